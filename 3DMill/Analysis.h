@@ -0,0 +1,1138 @@
+// position analysis for clients: the best move, how good a position is and whether the side to move can force a win.
+// searches run on their own pool of threads, so neither the network thread nor a room ever waits for one. Requests
+// wait in priority lanes (players in a live game before post-game review), each has a node and time budget and can be
+// cancelled, and results are cached by the position with the board's symmetries taken out.
+#ifndef ANALYSIS_H
+#define ANALYSIS_H
+
+#include <stdint.h>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <iostream>
+
+#include "Tools.h"
+#include "Rules.h"
+#include "Metrics.h"
+#include "Transport.h"
+
+// lane 0 is players in a live game, lane 1 is review. Review is only searched when no live game is waiting.
+const int ANALYSIS_LANES = 2;
+
+// the most a request in each lane can ask for
+const uint32 ANALYSIS_MAX_NODES[ANALYSIS_LANES] = { 200000, 2000000 };
+const int ANALYSIS_MAX_MILLIS[ANALYSIS_LANES] = { 250, 3000 };
+
+// requests waiting in one lane, and waiting or running for one connection, before more are turned away
+const int ANALYSIS_QUEUE_LIMIT = 256;
+const int ANALYSIS_MAX_PER_CONNECTION = 4;
+
+// positions kept in the result cache
+const size_t ANALYSIS_CACHE_SIZE = 65536;
+
+// entries in each search thread's table of positions already searched (a power of two)
+const size_t ANALYSIS_TABLE_SIZE = 1 << 18;
+
+// deepest a search goes, in plies
+const int ANALYSIS_MAX_PLY = 32;
+
+// score of a won position (less the plies it takes to win it). Anything past ANALYSIS_WIN_BOUND is a forced result.
+const int ANALYSIS_WIN_SCORE = 100000;
+const int ANALYSIS_WIN_BOUND = ANALYSIS_WIN_SCORE - ANALYSIS_MAX_PLY - 1;
+
+// the board's fixed geometry: the slots that hold pieces, the lines that make a mill, where a piece can move to,
+// and the 96 ways to turn or mirror the board (the cubes together, and the order of the cubes) that change none of that
+struct AnalysisTables {
+	static const int NUM_SYMMETRIES = 96;
+
+	int numSlots = 0;
+	int slots[BOARD_SLOTS];
+
+	int numLines = 0;
+	int lines[48][3];
+
+	// lines through each slot
+	int numSlotLines[BOARD_SLOTS];
+	int slotLines[BOARD_SLOTS][4];
+
+	// slots a piece can move to without flying: along a cube edge, or to the next cube from the middle of an edge
+	int numNeighbours[BOARD_SLOTS];
+	int neighbours[BOARD_SLOTS][6];
+
+	// where each slot ends up under a symmetry, and where it came from
+	int symmetry[NUM_SYMMETRIES][BOARD_SLOTS];
+	int inverse[NUM_SYMMETRIES][BOARD_SLOTS];
+
+	AnalysisTables() {
+		for (int slot = 0; slot < BOARD_SLOTS; slot++) {
+			int c, x, y, z;
+			slotCoord(slot, c, x, y, z);
+			if (!Rules::isHole(x, y, z)) {
+				slots[numSlots++] = slot;
+			}
+			numSlotLines[slot] = 0;
+			numNeighbours[slot] = 0;
+		}
+
+		// the edges of each cube
+		for (int c = 0; c < 3; c++) {
+			for (int axis = 0; axis < 3; axis++) {
+				for (int a = 0; a <= 2; a += 2) {
+					for (int b = 0; b <= 2; b += 2) {
+						for (int i = 0; i < 3; i++) {
+							int p[3];
+							p[axis] = i;
+							p[(axis + 1) % 3] = a;
+							p[(axis + 2) % 3] = b;
+							lines[numLines][i] = slotIndex(c, p[0], p[1], p[2]);
+						}
+						numLines++;
+					}
+				}
+			}
+		}
+
+		// the middle of an edge through all three cubes
+		for (int x = 0; x < 3; x++) {
+			for (int y = 0; y < 3; y++) {
+				for (int z = 0; z < 3; z++) {
+					if ((x == 1) + (y == 1) + (z == 1) != 1) {
+						continue;
+					}
+					for (int c = 0; c < 3; c++) {
+						lines[numLines][c] = slotIndex(c, x, y, z);
+					}
+					numLines++;
+				}
+			}
+		}
+
+		for (int line = 0; line < numLines; line++) {
+			for (int i = 0; i < 3; i++) {
+				int slot = lines[line][i];
+				slotLines[slot][numSlotLines[slot]++] = line;
+			}
+		}
+
+		for (int i = 0; i < numSlots; i++) {
+			int slot = slots[i];
+			int c, p[3];
+			slotCoord(slot, c, p[0], p[1], p[2]);
+
+			for (int axis = 0; axis < 3; axis++) {
+				for (int d = -1; d <= 1; d += 2) {
+					int q[3] = { p[0], p[1], p[2] };
+					q[axis] += d;
+					if (q[axis] >= 0 && q[axis] <= 2 && !Rules::isHole(q[0], q[1], q[2])) {
+						neighbours[slot][numNeighbours[slot]++] = slotIndex(c, q[0], q[1], q[2]);
+					}
+				}
+			}
+
+			if (p[0] == 1 || p[1] == 1 || p[2] == 1) {
+				for (int d = -1; d <= 1; d += 2) {
+					if (c + d >= 0 && c + d <= 2) {
+						neighbours[slot][numNeighbours[slot]++] = slotIndex(c + d, p[0], p[1], p[2]);
+					}
+				}
+			}
+		}
+
+		// every order of the axes, mirrored along any of them, with the cubes in either order
+		int perm[3] = { 0, 1, 2 };
+		int index = 0;
+		do {
+			for (int flips = 0; flips < 8; flips++) {
+				for (int flipCubes = 0; flipCubes < 2; flipCubes++) {
+					for (int slot = 0; slot < BOARD_SLOTS; slot++) {
+						int c, p[3];
+						slotCoord(slot, c, p[0], p[1], p[2]);
+
+						int q[3];
+						for (int axis = 0; axis < 3; axis++) {
+							q[axis] = (flips & (1 << axis)) ? 2 - p[perm[axis]] : p[perm[axis]];
+						}
+
+						int moved = slotIndex(flipCubes ? 2 - c : c, q[0], q[1], q[2]);
+						symmetry[index][slot] = moved;
+						inverse[index][moved] = slot;
+					}
+					index++;
+				}
+			}
+		} while (std::next_permutation(perm, perm + 3));
+	}
+};
+
+// shared tables, built once per process
+inline const AnalysisTables &analysisTables() {
+	static const AnalysisTables tables;
+	return tables;
+}
+
+// a piece from a slot (-1 from the reserve) to a slot, then the opponent's pieces it takes for every mill it closed
+struct AnalysisMove {
+	int8 from = -1;
+	int8 to = -1;
+	int8 numTaken = 0;
+	int8 taken[3] = { -1, -1, -1 };
+
+	bool operator==(const AnalysisMove &other) const {
+		return from == other.from && to == other.to && numTaken == other.numTaken &&
+			taken[0] == other.taken[0] && taken[1] == other.taken[1] && taken[2] == other.taken[2];
+	}
+};
+
+// the parts of a game state the search needs, in the packet's board values
+struct AnalysisPosition {
+	int8 board[BOARD_SLOTS];
+
+	// by color (1 red, 2 blue)
+	int reserve[3] = { 0, 0, 0 };
+	int onBoard[3] = { 0, 0, 0 };
+	int turn = Rules::RED;
+
+	// zobrist hash of the board, kept up to date by every move
+	uint64 boardHash = 0;
+
+	// false if the packet can't be a position of this game
+	bool FromPacket(const DataPacket &data) {
+		if ((data.currentTurn != Rules::RED && data.currentTurn != Rules::BLUE) ||
+			data.piecesLeft1 < 0 || data.piecesLeft1 > 23 || data.piecesLeft2 < 0 || data.piecesLeft2 > 23) {
+			return false;
+		}
+
+		reserve[Rules::RED] = data.piecesLeft1;
+		reserve[Rules::BLUE] = data.piecesLeft2;
+		onBoard[Rules::RED] = 0;
+		onBoard[Rules::BLUE] = 0;
+		turn = data.currentTurn;
+
+		for (int slot = 0; slot < BOARD_SLOTS; slot++) {
+			int c, x, y, z;
+			slotCoord(slot, c, x, y, z);
+			int value = data.board[c][x][y][z];
+
+			if (Rules::isHole(x, y, z)) {
+				board[slot] = Rules::EMPTY;
+				continue;
+			}
+			if (value != Rules::NONE && value != Rules::RED && value != Rules::BLUE) {
+				return false;
+			}
+			board[slot] = (int8)value;
+			if (value != Rules::NONE) {
+				onBoard[value]++;
+			}
+		}
+
+		boardHash = 0;
+		for (int slot = 0; slot < BOARD_SLOTS; slot++) {
+			boardHash ^= zobrist().slotKey(slot, board[slot]);
+		}
+		return true;
+	}
+
+	uint64 Hash() const {
+		return boardHash ^ zobrist().hashCounters(0, 0, reserve[Rules::RED], reserve[Rules::BLUE], turn);
+	}
+
+	// the hash this position would have after a symmetry
+	uint64 TransformedHash(int symmetry) const {
+		const AnalysisTables &tables = analysisTables();
+		uint64 hash = 0;
+		for (int slot = 0; slot < BOARD_SLOTS; slot++) {
+			hash ^= zobrist().slotKey(tables.symmetry[symmetry][slot], board[slot]);
+		}
+		return hash ^ zobrist().hashCounters(0, 0, reserve[Rules::RED], reserve[Rules::BLUE], turn);
+	}
+
+	// this position turned or mirrored
+	void Transform(const AnalysisPosition &from, int symmetry) {
+		const AnalysisTables &tables = analysisTables();
+		*this = from;
+		for (int slot = 0; slot < BOARD_SLOTS; slot++) {
+			board[tables.symmetry[symmetry][slot]] = from.board[slot];
+		}
+
+		boardHash = 0;
+		for (int slot = 0; slot < BOARD_SLOTS; slot++) {
+			boardHash ^= zobrist().slotKey(slot, board[slot]);
+		}
+	}
+
+	// the symmetry that gives the lowest hash, so every turned or mirrored copy of a position ends up the same
+	int Canonical(uint64 &hash) const {
+		int best = 0;
+		hash = TransformedHash(0);
+		for (int symmetry = 1; symmetry < AnalysisTables::NUM_SYMMETRIES; symmetry++) {
+			uint64 transformed = TransformedHash(symmetry);
+			if (transformed < hash) {
+				hash = transformed;
+				best = symmetry;
+			}
+		}
+		return best;
+	}
+
+	// whether the piece on a slot is part of a mill
+	bool InMill(int slot) const {
+		const AnalysisTables &tables = analysisTables();
+		int color = board[slot];
+		for (int i = 0; i < tables.numSlotLines[slot]; i++) {
+			const int *line = tables.lines[tables.slotLines[slot][i]];
+			if (board[line[0]] == color && board[line[1]] == color && board[line[2]] == color) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// mills the piece on a slot closes
+	int MillsThrough(int slot) const {
+		const AnalysisTables &tables = analysisTables();
+		int color = board[slot];
+		int mills = 0;
+		for (int i = 0; i < tables.numSlotLines[slot]; i++) {
+			const int *line = tables.lines[tables.slotLines[slot][i]];
+			if (board[line[0]] == color && board[line[1]] == color && board[line[2]] == color) {
+				mills++;
+			}
+		}
+		return mills;
+	}
+
+	void Set(int slot, int value) {
+		boardHash ^= zobrist().slotKey(slot, board[slot]) ^ zobrist().slotKey(slot, value);
+		board[slot] = (int8)value;
+	}
+
+	void MakeMove(const AnalysisMove &move) {
+		int me = turn;
+		int opponent = 3 - me;
+
+		if (move.from < 0) {
+			reserve[me]--;
+			onBoard[me]++;
+		}
+		else {
+			Set(move.from, Rules::NONE);
+		}
+		Set(move.to, me);
+
+		for (int i = 0; i < move.numTaken; i++) {
+			Set(move.taken[i], Rules::NONE);
+		}
+		onBoard[opponent] -= move.numTaken;
+
+		turn = opponent;
+	}
+
+	void UnmakeMove(const AnalysisMove &move) {
+		int opponent = turn;
+		int me = 3 - opponent;
+
+		for (int i = 0; i < move.numTaken; i++) {
+			Set(move.taken[i], opponent);
+		}
+		onBoard[opponent] += move.numTaken;
+
+		Set(move.to, Rules::NONE);
+		if (move.from < 0) {
+			reserve[me]++;
+			onBoard[me]--;
+		}
+		else {
+			Set(move.from, me);
+		}
+
+		turn = me;
+	}
+
+	// the side to move lost (less than three pieces left on the board and in reserve)
+	bool Lost() const {
+		return reserve[turn] + onBoard[turn] < 3;
+	}
+
+	// every move of the side to move. Like GameManager: place from the reserve or move a piece along the board (anywhere
+	// once a player is down to three), and each mill closed takes one of the opponent's pieces that isn't in a mill.
+	void GenerateMoves(std::vector<AnalysisMove> &moves) {
+		const AnalysisTables &tables = analysisTables();
+		int me = turn;
+		bool flying = onBoard[me] + reserve[me] <= 3;
+
+		moves.clear();
+		for (int i = 0; i < tables.numSlots; i++) {
+			int to = tables.slots[i];
+			if (board[to] != Rules::NONE) {
+				continue;
+			}
+
+			if (reserve[me] > 0) {
+				AddMove(moves, -1, to);
+			}
+
+			if (flying) {
+				for (int j = 0; j < tables.numSlots; j++) {
+					if (board[tables.slots[j]] == me) {
+						AddMove(moves, tables.slots[j], to);
+					}
+				}
+			}
+			else {
+				for (int j = 0; j < tables.numNeighbours[to]; j++) {
+					int from = tables.neighbours[to][j];
+					if (board[from] == me) {
+						AddMove(moves, from, to);
+					}
+				}
+			}
+		}
+	}
+
+	void AddMove(std::vector<AnalysisMove> &moves, int from, int to) {
+		int me = turn;
+
+		if (from >= 0) {
+			board[from] = Rules::NONE;
+		}
+		board[to] = (int8)me;
+		int mills = MillsThrough(to);
+
+		AnalysisMove move;
+		move.from = (int8)from;
+		move.to = (int8)to;
+
+		if (mills == 0) {
+			moves.push_back(move);
+		}
+		else {
+			// the opponent's pieces that can be taken don't change as they are taken, since none are in a mill
+			const AnalysisTables &tables = analysisTables();
+			int takeable[BOARD_SLOTS];
+			int numTakeable = 0;
+			for (int i = 0; i < tables.numSlots; i++) {
+				int slot = tables.slots[i];
+				if (board[slot] == 3 - me && !InMill(slot)) {
+					takeable[numTakeable++] = slot;
+				}
+			}
+
+			move.numTaken = (int8)(mills < numTakeable ? mills : numTakeable);
+			AddTakes(moves, move, takeable, numTakeable, 0, 0);
+		}
+
+		board[to] = Rules::NONE;
+		if (from >= 0) {
+			board[from] = (int8)me;
+		}
+	}
+
+	// every set of move.numTaken pieces out of takeable (in slot order, so each set is only made once)
+	static void AddTakes(std::vector<AnalysisMove> &moves, AnalysisMove &move, const int *takeable, int numTakeable, int first, int count) {
+		if (count == move.numTaken) {
+			moves.push_back(move);
+			return;
+		}
+		for (int i = first; i <= numTakeable - (move.numTaken - count); i++) {
+			move.taken[count] = (int8)takeable[i];
+			AddTakes(moves, move, takeable, numTakeable, i + 1, count + 1);
+		}
+		move.taken[count] = -1;
+	}
+
+	// for the side to move: 100 per piece ahead, plus lines a player can close next move
+	int Evaluate() const {
+		const AnalysisTables &tables = analysisTables();
+		int me = turn;
+		int opponent = 3 - me;
+
+		int score = (reserve[me] + onBoard[me] - reserve[opponent] - onBoard[opponent]) * 100;
+		for (int line = 0; line < tables.numLines; line++) {
+			int mine = 0, theirs = 0, empty = 0;
+			for (int i = 0; i < 3; i++) {
+				int value = board[tables.lines[line][i]];
+				if (value == me) {
+					mine++;
+				}
+				else if (value == opponent) {
+					theirs++;
+				}
+				else {
+					empty++;
+				}
+			}
+
+			// it's our move, so our open lines are worth more than theirs
+			if (mine == 2 && empty == 1) {
+				score += 30;
+			}
+			else if (theirs == 2 && empty == 1) {
+				score -= 20;
+			}
+		}
+		return score;
+	}
+};
+
+// iterative deepening alpha-beta search. One per thread, the table of positions is kept between searches.
+class AnalysisSearch {
+public:
+	struct Limits {
+		uint64 maxNodes = 0;
+		std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+
+		// the search stops as soon as it sees this set (nullptr if it can't be cancelled)
+		const std::atomic<int> *cancel = nullptr;
+
+		// only look for a forced win for the side to move, which cuts off far more of the tree
+		bool forcedWinOnly = false;
+	};
+
+	struct Result {
+		int score = 0;
+		int forcedWin = 0;
+		// plies of the last search that finished
+		int depth = 0;
+		uint64 nodes = 0;
+
+		bool haveMove = false;
+		AnalysisMove best;
+
+		// stopped by the limits rather than running out of plies or finding a forced result
+		bool stopped = false;
+	};
+
+	AnalysisSearch() : table(ANALYSIS_TABLE_SIZE) {
+	}
+
+	Result Search(const AnalysisPosition &position, const Limits &searchLimits) {
+		pos = position;
+		limits = searchLimits;
+		nodes = 0;
+		stopped = false;
+
+		Result result;
+		if (pos.Lost()) {
+			// already lost, there is nothing to search
+			result.score = -ANALYSIS_WIN_SCORE;
+			return result;
+		}
+
+		std::vector<AnalysisMove> &rootMoves = moveStack[0];
+		pos.GenerateMoves(rootMoves);
+		if (rootMoves.empty()) {
+			// stuck, the game can't go on
+			return result;
+		}
+
+		// something to answer with even if the first search is cut short
+		std::stable_partition(rootMoves.begin(), rootMoves.end(), [](const AnalysisMove &move) { return move.numTaken > 0; });
+		result.haveMove = true;
+		result.best = rootMoves[0];
+		result.score = pos.Evaluate();
+
+		for (int depth = 1; depth <= ANALYSIS_MAX_PLY; depth++) {
+			int alpha = limits.forcedWinOnly ? ANALYSIS_WIN_BOUND - 1 : -ANALYSIS_WIN_SCORE - 1;
+			int beta = limits.forcedWinOnly ? ANALYSIS_WIN_BOUND : ANALYSIS_WIN_SCORE + 1;
+
+			int best = -ANALYSIS_WIN_SCORE - 1;
+			int bestIndex = 0;
+			for (int i = 0; i < rootMoves.size(); i++) {
+				pos.MakeMove(rootMoves[i]);
+				int score = -Negamax(depth - 1, 1, -beta, -(best > alpha ? best : alpha));
+				pos.UnmakeMove(rootMoves[i]);
+
+				if (stopped) {
+					break;
+				}
+				if (score > best) {
+					best = score;
+					bestIndex = i;
+				}
+				if (best >= beta) {
+					break;
+				}
+			}
+			if (stopped) {
+				result.stopped = true;
+				break;
+			}
+
+			// the best move is searched first next time
+			std::rotate(rootMoves.begin(), rootMoves.begin() + bestIndex, rootMoves.begin() + bestIndex + 1);
+			result.depth = depth;
+			result.best = rootMoves[0];
+
+			if (limits.forcedWinOnly) {
+				if (best >= ANALYSIS_WIN_BOUND) {
+					result.score = best;
+					result.forcedWin = depth;
+					break;
+				}
+				continue;
+			}
+
+			result.score = best;
+			if (best >= ANALYSIS_WIN_BOUND || best <= -ANALYSIS_WIN_BOUND) {
+				result.forcedWin = best > 0 ? ANALYSIS_WIN_SCORE - best : -(ANALYSIS_WIN_SCORE + best);
+				break;
+			}
+		}
+
+		result.nodes = nodes;
+		return result;
+	}
+
+private:
+	enum Bound : uint8 { EXACT, LOWER, UPPER };
+
+	struct Entry {
+		uint64 key = 0;
+		int score = 0;
+		int8 depth = -1;
+		Bound bound = EXACT;
+		AnalysisMove best;
+	};
+
+	std::vector<Entry> table;
+	std::vector<AnalysisMove> moveStack[ANALYSIS_MAX_PLY + 1];
+
+	AnalysisPosition pos;
+	Limits limits;
+	uint64 nodes = 0;
+	bool stopped = false;
+
+	int Negamax(int depth, int ply, int alpha, int beta) {
+		nodes++;
+		if (nodes >= limits.maxNodes) {
+			stopped = true;
+		}
+		else if ((nodes & 1023) == 0 &&
+			(std::chrono::steady_clock::now() >= limits.deadline || (limits.cancel != nullptr && limits.cancel->load(std::memory_order_relaxed) != 0))) {
+			stopped = true;
+		}
+		if (stopped) {
+			return 0;
+		}
+
+		if (pos.Lost()) {
+			return -(ANALYSIS_WIN_SCORE - ply);
+		}
+		if (depth <= 0 || ply >= ANALYSIS_MAX_PLY) {
+			return pos.Evaluate();
+		}
+
+		uint64 key = pos.Hash();
+		Entry &entry = table[key & (table.size() - 1)];
+		bool haveHashMove = false;
+		if (entry.key == key) {
+			haveHashMove = entry.best.to >= 0;
+			if (entry.depth >= depth) {
+				int score = FromTable(entry.score, ply);
+				if (entry.bound == EXACT || (entry.bound == LOWER && score >= beta) || (entry.bound == UPPER && score <= alpha)) {
+					return score;
+				}
+			}
+		}
+
+		std::vector<AnalysisMove> &moves = moveStack[ply];
+		pos.GenerateMoves(moves);
+		if (moves.empty()) {
+			return 0;
+		}
+
+		// the best move last time first, then moves that take a piece
+		std::stable_partition(moves.begin(), moves.end(), [](const AnalysisMove &move) { return move.numTaken > 0; });
+		if (haveHashMove) {
+			auto it = std::find(moves.begin(), moves.end(), entry.best);
+			if (it != moves.end()) {
+				std::rotate(moves.begin(), it, it + 1);
+			}
+		}
+
+		int originalAlpha = alpha;
+		int best = -ANALYSIS_WIN_SCORE - 1;
+		AnalysisMove bestMove = moves[0];
+		for (int i = 0; i < moves.size(); i++) {
+			pos.MakeMove(moves[i]);
+			int score = -Negamax(depth - 1, ply + 1, -beta, -alpha);
+			pos.UnmakeMove(moves[i]);
+
+			if (stopped) {
+				return 0;
+			}
+			if (score > best) {
+				best = score;
+				bestMove = moves[i];
+			}
+			if (best > alpha) {
+				alpha = best;
+			}
+			if (alpha >= beta) {
+				break;
+			}
+		}
+
+		// the entry may have been replaced by a deeper search, that's fine, it is only a hint
+		Entry &store = table[key & (table.size() - 1)];
+		store.key = key;
+		store.score = ToTable(best, ply);
+		store.depth = (int8)depth;
+		store.bound = best <= originalAlpha ? UPPER : best >= beta ? LOWER : EXACT;
+		store.best = bestMove;
+		return best;
+	}
+
+	// wins are stored as plies from the position, not from the root
+	static int ToTable(int score, int ply) {
+		return score >= ANALYSIS_WIN_BOUND ? score + ply : score <= -ANALYSIS_WIN_BOUND ? score - ply : score;
+	}
+
+	static int FromTable(int score, int ply) {
+		return score >= ANALYSIS_WIN_BOUND ? score - ply : score <= -ANALYSIS_WIN_BOUND ? score + ply : score;
+	}
+};
+
+// the analysis threads. Requests are handed over by the network thread, which never waits for a search: anything in
+// the cache is answered straight away and everything else is queued. Answers are sent from the analysis threads.
+class AnalysisPool {
+public:
+	// counters since the start. Read by the server console.
+	std::atomic<uint64> requests{ 0 };
+	std::atomic<uint64> cacheHits{ 0 };
+	std::atomic<uint64> searches{ 0 };
+	std::atomic<uint64> nodesSearched{ 0 };
+	// turned away because the lanes or the connection were full (or analysis is off)
+	std::atomic<uint64> rejected{ 0 };
+	std::atomic<uint64> cancelled{ 0 };
+
+	// time (us) a request waited for a thread, and spent being searched
+	LatencyHistogram waitTime;
+	LatencyHistogram searchTime;
+
+	// every answer sent
+	MessageCounters sent;
+
+	~AnalysisPool() {
+		Stop();
+	}
+
+	void Start(int numThreads, Transport *transport) {
+		m_pTransport = transport;
+		running = true;
+		for (int i = 0; i < numThreads; i++) {
+			threads.push_back(std::thread(&AnalysisPool::Run, this));
+		}
+	}
+
+	// searches still running are stopped, nothing queued is answered
+	void Stop() {
+		{
+			std::lock_guard<std::mutex> lock(mutexJobs);
+			running = false;
+			for (int lane = 0; lane < ANALYSIS_LANES; lane++) {
+				lanes[lane].clear();
+			}
+			for (int i = 0; i < active.size(); i++) {
+				active[i]->cancel = CANCEL_SILENT;
+			}
+			outstanding.clear();
+		}
+		jobsCondition.notify_all();
+
+		for (int i = 0; i < threads.size(); i++) {
+			threads[i].join();
+		}
+		threads.clear();
+	}
+
+	int Threads() const {
+		return (int)threads.size();
+	}
+
+	// requests waiting for a thread
+	int Waiting() {
+		std::lock_guard<std::mutex> lock(mutexJobs);
+		return (int)(lanes[0].size() + lanes[1].size());
+	}
+
+	// called from the network thread
+	void Submit(HSteamNetConnection conn, const AnalysisRequestPacket &request) {
+		if (request.kind == AnalysisRequestPacket::CANCEL) {
+			Cancel(conn, request.requestId);
+			return;
+		}
+		requests++;
+
+		AnalysisResultPacket answer;
+		answer.requestId = request.requestId;
+		answer.kind = request.kind;
+
+		AnalysisPosition position;
+		if (request.kind < AnalysisRequestPacket::BEST_MOVE || request.kind > AnalysisRequestPacket::FORCED_WIN || !position.FromPacket(request.position)) {
+			answer.status = AnalysisResultPacket::BAD_POSITION;
+			Send(conn, answer);
+			return;
+		}
+
+		std::shared_ptr<Job> job = std::make_shared<Job>();
+		job->conn = conn;
+		job->requestId = request.requestId;
+		job->kind = request.kind;
+		job->lane = request.lane == 1 ? 1 : 0;
+		job->maxNodes = request.maxNodes > 0 && request.maxNodes < ANALYSIS_MAX_NODES[job->lane] ? request.maxNodes : ANALYSIS_MAX_NODES[job->lane];
+		job->maxMillis = request.maxMillis > 0 && request.maxMillis < ANALYSIS_MAX_MILLIS[job->lane] ? request.maxMillis : ANALYSIS_MAX_MILLIS[job->lane];
+
+		// searched the way round with the lowest hash, so a turned or mirrored copy finds it in the cache
+		uint64 hash;
+		job->symmetry = position.Canonical(hash);
+		job->position.Transform(position, job->symmetry);
+		job->key = CacheKey(hash, job->kind);
+
+		{
+			std::lock_guard<std::mutex> lock(mutexJobs);
+
+			auto itCache = cache.find(job->key);
+			if (itCache != cache.end() && (itCache->second.proven || itCache->second.maxNodes >= job->maxNodes)) {
+				FillAnswer(answer, itCache->second, job->symmetry);
+				answer.cached = true;
+				cacheHits++;
+			}
+			else if (!running || threads.empty() || lanes[job->lane].size() >= ANALYSIS_QUEUE_LIMIT || outstanding[conn] >= ANALYSIS_MAX_PER_CONNECTION) {
+				answer.status = AnalysisResultPacket::BUSY;
+				rejected++;
+			}
+			else {
+				job->queuedAt = std::chrono::steady_clock::now();
+				lanes[job->lane].push_back(job);
+				outstanding[conn]++;
+				job = nullptr;
+			}
+		}
+
+		if (job == nullptr) {
+			jobsCondition.notify_one();
+			return;
+		}
+		Send(conn, answer);
+	}
+
+	// the connection is gone. Its requests are dropped without an answer.
+	void CancelConnection(HSteamNetConnection conn) {
+		std::lock_guard<std::mutex> lock(mutexJobs);
+		for (int lane = 0; lane < ANALYSIS_LANES; lane++) {
+			for (int i = (int)lanes[lane].size() - 1; i >= 0; i--) {
+				if (lanes[lane][i]->conn == conn) {
+					lanes[lane].erase(lanes[lane].begin() + i);
+					cancelled++;
+				}
+			}
+		}
+		for (int i = 0; i < active.size(); i++) {
+			if (active[i]->conn == conn) {
+				active[i]->cancel = CANCEL_SILENT;
+			}
+		}
+		outstanding.erase(conn);
+	}
+
+	// search random positions from random games, then the same positions turned or mirrored to check they come
+	// out of the cache
+	static void Benchmark(int numPositions, uint32 maxNodes) {
+		if (numPositions <= 0) {
+			return;
+		}
+
+		std::mt19937 rng(1);
+		std::vector<AnalysisPosition> positions;
+		std::vector<AnalysisMove> moves;
+		while (positions.size() < numPositions) {
+			DataPacket start = Rules::newGame();
+			AnalysisPosition position;
+			position.FromPacket(start);
+
+			int plies = std::uniform_int_distribution<int>(4, 60)(rng);
+			for (int i = 0; i < plies && !position.Lost(); i++) {
+				position.GenerateMoves(moves);
+				if (moves.empty()) {
+					break;
+				}
+				position.MakeMove(moves[std::uniform_int_distribution<int>(0, (int)moves.size() - 1)(rng)]);
+			}
+			if (!position.Lost()) {
+				positions.push_back(position);
+			}
+		}
+
+		AnalysisSearch search;
+		AnalysisSearch::Limits limits;
+		limits.maxNodes = maxNodes;
+
+		std::unordered_map<uint64, int> cached;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		uint64 nodes = 0;
+		int depths = 0;
+		int forced = 0;
+		for (int i = 0; i < positions.size(); i++) {
+			uint64 hash;
+			AnalysisPosition canonical;
+			canonical.Transform(positions[i], positions[i].Canonical(hash));
+
+			AnalysisSearch::Result result = search.Search(canonical, limits);
+			nodes += result.nodes;
+			depths += result.depth;
+			if (result.forcedWin != 0) {
+				forced++;
+			}
+			cached[hash] = i;
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		std::cout << "Searched " << positions.size() << " positions with " << maxNodes << " nodes each in " << seconds * 1000.0 << " ms (" <<
+			nodes / seconds << " nodes/sec). Average depth " << (double)depths / positions.size() << " plies, " << forced <<
+			" forced wins or losses found" << std::endl;
+
+		int hits = 0;
+		start = std::chrono::steady_clock::now();
+		for (int i = 0; i < positions.size(); i++) {
+			AnalysisPosition turned;
+			turned.Transform(positions[i], std::uniform_int_distribution<int>(0, AnalysisTables::NUM_SYMMETRIES - 1)(rng));
+
+			uint64 hash;
+			turned.Canonical(hash);
+			auto it = cached.find(hash);
+			if (it != cached.end() && it->second == i) {
+				hits++;
+			}
+		}
+		seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		std::cout << hits << " of " << positions.size() << " turned or mirrored positions found in the cache, " <<
+			seconds * 1000000.0 / positions.size() << " us per lookup" << std::endl;
+	}
+
+private:
+	// a search that is stopped early either tells the client (it asked) or doesn't (it is gone)
+	enum Cancel { CANCEL_NONE, CANCEL_REPLY, CANCEL_SILENT };
+
+	struct Job {
+		HSteamNetConnection conn;
+		uint32 requestId;
+		int kind;
+		int lane;
+		uint32 maxNodes;
+		int maxMillis;
+
+		// the position as searched, and the symmetry that turned the client's position into it
+		AnalysisPosition position;
+		int symmetry;
+		uint64 key;
+
+		std::chrono::steady_clock::time_point queuedAt;
+		std::atomic<int> cancel{ CANCEL_NONE };
+	};
+
+	// a finished search, in the canonical position's slots
+	struct CachedResult {
+		int score;
+		int forcedWin;
+		int depth;
+		uint64 nodes;
+		bool haveMove;
+		AnalysisMove best;
+
+		// the node budget it was searched with. A forced result holds for any budget.
+		uint32 maxNodes;
+		bool proven;
+	};
+
+	Transport *m_pTransport = nullptr;
+	std::vector<std::thread> threads;
+
+	// guards everything below
+	std::mutex mutexJobs;
+	std::condition_variable jobsCondition;
+	bool running = false;
+	std::deque<std::shared_ptr<Job>> lanes[ANALYSIS_LANES];
+	// being searched right now, so they can be cancelled
+	std::vector<std::shared_ptr<Job>> active;
+	// requests waiting or being searched for each connection
+	std::unordered_map<HSteamNetConnection, int> outstanding;
+
+	std::unordered_map<uint64, CachedResult> cache;
+	// oldest first, the first to go once the cache is full
+	std::deque<uint64> cacheOrder;
+
+	// a forced win check is a different search from a full one
+	static uint64 CacheKey(uint64 hash, int kind) {
+		return kind == AnalysisRequestPacket::FORCED_WIN ? Zobrist::mix(hash ^ 0x464F524345445749ULL) : hash;
+	}
+
+	void Cancel(HSteamNetConnection conn, uint32 requestId) {
+		bool found = false;
+		{
+			std::lock_guard<std::mutex> lock(mutexJobs);
+			for (int lane = 0; lane < ANALYSIS_LANES && !found; lane++) {
+				for (int i = 0; i < lanes[lane].size(); i++) {
+					if (lanes[lane][i]->conn == conn && lanes[lane][i]->requestId == requestId) {
+						lanes[lane].erase(lanes[lane].begin() + i);
+						Finished(conn);
+						found = true;
+						break;
+					}
+				}
+			}
+
+			// a running search answers for itself once it stops
+			for (int i = 0; i < active.size(); i++) {
+				if (active[i]->conn == conn && active[i]->requestId == requestId) {
+					active[i]->cancel = CANCEL_REPLY;
+					return;
+				}
+			}
+		}
+
+		if (found) {
+			cancelled++;
+
+			AnalysisResultPacket answer;
+			answer.status = AnalysisResultPacket::CANCELLED;
+			answer.requestId = requestId;
+			Send(conn, answer);
+		}
+	}
+
+	// called with mutexJobs held
+	void Finished(HSteamNetConnection conn) {
+		auto it = outstanding.find(conn);
+		if (it != outstanding.end() && --it->second <= 0) {
+			outstanding.erase(it);
+		}
+	}
+
+	void Run() {
+		AnalysisSearch search;
+
+		while (true) {
+			std::shared_ptr<Job> job;
+			{
+				std::unique_lock<std::mutex> lock(mutexJobs);
+				jobsCondition.wait(lock, [this] { return !running || !lanes[0].empty() || !lanes[1].empty(); });
+				if (!running) {
+					break;
+				}
+
+				// live games first
+				int lane = lanes[0].empty() ? 1 : 0;
+				job = lanes[lane].front();
+				lanes[lane].pop_front();
+				active.push_back(job);
+			}
+
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			waitTime.record(std::chrono::duration_cast<std::chrono::microseconds>(start - job->queuedAt).count());
+
+			AnalysisSearch::Limits limits;
+			limits.maxNodes = job->maxNodes;
+			limits.deadline = start + std::chrono::milliseconds(job->maxMillis);
+			limits.cancel = &job->cancel;
+			limits.forcedWinOnly = job->kind == AnalysisRequestPacket::FORCED_WIN;
+			AnalysisSearch::Result result = search.Search(job->position, limits);
+
+			searchTime.record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+			searches++;
+			nodesSearched += result.nodes;
+
+			CachedResult entry;
+			entry.score = result.score;
+			entry.forcedWin = result.forcedWin;
+			entry.depth = result.depth;
+			entry.nodes = result.nodes;
+			entry.haveMove = result.haveMove;
+			entry.best = result.best;
+			entry.maxNodes = job->maxNodes;
+			entry.proven = !result.stopped;
+
+			int cancel;
+			{
+				std::lock_guard<std::mutex> lock(mutexJobs);
+				active.erase(std::find(active.begin(), active.end(), job));
+				cancel = job->cancel;
+				if (cancel != CANCEL_SILENT) {
+					Finished(job->conn);
+				}
+
+				// a cancelled search stopped early and is no good to anyone else
+				if (cancel == CANCEL_NONE) {
+					StoreLocked(job->key, entry);
+				}
+			}
+
+			AnalysisResultPacket answer;
+			answer.requestId = job->requestId;
+			answer.kind = job->kind;
+			if (cancel != CANCEL_NONE) {
+				cancelled++;
+				if (cancel == CANCEL_SILENT) {
+					continue;
+				}
+				answer.status = AnalysisResultPacket::CANCELLED;
+			}
+			else {
+				FillAnswer(answer, entry, job->symmetry);
+			}
+			Send(job->conn, answer);
+		}
+	}
+
+	// called with mutexJobs held
+	void StoreLocked(uint64 key, const CachedResult &entry) {
+		auto it = cache.find(key);
+		if (it != cache.end()) {
+			it->second = entry;
+			return;
+		}
+
+		cache[key] = entry;
+		cacheOrder.push_back(key);
+		if (cacheOrder.size() > ANALYSIS_CACHE_SIZE) {
+			cache.erase(cacheOrder.front());
+			cacheOrder.pop_front();
+		}
+	}
+
+	// the cached move is in the canonical position's slots, the client gets it in its own
+	static void FillAnswer(AnalysisResultPacket &answer, const CachedResult &entry, int symmetry) {
+		const AnalysisTables &tables = analysisTables();
+
+		answer.status = AnalysisResultPacket::DONE;
+		answer.score = entry.score;
+		answer.forcedWin = entry.forcedWin;
+		answer.depth = entry.depth;
+		answer.nodes = (uint32)entry.nodes;
+
+		if (entry.haveMove && answer.kind != AnalysisRequestPacket::EVALUATE) {
+			answer.from = entry.best.from >= 0 ? tables.inverse[symmetry][entry.best.from] : -1;
+			answer.to = tables.inverse[symmetry][entry.best.to];
+			for (int i = 0; i < 3; i++) {
+				answer.taken[i] = i < entry.best.numTaken ? tables.inverse[symmetry][entry.best.taken[i]] : -1;
+			}
+		}
+	}
+
+	void Send(HSteamNetConnection conn, const AnalysisResultPacket &answer) {
+		m_pTransport->SendMessageToConnection(conn, &answer, (uint32)sizeof(answer), k_nSteamNetworkingSend_Reliable);
+		sent.record(answer.type, sizeof(answer));
+	}
+};
+
+#endif
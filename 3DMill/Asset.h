@@ -55,6 +55,12 @@ public:
 	// make white gradient
 	Effect gradient;
 
+	// drawn in one call with every other instanced asset of the same model (board pieces), instead of on its own
+	bool instanced = false;
+
+	// drawn over the scene without the depth test (after everything else)
+	bool ui = false;
+
 	Asset() {
 
 	}
@@ -101,6 +107,7 @@ public:
 
 	void setPosition(glm::vec3 position) {
 		this->position = position;
+		transformDirty = true;
 	}
 
 	void setRotation(glm::vec3 rotation) {
@@ -126,10 +133,30 @@ public:
 		if (this->rotation.z < 0) {
 			this->rotation.z = 360 + this->rotation.z;
 		}
+
+		transformDirty = true;
 	}
 
 	void setScale(glm::vec3 scale) {
 		this->scale = scale;
+		transformDirty = true;
+	}
+
+	// world transform: translate, rotate around x, y then z, then scale.
+	// kept until setPosition, setRotation or setScale change it, so the board and pieces only build it once
+	const glm::mat4 &getModelMatrix() {
+		if (transformDirty) {
+			updateTransform();
+		}
+		return modelMatrix;
+	}
+
+	// turns the model's normals into world space (inverse transpose, so a scale that isn't even doesn't bend them)
+	const glm::mat3 &getNormalMatrix() {
+		if (transformDirty) {
+			updateTransform();
+		}
+		return normalMatrix;
 	}
 
 	// Note: override disables lighting effects for the object
@@ -147,19 +174,25 @@ public:
 		gradient.enabled = false;
 	}
 
+	// the shader has to be in use already (the graphics engine binds it once for every asset)
 	void updateEffects(Shader &shader) {
-		// set defaults
-		shader.use();
-		shader.setVec3("effectColor", glm::vec3(1));
-		shader.setFloat("effectColorStrength", 0);
+		glm::vec4 output = updateEffects();
+		shader.setVec3("effectColor", glm::vec3(output));
+		shader.setFloat("effectColorStrength", output.w);
+	}
 
-		if (gradient.enabled) {
-			updateGradientEffect(shader);
+	// advances the effects a frame and returns the effect color (rgb) and its strength (w)
+	glm::vec4 updateEffects() {
+		// set defaults
+		if (!gradient.enabled) {
+			return glm::vec4(1, 1, 1, 0);
 		}
+
+		return glm::vec4(updateGradientEffect(), gradient.colorStrength);
 	}
 
 	// returns output color of the gradient effect
-	void updateGradientEffect(Shader &shader) {
+	glm::vec3 updateGradientEffect() {
 		gradient.frame += gradient.speed;
 
 		if (gradient.frame > 1000 || gradient.frame < 0) {
@@ -174,9 +207,25 @@ public:
 		glm::vec3 output = (gradient.color - float(((255 - width) / 2) / 255)) * float((width/255) * (float(gradient.frame) / 1000)) + float(((255 - width) / 2) / 255);
 		// std::cout << to_string(output) << std::endl;
 
-		shader.use();
-		shader.setVec3("effectColor", output);
-		shader.setFloat("effectColorStrength", gradient.colorStrength);
+		return output;
+	}
+
+private:
+	glm::mat4 modelMatrix;
+	glm::mat3 normalMatrix;
+	bool transformDirty = true;
+
+	void updateTransform() {
+		modelMatrix = glm::mat4(1.0f);
+		modelMatrix = glm::translate(modelMatrix, position);
+		modelMatrix = glm::rotate(modelMatrix, glm::radians(rotation.x), glm::vec3(1.0, 0.0, 0.0));
+		modelMatrix = glm::rotate(modelMatrix, glm::radians(rotation.y), glm::vec3(0.0, 1.0, 0.0));
+		modelMatrix = glm::rotate(modelMatrix, glm::radians(rotation.z), glm::vec3(0.0, 0.0, 1.0));
+		modelMatrix = glm::scale(modelMatrix, scale);
+
+		normalMatrix = glm::transpose(glm::inverse(glm::mat3(modelMatrix)));
+
+		transformDirty = false;
 	}
 };
 
@@ -72,6 +72,8 @@ public:
 		// since the origin of the board is at the bottom center, we just find the bottom left corner and work relatively.
 		glm::vec3 pos = getPiecePosFromCoord(x,y,z,c);
 		data[c][x][y][z] = Piece(graphics, color, pos);
+		// pieces on the board are drawn together
+		data[c][x][y][z].asset->instanced = true;
 
 		return true;
 	}
@@ -174,29 +176,49 @@ public:
 		return data[(int)pos.w][(int)pos.x][(int)pos.y][(int)pos.z];
 	}
 
-	// sets all the board positons and current to whatever the datapacked says
-	void setBoardToData(DataPacket *datapacket) {
-		// std::cout << "set board to data" << std::endl;
-		clearBoard();
+	// replace whatever is in a slot with a new piece of the given color
+	void setPiece(Piece::Color color, int x, int y, int z, int c) {
+		Piece &piece = data[c][x][y][z];
+		if (graphics != nullptr) {
+			graphics->removeAsset(piece.asset);
+		}
+		delete piece.asset;
+
+		piece = Piece(graphics, color, getPiecePosFromCoord(x, y, z, c));
+		piece.asset->instanced = true;
+	}
+
+	// sets all the board positons and current to whatever the datapacked says.
+	// only slots that differ from the board are replaced, so an update that moves one piece only touches that piece.
+	// returns the number of slots changed.
+	int setBoardToData(DataPacket *datapacket) {
+		int changed = 0;
 		for (int c = 0; c < 3; c++) {
 			for (int x = 0; x < 3; x++) {
 				for (int y = 0; y < 3; y++) {
 					for (int z = 0; z < 3; z++) {
-						if (datapacket->board[c][x][y][z] == 0) {
-							addPiece(Piece::Color::NONE, x, y, z, c);
+						// holes in the center of the cubes never hold a piece
+						if (data[c][x][y][z].type == Piece::Color::EMPTY) {
+							continue;
 						}
+
+						Piece::Color color = Piece::Color::NONE;
 						if (datapacket->board[c][x][y][z] == 1) {
-							addPiece(Piece::Color::RED, x, y, z, c);
-							//std::cout << c << " " << x << " " << y << " " << z << std::endl;
+							color = Piece::Color::RED;
 						}
 						if (datapacket->board[c][x][y][z] == 2) {
-							addPiece(Piece::Color::BLUE, x, y, z, c);
-							//std::cout << c << " " << x << " " << y << " " << z << std::endl;
+							color = Piece::Color::BLUE;
+						}
+
+						if (data[c][x][y][z].type != color) {
+							setPiece(color, x, y, z, c);
+							changed++;
 						}
 					}
 				}
 			}
 		}
+		return changed;
 	}
 };
 
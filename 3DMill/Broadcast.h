@@ -0,0 +1,186 @@
+// sends one encoded message to many connections. The payload is copied once into a reference counted buffer
+// that every outgoing message points at, and the whole batch is handed to GameNetworkingSockets in one call.
+#ifndef BROADCAST_H
+#define BROADCAST_H
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <string.h>
+
+#include <GameNetworkingSockets/steam/steamnetworkingsockets.h>
+#include <GameNetworkingSockets/steam/isteamnetworkingutils.h>
+
+// buffers up to this size (header included) come from the pool, bigger ones are allocated every time
+const uint32 BUFFER_POOL_BLOCK = 1024;
+// most free blocks the pool holds on to
+const int BUFFER_POOL_MAX_FREE = 16384;
+
+// free list of fixed size blocks for message buffers. Blocks are taken by whoever sends and given back by whoever
+// frees the last message (the library does that from its own thread), so it is locked.
+// there is one for the whole process and it is never destroyed, so the library can free messages after everything else is gone.
+class BufferPool {
+public:
+	// blocks that had to be allocated and blocks that were reused
+	std::atomic<uint64> allocations{ 0 };
+	std::atomic<uint64> reuses{ 0 };
+
+	static BufferPool &Get() {
+		static BufferPool *pool = new BufferPool();
+		return *pool;
+	}
+
+	void *Take() {
+		{
+			std::lock_guard<std::mutex> lock(mutexFree);
+			if (!blocks.empty()) {
+				void *block = blocks.back();
+				blocks.pop_back();
+				reuses.fetch_add(1, std::memory_order_relaxed);
+				return block;
+			}
+		}
+
+		allocations.fetch_add(1, std::memory_order_relaxed);
+		return ::operator new(BUFFER_POOL_BLOCK);
+	}
+
+	void Give(void *block) {
+		{
+			std::lock_guard<std::mutex> lock(mutexFree);
+			if (blocks.size() < BUFFER_POOL_MAX_FREE) {
+				blocks.push_back(block);
+				return;
+			}
+		}
+		::operator delete(block);
+	}
+
+private:
+	std::mutex mutexFree;
+	std::vector<void*> blocks;
+};
+
+// header followed by the payload bytes in one allocation. Messages point at it through m_pData and keep it
+// in m_nUserData so FreeData can find it. The header is padded so the payload is aligned like any other allocation.
+struct alignas(16) SharedBuffer {
+	std::atomic<int> refs;
+
+	// the block came from BufferPool
+	bool pooled;
+
+	void *data() {
+		return this + 1;
+	}
+
+	// a buffer for size bytes that the caller fills in
+	static SharedBuffer *Allocate(uint32 size, int refs) {
+		bool pooled = sizeof(SharedBuffer) + size <= BUFFER_POOL_BLOCK;
+		void *memory;
+		if (pooled) {
+			memory = BufferPool::Get().Take();
+		}
+		else {
+			BufferPool::Get().allocations.fetch_add(1, std::memory_order_relaxed);
+			memory = ::operator new(sizeof(SharedBuffer) + size);
+		}
+
+		SharedBuffer *buffer = new (memory) SharedBuffer();
+		buffer->refs = refs;
+		buffer->pooled = pooled;
+		return buffer;
+	}
+
+	static SharedBuffer *Create(const void *data, uint32 size, int refs) {
+		SharedBuffer *buffer = Allocate(size, refs);
+		memcpy(buffer->data(), data, size);
+		return buffer;
+	}
+
+	// drop one reference without a message (for a message that was never sent)
+	void Release() {
+		if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			bool fromPool = pooled;
+			this->~SharedBuffer();
+			if (fromPool) {
+				BufferPool::Get().Give(this);
+			}
+			else {
+				::operator delete(this);
+			}
+		}
+	}
+
+	// point a message at the buffer
+	void Attach(SteamNetworkingMessage_t *msg, uint32 size) {
+		msg->m_pData = data();
+		msg->m_cbSize = size;
+		msg->m_pfnFreeData = FreeData;
+		msg->m_nUserData = (int64)(intptr_t)this;
+	}
+
+	// can be called by the library from any thread
+	static void FreeData(SteamNetworkingMessage_t *msg) {
+		((SharedBuffer*)(intptr_t)msg->m_nUserData)->Release();
+	}
+};
+
+// a message waiting to be handed to a transport. It holds one reference to its buffer.
+struct OutboundMessage {
+	HSteamNetConnection conn;
+	SharedBuffer *buffer;
+	uint32 size;
+	int sendFlags;
+};
+
+// hand every message to the library with one SendMessages call. The library takes their buffer references.
+inline void SendOutbound(ISteamNetworkingSockets *pInterface, const std::vector<OutboundMessage> &outbound) {
+	if (outbound.empty()) {
+		return;
+	}
+
+	// reused between sends on the same thread
+	static thread_local std::vector<SteamNetworkingMessage_t*> messages;
+
+	messages.resize(outbound.size());
+	for (int i = 0; i < outbound.size(); i++) {
+		SteamNetworkingMessage_t *msg = SteamNetworkingUtils()->AllocateMessage(0);
+		msg->m_conn = outbound[i].conn;
+		msg->m_nFlags = outbound[i].sendFlags;
+		outbound[i].buffer->Attach(msg, outbound[i].size);
+
+		messages[i] = msg;
+	}
+
+	// the library takes ownership of the messages (even ones that fail to send)
+	pInterface->SendMessages((int)messages.size(), messages.data(), nullptr);
+}
+
+// send the same bytes to every connection in the list with one SendMessages call. Safe to call from any thread.
+inline void BroadcastShared(ISteamNetworkingSockets *pInterface, const std::vector<HSteamNetConnection> &conns, const void *data, uint32 size, int sendFlags) {
+	if (conns.empty()) {
+		return;
+	}
+
+	// the buffer lives until the library frees the last message pointing at it
+	SharedBuffer *buffer = SharedBuffer::Create(data, size, (int)conns.size());
+
+	// reused between sends on the same thread
+	static thread_local std::vector<SteamNetworkingMessage_t*> messages;
+
+	messages.resize(conns.size());
+	for (int i = 0; i < conns.size(); i++) {
+		SteamNetworkingMessage_t *msg = SteamNetworkingUtils()->AllocateMessage(0);
+		msg->m_conn = conns[i];
+		msg->m_nFlags = sendFlags;
+		buffer->Attach(msg, size);
+
+		messages[i] = msg;
+	}
+
+	// the library takes ownership of the messages (even ones that fail to send)
+	pInterface->SendMessages((int)messages.size(), messages.data(), nullptr);
+}
+
+#endif
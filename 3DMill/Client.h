@@ -16,6 +16,7 @@
 #include <thread>
 #include <mutex>
 #include <queue>
+#include <deque>
 #include <map>
 #include <cctype>
 
@@ -31,6 +32,9 @@
 #include "Local3DMill.h"
 
 #include "Tools.h"
+#include "Rules.h"
+#include "Metrics.h"
+#include "Transport.h"
 
 // prototypes
 // callbacks
@@ -40,14 +44,40 @@ void outlinePieceMoveCallback(bool visible, glm::vec3 pos);
 
 void* clientPtr;
 
+// when the server hosting our room goes away, ask the server we first connected to where the room is now.
+// it takes the other servers a moment to notice, so it is tried a few times.
+const std::chrono::milliseconds CLIENT_RECONNECT_DELAY(1000);
+const int CLIENT_MAX_RECONNECTS = 15;
+
 class Client
 {
 public:
 	Local3DMill game;
 	int currentTurn;
 
+	// max number of outline piece updates sent per second. Only the newest state is kept between sends.
+	int maxSelectionRate = 20;
+
+	// the room on the server to join (or create) once connected
+	uint32 roomId = 1;
+
+	// ask the server for an opponent of a similar rating instead of joining roomId
+	bool matchmake = false;
+	int rating = 1500;
+
+	// watch the room without playing. Nothing is sent to the server and local changes are reset to the server's state.
+	bool spectate = false;
+
 	// Start and run the Client
 	void Run(const SteamNetworkingIPAddr &serverAddr)
+	{
+		// Select instance to use.  For now we'll always use the default.
+		GnsTransport transport(SteamNetworkingSockets());
+		Run(&transport, serverAddr);
+	}
+
+	// run the client on any transport
+	void Run(Transport *transport, const SteamNetworkingIPAddr &serverAddr)
 	{
 		// setup local game stuff
 		clientPtr = this;
@@ -59,21 +89,14 @@ public:
 		// disable fps counter
 		game.enableFPSCounter = false;
 
-		// Select instance to use.  For now we'll always use the default.
-		m_pInterface = SteamNetworkingSockets();
+		m_pTransport = transport;
+		m_pTransport->SetStatusChangedCallback(StatusChangedCallback, this);
 
 		// Start connecting
-		char szAddr[SteamNetworkingIPAddr::k_cchMaxString];
-		serverAddr.ToString(szAddr, sizeof(szAddr), true);
-		std::cout << "Connecting to chat server at " << szAddr << std::endl;
-		SteamNetworkingConfigValue_t opt;
-		opt.SetPtr(k_ESteamNetworkingConfig_Callback_ConnectionStatusChanged, (void*)SteamNetConnectionStatusChangedCallback);
-		m_hConnection = m_pInterface->ConnectByIPAddress(serverAddr, 1, &opt);
-		if (m_hConnection == k_HSteamNetConnection_Invalid) {
-			std::cout << "Failed to create connection" << std::endl;
-		}
+		entryAddr = serverAddr;
+		ConnectToServer(serverAddr);
 
-		std::cout << "Server commands include: '/quit' and '/clear'" << std::endl << std::endl;
+		std::cout << "Server commands include: '/quit', '/clear' (the other player has to /clear too while a match is going) and '/analyze [best|eval|win|cancel]'" << std::endl << std::endl;
 
 		// main loop
 		while (!g_bQuit && game.run() == 1)
@@ -81,12 +104,70 @@ public:
 			PollIncomingMessages();
 			PollConnectionStateChanges();
 			PollLocalUserInput();
+			FlushSelection();
+
+			if (reconnectPending && std::chrono::steady_clock::now() >= reconnectAt) {
+				reconnectPending = false;
+				redirected = false;
+				ConnectToServer(entryAddr);
+			}
 			std::this_thread::sleep_for(std::chrono::milliseconds(10));
 		}
+
+		if (boardUpdateTime.count > 0) {
+			std::cout << "Board updates (us): p50 " << boardUpdateTime.percentile(0.5) << ", p99 " << boardUpdateTime.percentile(0.99) <<
+				", max " << boardUpdateTime.max << " over " << boardUpdateTime.count << " updates, " << slotsChanged << " slots changed" << std::endl;
+		}
+
+		// what drawing the scene costs the CPU
+		const GraphicsEngine::DrawStats &draws = game.graphics.drawStats;
+		if (draws.frames > 0 && draws.draws > 0) {
+			std::cout << "Scene: " << draws.frames << " frames, " << (double)draws.draws / draws.frames << " draws per frame, " <<
+				draws.nanos / draws.frames / 1000.0 << " us of CPU per frame, " << (double)draws.nanos / draws.draws / 1000.0 << " us per draw" << std::endl;
+		}
+
+		m_pTransport = nullptr;
 	}
 
 	void SendDataToServer(DataPacket *data) {
-		m_pInterface->SendMessageToConnection(m_hConnection, data, (uint32)sizeof(*data), k_nSteamNetworkingSend_Reliable, nullptr);
+		m_pTransport->SendMessageToConnection(m_hConnection, data, (uint32)sizeof(*data), k_nSteamNetworkingSend_Reliable);
+	}
+
+	// keep only the newest outline piece state, it is sent by FlushSelection
+	void QueueSelection(bool visible, glm::vec3 pos) {
+		pendingSelection.visible = visible;
+		pendingSelection.pos = pos;
+		selectionDirty = true;
+	}
+
+	// send the queued outline piece state if the rate limit allows it
+	void FlushSelection() {
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		std::chrono::milliseconds interval(1000 / (maxSelectionRate > 0 ? maxSelectionRate : 1));
+
+		if (now - lastSelectionSend < interval) {
+			return;
+		}
+
+		if (selectionDirty) {
+			pendingSelection.sequence++;
+			pendingSelection.settled = false;
+			selectionDirty = false;
+			selectionRepeated = false;
+		}
+		// the stream is unreliable so the final state is sent again reliably once the cursor settles, in case it
+		// was lost on the way to the server or on the way on to the other player (see SelectionPacket::settled)
+		else if (selectionRepeated || now - lastSelectionSend < interval * 4) {
+			return;
+		}
+		else {
+			pendingSelection.settled = true;
+			selectionRepeated = true;
+		}
+
+		lastSelectionSend = now;
+		m_pTransport->SendMessageToConnection(m_hConnection, &pendingSelection, (uint32)sizeof(pendingSelection),
+			pendingSelection.settled ? k_nSteamNetworkingSend_Reliable : k_nSteamNetworkingSend_UnreliableNoDelay);
 	}
 
 	// shortcut to just send all relevant info to the server
@@ -106,9 +187,89 @@ public:
 		data.currentTurn = game.gameManager.currentTurn;
 
 		// send to server
+		SubmitAction(data);
+	}
+
+	// the game has already put the move on the board, so it stays there as a prediction until the server answers.
+	// it is numbered so the answer can be matched to it, and checked against the rules first so an illegal move
+	// is undone right away instead of a round trip later. Whether a new game can start is up to the server
+	// (the other player may have to agree), which answers with the board to go back to if it can't.
+	void SubmitAction(DataPacket &data) {
+		DataPacket predicted = PredictedState();
+		if (!Rules::isNewGame(data)) {
+			int mills = millsLeft;
+			if (!Rules::legalSubmission(predicted, data, game.gameManager.placeOnlyOnTurn, mills)) {
+				std::cout << "That move is not allowed" << std::endl;
+				ShowState(predicted);
+				return;
+			}
+			millsLeft = mills;
+		}
+
+		if (lockstep > 0) {
+			SubmitLockstepAction(data);
+			return;
+		}
+
+		data.action = ++nextAction;
+		pendingActions.push_back(data);
 		SendDataToServer(&data);
 	}
 
+	// in lockstep the move is applied here with the same rules the server runs, and only the slots it changed are sent.
+	// the server only answers if it refuses the move, with the full state to go back to.
+	void SubmitLockstepAction(const DataPacket &data) {
+		DataPacket next = syncState;
+		Rules::applySubmission(next, data);
+
+		DeltaPacket action;
+		if (BuildDelta(syncState, next, action) == 0 && next.score1 == syncState.score1 && next.score2 == syncState.score2 &&
+			next.piecesLeft1 == syncState.piecesLeft1 && next.piecesLeft2 == syncState.piecesLeft2 && next.currentTurn == syncState.currentTurn) {
+			return;
+		}
+		action.type = DataPacket::MsgType::GAME_ACTION;
+		action.sequence = syncState.sequence + 1;
+		action.actionTurn = game.gameManager.placeOnlyOnTurn;
+		action.action = ++nextAction;
+
+		// the checksum is only sent every lockstep actions for the server to compare with its own
+		uint64 checksum = 0;
+		ApplyDelta(syncState, action, checksum);
+		action.checksum = action.sequence % lockstep == 0 ? checksum : 0;
+
+		m_pTransport->SendMessageToConnection(m_hConnection, &action, DeltaPacketSize(action), k_nSteamNetworkingSend_Reliable);
+		Reconcile();
+	}
+
+	// show the server's state with any moves it hasn't answered yet on top
+	void Reconcile() {
+		ShowState(PredictedState());
+	}
+
+	// put a state on the board. Only slots that differ are touched, so an answer that matches the prediction
+	// changes nothing on screen and a rejected move only undoes what the server didn't accept.
+	void ShowState(const DataPacket &state) {
+		// don't update the data on the board if one player is still in the win-pause menu.
+		if (game.gameManager.winPause) {
+			return;
+		}
+
+		// board pieces (timed since this is what lands in the frame a packet arrives on)
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		DataPacket data = state;
+		slotsChanged += game.gameManager.board.setBoardToData(&data);
+		boardUpdateTime.record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+
+		// set current scores
+		game.gameManager.setScores((int)state.score1, (int)state.score2);
+		game.gameManager.setPiecesLeft((int)state.piecesLeft1, (int)state.piecesLeft2);
+
+		// set the current turn (this drops the selected piece, so only when it changed)
+		if (game.gameManager.currentTurn != state.currentTurn) {
+			game.gameManager.setTurnToInt(state.currentTurn);
+		}
+	}
+
 	// game stuff
 	// convert the pieces on the board to data 1's and 2's to represent red and blue respectivley.
 	// returns a datapacket with the int array converted to numbers
@@ -144,71 +305,376 @@ private:
 
 	string filepath;
 
+	// mirror of the last numbered state from the server. Deltas are applied on top of this.
+	DataPacket syncState;
+	// set when a delta was missed or did not match its checksum; deltas are ignored until the next snapshot
+	bool awaitingSnapshot = true;
+
+	// checksums are compared every this many actions if the room runs in lockstep (0 if the server sends every state)
+	int lockstep = 0;
+
+	// moves sent to the server that it hasn't answered yet, oldest first
+	std::deque<DataPacket> pendingActions;
+	uint32 nextAction = 0;
+
+	// the opponent's pieces we still have to take after our predicted moves (the server's count comes with snapshots)
+	int millsLeft = 0;
+
+	// time spent putting server states on the board
+	LatencyHistogram boardUpdateTime;
+	uint64 slotsChanged = 0;
+
+	// outline piece stream
+	SelectionPacket pendingSelection;
+	bool selectionDirty = false;
+	bool selectionRepeated = true;
+	std::chrono::steady_clock::time_point lastSelectionSend;
+
+	// newest relayed selection seen from the server
+	uint32 lastOpponentSelection = 0;
+
+	// the last analysis asked for, so it can be cancelled
+	uint32 lastAnalysis = 0;
+
 	HSteamNetConnection m_hConnection;
-	ISteamNetworkingSockets *m_pInterface;
+	Transport *m_pTransport = nullptr;
+
+	// the server we were started with. When the room is hosted by another server process we are sent there,
+	// and come back here to find it again if that server goes away.
+	SteamNetworkingIPAddr entryAddr;
+	bool redirected = false;
+	bool reconnectPending = false;
+	int reconnects = 0;
+	std::chrono::steady_clock::time_point reconnectAt;
+
+	// our color in the room (0 as a spectator), taken back after a reconnect
+	int turn = 0;
+
+	void ConnectToServer(const SteamNetworkingIPAddr &addr)
+	{
+		char szAddr[SteamNetworkingIPAddr::k_cchMaxString];
+		addr.ToString(szAddr, sizeof(szAddr), true);
+		std::cout << "Connecting to chat server at " << szAddr << std::endl;
+		m_hConnection = m_pTransport->Connect(addr);
+		if (m_hConnection == k_HSteamNetConnection_Invalid) {
+			std::cout << "Failed to create connection" << std::endl;
+		}
+	}
 
 	void PollIncomingMessages()
 	{
 		while (!g_bQuit)
 		{
 			ISteamNetworkingMessage *pIncomingMsg = nullptr;
-			int numMsgs = m_pInterface->ReceiveMessagesOnConnection(m_hConnection, &pIncomingMsg, 1);
+			int numMsgs = m_pTransport->ReceiveMessages(&pIncomingMsg, 1);
 			if (numMsgs == 0)
 				break;
 			if (numMsgs < 0)
 				std::cout << "Error checking for messages" << std::endl;
 
-			// Just echo anything we get from the server
-			// we trust anything coming from the server so just set the current board to whatever this is
-			DataPacket *data = (DataPacket*)pIncomingMsg->m_pData;
-			// std::cout << "data recieved" << std::endl;
-			switch (data->type) {
-				// connection info
-				// currently broken for some reason
-				case DataPacket::MsgType::CONNECTION_STATUS: {
-					// std::cout << data->msg.c_str() << std::endl;
+			// the server packs everything it has for us in one go into one message
+			UnpackMessages(pIncomingMsg->m_pData, pIncomingMsg->m_cbSize, [this](const void *payload, int size) { HandleMessage(payload, size); });
+
+			// We don't need this anymore.
+			pIncomingMsg->Release();
+		}
+	}
+
+	// one message from the server
+	void HandleMessage(const void *payload, int size)
+	{
+		// Just echo anything we get from the server
+		// we trust anything coming from the server so just set the current board to whatever this is
+		if (size < (int)sizeof(DataPacket::MsgType)) {
+			return;
+		}
+		DataPacket *data = (DataPacket*)payload;
+		// std::cout << "data recieved" << std::endl;
+		switch (data->type) {
+			// connection info
+			case DataPacket::MsgType::CONNECTION_STATUS: {
+				if (size < (int)sizeof(DataPacket)) {
 					break;
 				}
-				// a person is moving their outline piece
-				case DataPacket::MsgType::GAME_SELECTION: {
-					game.gameManager.setOpponentOutlinePiece(data->selectedVisible, data->selectedPiecePos);
+				std::cout << std::string(data->msg, strnlen(data->msg, sizeof(data->msg))) << std::endl;
+				break;
+			}
+			// a person is moving their outline piece
+			case DataPacket::MsgType::GAME_SELECTION: {
+				SelectionPacket *selection = (SelectionPacket*)payload;
 
+				// unreliable messages can arrive late or twice, only keep the newest
+				if (size < (int)sizeof(SelectionPacket) || selection->sequence <= lastOpponentSelection) {
 					break;
 				}
-				// attempting to place a piece
-				case DataPacket::MsgType::GAME_DATA: {
-					// don't update the data on the board if one player is still in the win-pause menu.
-					if (!game.gameManager.winPause) {
-						// board pieces
-						game.gameManager.board.setBoardToData(data);
-
-						// set current scores
-						game.gameManager.setScores((int)data->score1, (int)data->score2);
-						game.gameManager.setPiecesLeft((int)data->piecesLeft1, (int)data->piecesLeft2);
-
-						// set the current turn
-						game.gameManager.setTurnToInt(data->currentTurn);
-					}
+				lastOpponentSelection = selection->sequence;
 
+				game.gameManager.setOpponentOutlinePiece(selection->visible, selection->pos);
+				break;
+			}
+			// full snapshot of the game (sent on join or after a resync request)
+			case DataPacket::MsgType::GAME_DATA: {
+				if (size < (int)sizeof(DataPacket)) {
 					break;
 				}
-				// First setup message recieved from server that specifies the clients turn (Color)
-				case DataPacket::MsgType::GAME_SETUP: {
-					game.gameManager.placeOnlyOnTurn = data->assignedTurn;
+				syncState = *data;
+				awaitingSnapshot = false;
+
+				// snapshots answer every move up to the one they carry (a rejected move is answered this way)
+				ActionsAnswered(data->action);
+				if (pendingActions.empty()) {
+					millsLeft = data->millsLeft;
+					game.gameManager.mills = syncState.currentTurn == game.gameManager.placeOnlyOnTurn ? millsLeft : 0;
+				}
+				Reconcile();
+				break;
+			}
+			// a single numbered change to the game
+			case DataPacket::MsgType::GAME_DELTA: {
+				DeltaPacket *delta = (DeltaPacket*)payload;
 
+				// wait for the snapshot we already asked for
+				if (awaitingSnapshot || size < (int)offsetof(DeltaPacket, changes) || delta->numChanges < 0 || delta->numChanges > BOARD_SLOTS ||
+					size < (int)DeltaPacketSize(*delta)) {
 					break;
 				}
-				default: {
-					std::cout << "Recieved data of no known type" << std::endl;
+
+				// a gap in the sequence means we missed a change
+				if (delta->sequence != syncState.sequence + 1) {
+					std::cout << "Missed state " << syncState.sequence + 1 << " (got " << delta->sequence << "), resyncing" << std::endl;
+					RequestSnapshot();
+					break;
+				}
+
+				// the checksum catches any divergence right away
+				uint64 checksum = 0;
+				if (!ApplyDelta(syncState, *delta, checksum) || checksum != delta->checksum) {
+					std::cout << "State " << delta->sequence << " failed its checksum, resyncing" << std::endl;
+					RequestSnapshot();
 					break;
 				}
+
+				// our own move coming back
+				if (delta->actionTurn != 0 && delta->actionTurn == game.gameManager.placeOnlyOnTurn) {
+					ActionsAnswered(delta->action);
+				}
+				Reconcile();
+				break;
 			}
+			// the other player's move in a lockstep room, run through the same rules here
+			case DataPacket::MsgType::GAME_ACTION: {
+				DeltaPacket *action = (DeltaPacket*)payload;
+				if (awaitingSnapshot || size < (int)offsetof(DeltaPacket, changes) || action->numChanges < 0 || action->numChanges > BOARD_SLOTS ||
+					size < (int)DeltaPacketSize(*action) || !Rules::legalChanges(*action)) {
+					break;
+				}
 
-			// We don't need this anymore.
-			pIncomingMsg->Release();
+				// our own move crossed with it, the server refused ours and a snapshot is on its way
+				if (action->sequence != syncState.sequence + 1) {
+					RequestSnapshot();
+					break;
+				}
+
+				// every lockstep actions the server's checksum comes along
+				uint64 checksum = 0;
+				if (!ApplyDelta(syncState, *action, checksum) || (action->checksum != 0 && checksum != action->checksum)) {
+					std::cout << "State " << action->sequence << " does not match the server, resyncing" << std::endl;
+					RequestSnapshot();
+					break;
+				}
+
+				Reconcile();
+				break;
+			}
+			// our room is hosted by another server process
+			case DataPacket::MsgType::ROOM_REDIRECT: {
+				RedirectPacket *redirect = (RedirectPacket*)payload;
+				SteamNetworkingIPAddr addr;
+				if (size < (int)sizeof(RedirectPacket) || !addr.ParseString(redirect->address)) {
+					break;
+				}
+
+				std::cout << "Room " << redirect->roomId << " is hosted by " << redirect->address << std::endl;
+				roomId = redirect->roomId;
+				spectate = redirect->spectate;
+				turn = redirect->turn;
+				redirected = true;
+
+				m_pTransport->CloseConnection(m_hConnection, 0, "Redirected", false);
+				ConnectToServer(addr);
+				break;
+			}
+			// the players' time (only if the server has a time control)
+			case DataPacket::MsgType::GAME_CLOCK: {
+				if (size < (int)sizeof(ClockPacket)) {
+					break;
+				}
+
+				ClockPacket *clock = (ClockPacket*)payload;
+				std::cout << "Clock: red " << FormatClock(clock->millisLeft1) << (clock->running == Rules::RED ? " (running)" : "") <<
+					", blue " << FormatClock(clock->millisLeft2) << (clock->running == Rules::BLUE ? " (running)" : "") << std::endl;
+				break;
+			}
+			// the answer to '/analyze'
+			case DataPacket::MsgType::ANALYSIS_RESULT: {
+				if (size < (int)sizeof(AnalysisResultPacket)) {
+					break;
+				}
+
+				AnalysisResultPacket *result = (AnalysisResultPacket*)payload;
+				if (result->status == AnalysisResultPacket::BUSY) {
+					std::cout << "Analysis " << result->requestId << ": the server is too busy, try again later" << std::endl;
+					break;
+				}
+				if (result->status == AnalysisResultPacket::CANCELLED) {
+					std::cout << "Analysis " << result->requestId << " cancelled" << std::endl;
+					break;
+				}
+				if (result->status == AnalysisResultPacket::BAD_POSITION) {
+					std::cout << "Analysis " << result->requestId << ": the server can't analyse this position" << std::endl;
+					break;
+				}
+
+				std::cout << "Analysis " << result->requestId << " (" << result->depth << " plies, " << result->nodes << " positions" <<
+					(result->cached ? ", cached" : "") << "): ";
+				if (result->forcedWin > 0) {
+					std::cout << "the side to move wins within " << result->forcedWin << " plies";
+				}
+				else if (result->forcedWin < 0) {
+					std::cout << "the side to move loses within " << -result->forcedWin << " plies";
+				}
+				else if (result->kind == AnalysisRequestPacket::FORCED_WIN) {
+					std::cout << "no forced win found";
+				}
+				else {
+					std::cout << "score " << result->score / 100.0 << " pieces for the side to move";
+				}
+
+				if (result->to >= 0) {
+					std::cout << ". Best move: " << (result->from >= 0 ? FormatSlot(result->from) : std::string("reserve")) << " to " << FormatSlot(result->to);
+					for (int i = 0; i < 3 && result->taken[i] >= 0; i++) {
+						std::cout << ", take " << FormatSlot(result->taken[i]);
+					}
+				}
+				std::cout << std::endl;
+				break;
+			}
+			// First setup message recieved from server that specifies the clients turn (Color)
+			case DataPacket::MsgType::GAME_SETUP: {
+				if (size < (int)sizeof(DataPacket)) {
+					break;
+				}
+
+				// a turn of 0 means the server made us a spectator
+				spectate = data->assignedTurn == 0;
+				if (!spectate)
+					game.gameManager.placeOnlyOnTurn = data->assignedTurn;
+
+				lockstep = data->lockstep;
+				if (lockstep > 0)
+					std::cout << "The room runs in lockstep" << std::endl;
+
+				// a reconnect goes back to this room in this color, even if we were matched into it
+				turn = data->assignedTurn;
+				if (data->roomId != 0) {
+					roomId = data->roomId;
+					matchmake = false;
+				}
+				reconnects = 0;
+
+				// moves sent to a server we lost will never be answered, the snapshot that follows is the truth
+				pendingActions.clear();
+				awaitingSnapshot = true;
+
+				// every room numbers its relayed selections from the start
+				lastOpponentSelection = 0;
+				break;
+			}
+			default: {
+				std::cout << "Recieved data of no known type" << std::endl;
+				break;
+			}
 		}
 	}
 
+	// minutes:seconds.tenths
+	static std::string FormatClock(int millis) {
+		char temp[32];
+		sprintf_s(temp, "%d:%02d.%d", millis / 60000, (millis / 1000) % 60, (millis / 100) % 10);
+		return temp;
+	}
+
+	// the server has handled every move up to this number
+	void ActionsAnswered(uint32 action) {
+		while (!pendingActions.empty() && pendingActions.front().action <= action) {
+			pendingActions.pop_front();
+		}
+	}
+
+	// the last state from the server with the moves it hasn't answered yet applied
+	DataPacket PredictedState() {
+		DataPacket state = syncState;
+
+		// every submission is a whole board, so the newest one is all that matters
+		if (!pendingActions.empty()) {
+			Rules::applySubmission(state, pendingActions.back());
+		}
+		return state;
+	}
+
+	// best move, evaluation or forced win check of the board as we see it (with our unanswered moves)
+	void RequestAnalysis(const std::string &what) {
+		AnalysisRequestPacket request;
+		if (what == "best") {
+			request.kind = AnalysisRequestPacket::BEST_MOVE;
+		}
+		else if (what == "eval") {
+			request.kind = AnalysisRequestPacket::EVALUATE;
+		}
+		else if (what == "win") {
+			request.kind = AnalysisRequestPacket::FORCED_WIN;
+		}
+		else if (what == "cancel") {
+			request.kind = AnalysisRequestPacket::CANCEL;
+		}
+		else {
+			std::cout << "Analysis can be 'best', 'eval', 'win' or 'cancel'" << std::endl;
+			return;
+		}
+
+		if (request.kind == AnalysisRequestPacket::CANCEL) {
+			request.requestId = lastAnalysis;
+		}
+		else {
+			request.requestId = ++lastAnalysis;
+		}
+
+		// players get their answer before anyone reviewing a game
+		request.lane = spectate ? 1 : 0;
+		request.position = PredictedState();
+		m_pTransport->SendMessageToConnection(m_hConnection, &request, (uint32)sizeof(request), k_nSteamNetworkingSend_Reliable);
+	}
+
+	// cube level, x, y, z of a slot the server named
+	static std::string FormatSlot(int slot) {
+		int c, x, y, z;
+		slotCoord(slot, c, x, y, z);
+		char temp[32];
+		sprintf_s(temp, "(%d,%d,%d,%d)", c, x, y, z);
+		return temp;
+	}
+
+	// ask the server for a full snapshot of the game
+	void RequestSnapshot() {
+		awaitingSnapshot = true;
+
+		DataPacket data;
+		data.type = DataPacket::MsgType::GAME_RESYNC;
+		data.sequence = syncState.sequence;
+
+		SendDataToServer(&data);
+	}
+
 	void PollLocalUserInput()
 	{
 		std::string cmd;
@@ -222,7 +688,7 @@ private:
 				std::cout << "Disconnecting from chat server" << std::endl;
 
 				// Close the connection
-				m_pInterface->CloseConnection(m_hConnection, 0, "Goodbye", true);
+				m_pTransport->CloseConnection(m_hConnection, 0, "Goodbye", true);
 				break;
 			}
 
@@ -242,10 +708,16 @@ private:
 					}
 				}
 
-				SendDataToServer(&data);
+				SubmitAction(data);
 			}
 
-			std::cout << "Server commands include: '/quit' and '/clear'" << std::endl;
+			// ask the server about the position on our board
+			if (cmd.compare(0, 8, "/analyze") == 0) {
+				RequestAnalysis(cmd.size() > 9 ? cmd.substr(9) : "best");
+				continue;
+			}
+
+			std::cout << "Server commands include: '/quit', '/clear' (the other player has to /clear too while a match is going) and '/analyze [best|eval|win|cancel]'" << std::endl;
 
 			// Anything else, just send it to the server and let them parse it
 			// m_pInterface->SendMessageToConnection(m_hConnection, cmd.c_str(), (uint32)cmd.length(), k_nSteamNetworkingSend_Reliable, nullptr);
@@ -254,7 +726,10 @@ private:
 
 	void OnSteamNetConnectionStatusChanged(SteamNetConnectionStatusChangedCallback_t *pInfo)
 	{
-		assert(pInfo->m_hConn == m_hConnection || m_hConnection == k_HSteamNetConnection_Invalid);
+		// a connection we already left for another server
+		if (pInfo->m_hConn != m_hConnection) {
+			return;
+		}
 
 		// What's the state of the connection?
 		switch (pInfo->m_info.m_eState)
@@ -266,6 +741,18 @@ private:
 		case k_ESteamNetworkingConnectionState_ClosedByPeer:
 		case k_ESteamNetworkingConnectionState_ProblemDetectedLocally:
 		{
+			// the server hosting our room went away. The server we started with knows where the room went.
+			if (redirected && reconnects < CLIENT_MAX_RECONNECTS) {
+				std::cout << "Lost the server hosting room " << roomId << ", looking for it again. " << pInfo->m_info.m_szEndDebug << std::endl;
+				m_pTransport->CloseConnection(pInfo->m_hConn, 0, nullptr, false);
+				m_hConnection = k_HSteamNetConnection_Invalid;
+
+				reconnects++;
+				reconnectPending = true;
+				reconnectAt = std::chrono::steady_clock::now() + CLIENT_RECONNECT_DELAY;
+				break;
+			}
+
 			g_bQuit = true;
 
 			// Print an appropriate message
@@ -291,7 +778,7 @@ private:
 			// to finish up.  The reason information do not matter in this case,
 			// and we cannot linger because it's already closed on the other end,
 			// so we just pass 0's.
-			m_pInterface->CloseConnection(pInfo->m_hConn, 0, nullptr, false);
+			m_pTransport->CloseConnection(pInfo->m_hConn, 0, nullptr, false);
 			m_hConnection = k_HSteamNetConnection_Invalid;
 			break;
 		}
@@ -302,8 +789,27 @@ private:
 			break;
 
 		case k_ESteamNetworkingConnectionState_Connected:
-			std::cout << "Connected to server OK" << std::endl;
+		{
+			// the server puts us in its lobby, ask for a match or our room
+			if (matchmake)
+			{
+				std::cout << "Connected to server OK, looking for a match at rating " << rating << std::endl;
+
+				MatchPacket request;
+				request.rating = rating;
+				m_pTransport->SendMessageToConnection(m_hConnection, &request, (uint32)sizeof(request), k_nSteamNetworkingSend_Reliable);
+				break;
+			}
+
+			std::cout << "Connected to server OK, joining room " << roomId << std::endl;
+
+			RoomPacket room;
+			room.roomId = roomId;
+			room.spectate = spectate;
+			room.turn = turn;
+			m_pTransport->SendMessageToConnection(m_hConnection, &room, (uint32)sizeof(room), k_nSteamNetworkingSend_Reliable);
 			break;
+		}
 
 		default:
 			// Silences -Wswitch
@@ -311,38 +817,38 @@ private:
 		}
 	}
 
-	static Client *s_pCallbackInstance;
-	static void SteamNetConnectionStatusChangedCallback(SteamNetConnectionStatusChangedCallback_t *pInfo)
+	static void StatusChangedCallback(SteamNetConnectionStatusChangedCallback_t *pInfo, void *context)
 	{
-		s_pCallbackInstance->OnSteamNetConnectionStatusChanged(pInfo);
+		((Client*)context)->OnSteamNetConnectionStatusChanged(pInfo);
 	}
 
 	void PollConnectionStateChanges()
 	{
-		s_pCallbackInstance = this;
-		m_pInterface->RunCallbacks();
+		m_pTransport->RunCallbacks();
 	}
 };
 
 // called when a piece is moved
 void outlinePieceMoveCallback(bool visible, glm::vec3 pos) {
-	// send packet to server
+	// queue for the next send to the server
 	Client *client = (Client*)clientPtr;
 
-	DataPacket data;
-	data.type = data.GAME_SELECTION;
-	data.selectedVisible = visible;
-	data.selectedPiecePos = pos;
-
-	client->SendDataToServer(&data);
+	if (!client->spectate)
+		client->QueueSelection(visible, pos);
 }
 
 // called when a piece is placed
 void placePieceCallback(Piece::Color color, glm::vec4 pos) {
 	// send packet to server
 	Client *client = (Client*)clientPtr;
-	// if it is the clients turn
 
+	// spectators can't play so put the board back
+	if (client->spectate) {
+		client->Reconcile();
+		return;
+	}
+
+	// if it is the clients turn
 	client->SendCurrentDataToServer();
 
 	// std::cout << "sent message to server of type" << std::endl;
@@ -352,6 +858,11 @@ void placePieceCallback(Piece::Color color, glm::vec4 pos) {
 void clearBoardCallback() {
 	Client *client = (Client*)clientPtr;
 
+	if (client->spectate) {
+		client->Reconcile();
+		return;
+	}
+
 	// get empty board
 	DataPacket data = client->convertBoardToPacket();
 
@@ -368,7 +879,7 @@ void clearBoardCallback() {
 	// set turn to neutral so the original turns remain.
 	data.currentTurn = 0;
 
-	client->SendDataToServer(&data);
+	client->SubmitAction(data);
 }
 
 #endif
\ No newline at end of file
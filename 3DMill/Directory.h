@@ -0,0 +1,219 @@
+// which server process hosts a room when several of them share the rooms. Every process is given the same list of
+// shards and hashes room ids onto a ring of points, so they all agree on the owner of a room without asking each other.
+// a client that asks the wrong process is redirected. A shard that goes away is taken off the ring: only its rooms move
+// (each to the next shard along the ring) and the new owners bring them back from its journal. Nothing stops a shard
+// that was taken off the ring while still running, see Server::TakeOverShard.
+#ifndef DIRECTORY_H
+#define DIRECTORY_H
+
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+#include <GameNetworkingSockets/steam/steamnetworkingsockets.h>
+
+#include "Tools.h"
+
+// points each shard gets on the ring. More points spread the rooms more evenly.
+const int DIRECTORY_POINTS_PER_SHARD = 128;
+
+class RoomDirectory {
+public:
+	struct Shard {
+		std::string address;
+		SteamNetworkingIPAddr addr;
+
+		// where the shard journals its rooms (empty if it doesn't)
+		std::string journalPath;
+
+		// taken off the ring once it went away
+		bool alive = true;
+	};
+
+	// this process (-1 if there is no directory and every room is hosted here)
+	int self = -1;
+
+	// addresses is a comma separated list of ip:port, the same on every process. If journalBase is set every shard
+	// journals to journalBase.INDEX so the others can find its rooms. Returns false if the list is bad.
+	bool Configure(const std::string &addresses, int selfIndex, const std::string &journalBase) {
+		shards.clear();
+
+		size_t start = 0;
+		while (start <= addresses.size()) {
+			size_t end = addresses.find(',', start);
+			if (end == std::string::npos) {
+				end = addresses.size();
+			}
+
+			Shard shard;
+			shard.address = addresses.substr(start, end - start);
+			if (shard.address.empty() || !shard.addr.ParseString(shard.address.c_str())) {
+				std::cout << "Bad shard address '" << shard.address << "'" << std::endl;
+				return false;
+			}
+			if (!journalBase.empty()) {
+				shard.journalPath = journalBase + "." + std::to_string(shards.size());
+			}
+			shards.push_back(shard);
+
+			start = end + 1;
+		}
+
+		if (selfIndex < 0 || selfIndex >= (int)shards.size()) {
+			std::cout << "Shard " << selfIndex << " is not in the list of " << shards.size() << " shards" << std::endl;
+			return false;
+		}
+		self = selfIndex;
+
+		BuildRing();
+		return true;
+	}
+
+	bool Enabled() const {
+		return self >= 0 && shards.size() > 1;
+	}
+
+	int NumShards() const {
+		return (int)shards.size();
+	}
+
+	const Shard &GetShard(int shard) const {
+		return shards[shard];
+	}
+
+	// the shard hosting a room
+	int Owner(uint32 roomId) const {
+		if (ring.empty()) {
+			return self;
+		}
+
+		// the first point at or after the room's hash, wrapping around
+		uint64_t hash = HashRoom(roomId);
+		auto it = std::lower_bound(ring.begin(), ring.end(), Point{ hash, 0 });
+		if (it == ring.end()) {
+			it = ring.begin();
+		}
+		return it->shard;
+	}
+
+	bool OwnsRoom(uint32 roomId) const {
+		return !Enabled() || Owner(roomId) == self;
+	}
+
+	// take a shard that went away off the ring. Returns false if it already was.
+	bool MarkDown(int shard) {
+		if (shard < 0 || shard >= (int)shards.size() || shard == self || !shards[shard].alive) {
+			return false;
+		}
+
+		shards[shard].alive = false;
+		BuildRing();
+		return true;
+	}
+
+	// spread rooms over a number of shards, take one away and check only its rooms moved
+	static void Benchmark(int numShards, int numRooms) {
+		if (numShards < 2 || numRooms <= 0) {
+			return;
+		}
+
+		std::string addresses;
+		for (int i = 0; i < numShards; i++) {
+			addresses += (i > 0 ? "," : "") + std::string("127.0.0.1:") + std::to_string(27020 + i);
+		}
+
+		RoomDirectory directory;
+		if (!directory.Configure(addresses, 0, "")) {
+			return;
+		}
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		std::vector<int> owners(numRooms);
+		std::vector<int> counts(numShards, 0);
+		for (int i = 0; i < numRooms; i++) {
+			owners[i] = directory.Owner((uint32)i + 1);
+			counts[owners[i]]++;
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		int fewest = *std::min_element(counts.begin(), counts.end());
+		int most = *std::max_element(counts.begin(), counts.end());
+		double even = (double)numRooms / numShards;
+		std::cout << "Placed " << numRooms << " rooms on " << numShards << " shards in " << seconds * 1000.0 << " ms (" <<
+			numRooms / seconds << " lookups/sec). Fewest " << fewest << " (" << fewest / even * 100.0 << "% of even), most " <<
+			most << " (" << most / even * 100.0 << "% of even)" << std::endl;
+
+		// the last shard goes away. Its rooms have to go somewhere else and nothing else may move.
+		int lost = numShards - 1;
+		directory.MarkDown(lost);
+
+		int moved = 0;
+		int wrongMoves = 0;
+		std::vector<int> gained(numShards, 0);
+		for (int i = 0; i < numRooms; i++) {
+			int owner = directory.Owner((uint32)i + 1);
+			if (owner == owners[i]) {
+				continue;
+			}
+
+			moved++;
+			gained[owner]++;
+			if (owners[i] != lost || owner == lost) {
+				wrongMoves++;
+			}
+		}
+
+		std::cout << "Shard " << lost << " went away: " << moved << " of its " << counts[lost] << " rooms moved, " << wrongMoves <<
+			" rooms moved that shouldn't have. Most taken over by one shard: " << *std::max_element(gained.begin(), gained.end()) << std::endl;
+	}
+
+private:
+	struct Point {
+		uint64_t hash;
+		int shard;
+
+		bool operator<(const Point &other) const {
+			return hash < other.hash;
+		}
+	};
+
+	std::vector<Shard> shards;
+
+	// points of the live shards, sorted by hash
+	std::vector<Point> ring;
+
+	// points come from the address, so shards keep their place on the ring if the list is reordered
+	void BuildRing() {
+		ring.clear();
+		for (int i = 0; i < shards.size(); i++) {
+			if (!shards[i].alive) {
+				continue;
+			}
+
+			uint64_t base = HashString(shards[i].address);
+			for (int point = 0; point < DIRECTORY_POINTS_PER_SHARD; point++) {
+				ring.push_back({ Zobrist::mix(base + (uint64_t)point * 0x9E3779B97F4A7C15ULL), i });
+			}
+		}
+		std::sort(ring.begin(), ring.end());
+	}
+
+	static uint64_t HashRoom(uint32 roomId) {
+		return Zobrist::mix((uint64_t)roomId ^ 0x524F4F4D44495231ULL);
+	}
+
+	// FNV-1a
+	static uint64_t HashString(const std::string &str) {
+		uint64_t hash = 0xCBF29CE484222325ULL;
+		for (int i = 0; i < str.size(); i++) {
+			hash ^= (unsigned char)str[i];
+			hash *= 0x100000001B3ULL;
+		}
+		return hash;
+	}
+};
+
+#endif
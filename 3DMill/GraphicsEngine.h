@@ -16,6 +16,7 @@
 
 #include <iostream>
 #include <vector>
+#include <chrono>
 
 // graphics tools
 #include "Camera.h"
@@ -25,6 +26,7 @@
 #include "Mesh.h"
 #include "Skybox.h"
 #include "TextManager.h"
+#include "RenderQueue.h"
 
 // prototypes
 // callbacks
@@ -44,6 +46,22 @@ inline MouseControlState *mouseModePointer;
 
 inline Camera *cameraPointer;
 
+// uniform buffer binding point of the per frame camera and light data
+const unsigned int FRAME_UNIFORMS_BINDING = 0;
+
+// the Frame uniform block of the model shaders (std140, so vec3s are padded to vec4s)
+struct FrameUniforms {
+	glm::mat4 projection;
+	glm::mat4 view;
+	glm::vec4 viewPos;
+	glm::vec4 lightPos;
+	glm::vec4 lightColor;
+	float lightBrightness;
+	float lightDistance;
+	int enableLighting;
+	float padding;
+};
+
 // add all models before you start making assets
 // a simple graphicsengine (uses multisampling x4)
 class GraphicsEngine {
@@ -87,6 +105,14 @@ public:
 	// text stuff
 	TextManager textManager;
 
+	// CPU time spent handing the scene to GL, to see what each draw costs
+	struct DrawStats {
+		uint64_t frames = 0;
+		uint64_t draws = 0;
+		uint64_t nanos = 0;
+	};
+	DrawStats drawStats;
+
 	GraphicsEngine() {
 
 	}
@@ -181,6 +207,7 @@ public:
 		// local shader
 		// shader = Shader("resources/shaders/basic_model.vs", "resources/shaders/basic_model.fs");
 		shader = Shader("resources/shaders/lighted_model.vs", "resources/shaders/lighted_model.fs");
+		setupModelUniforms();
 	}
 
 	// switch Mouse Modes
@@ -293,12 +320,15 @@ public:
 		glClearColor(0.1f, 0.1f, 0.1f, 0.1f);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+		// the camera only moves between frames
+		glm::mat4 view = camera.update();
+
 		// draw
 		// skybox for background
-		skybox.render(camera.projection, camera.update());
+		skybox.render(camera.projection, view);
 
 		// light
-		light.render(camera.projection, camera.update());
+		light.render(camera.projection, view);
 
 		// testing stuff
 		// generateTestCube();
@@ -307,63 +337,201 @@ public:
 		}
 		
 		// model rendering
+		std::chrono::steady_clock::time_point sceneStart = std::chrono::steady_clock::now();
 		shader.use();
 
+		// camera and light go to every model at once
+		updateFrameUniforms(view);
+
+		// sorted by state and depth, so it doesn't matter what order the assets were added in
+		buildRenderQueue(view);
+		drawRenderQueue();
+		drawStats.frames++;
+		drawStats.nanos += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - sceneStart).count();
+
+		// render text elements
+		textManager.render();
+
+		glfwSwapBuffers(window);
+		glfwPollEvents();
+
+		return 1;
+	}
+
+private:
+	// camera and light for the model shader, written once per frame
+	unsigned int frameUBO;
+
+	// this frame's draws, kept so its memory is reused
+	RenderQueue renderQueue;
+
+	// model shader uniforms that change with every asset, looked up once
+	struct ModelUniforms {
+		int model;
+		int normalMatrix;
+		int overrideColorEnabled;
+		int overrideColor;
+		int instanced;
+	};
+	ModelUniforms modelUniforms;
+
+	void setupModelUniforms() {
+		modelUniforms.model = shader.uniform("model");
+		modelUniforms.normalMatrix = shader.uniform("normalMatrix");
+		modelUniforms.overrideColorEnabled = shader.uniform("overrideColorEnabled");
+		modelUniforms.overrideColor = shader.uniform("overrideColor");
+		modelUniforms.instanced = shader.uniform("instanced");
+
+		glGenBuffers(1, &frameUBO);
+		glBindBuffer(GL_UNIFORM_BUFFER, frameUBO);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), NULL, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_UNIFORMS_BINDING, frameUBO);
+
+		shader.bindUniformBlock("Frame", FRAME_UNIFORMS_BINDING);
+	}
+
+	void updateFrameUniforms(const glm::mat4 &view) {
+		FrameUniforms frame;
+		frame.projection = camera.projection;
+		frame.view = view;
+		frame.viewPos = glm::vec4(camera.pos, 1.0f);
+
 		// if the light is valid then enter lighting mode for shader
-		if (light.enabled) {
-			shader.setBool("enableLighting", true);
+		frame.enableLighting = light.enabled ? 1 : 0;
+		frame.lightPos = glm::vec4(light.pos, 1.0f);
+		frame.lightColor = glm::vec4(light.color, 1.0f);
+		frame.lightBrightness = light.brightness;
+		frame.lightDistance = light.distance;
+		frame.padding = 0.0f;
+
+		glBindBuffer(GL_UNIFORM_BUFFER, frameUBO);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameUniforms), &frame);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	}
 
-			shader.setVec3("lightPos", light.pos);
-			shader.setVec3("lightColor", light.color);
-			shader.setFloat("lightBrightness", light.brightness);
-			shader.setFloat("lightDistance", light.distance);
+	// one item for every visible asset, and one for all the instanced assets of each model
+	void buildRenderQueue(const glm::mat4 &view) {
+		renderQueue.clear();
+		for (int i = 0; i < models.size(); i++) {
+			models[i].instances.clear();
 		}
 
-		// draw assets with the corresponding model
-		// draw backwards since the board is transparent and the balls and other objects need to be drawn first
-		for (int i = scene.size()-1; i >= 0; i--) {
-			if (scene[i]->visible) {
-				// camera stuff
-				glm::mat4 projection = camera.projection;
-				glm::mat4 view = camera.update();
-				shader.setMat4("projection", projection);
-				shader.setMat4("view", view);
-				shader.setVec3("viewPos", camera.pos);
-
-				// translate model
-				glm::mat4 model = glm::mat4(1.0f);
-				model = glm::translate(model, scene[i]->position);
-				model = glm::rotate(model, glm::radians(scene[i]->rotation.x), glm::vec3(1.0, 0.0, 0.0));
-				model = glm::rotate(model, glm::radians(scene[i]->rotation.y), glm::vec3(0.0, 1.0, 0.0));
-				model = glm::rotate(model, glm::radians(scene[i]->rotation.z), glm::vec3(0.0, 0.0, 1.0));
-				model = glm::scale(model, scene[i]->scale);	// it's a bit too big for our scene, so scale it down
-				shader.setMat4("model", model);
-
-				// color change
-				shader.setBool("overrideColorEnabled", scene[i]->overrideColorEnabled);
-				if (scene[i]->overrideColorEnabled) {
-					shader.setVec3("overrideColor", scene[i]->overrideColor);
-				}
+		// instanced models are sorted by their farthest instance
+		std::vector<float> instanceDepth(models.size(), 0.0f);
 
-				// effects
-				scene[i]->updateEffects(shader);
+		for (int i = 0; i < scene.size(); i++) {
+			Asset *asset = scene[i];
+			if (!asset->visible || asset->model == nullptr) {
+				continue;
+			}
+
+			float depth = -(view * glm::vec4(asset->position, 1.0f)).z;
+			unsigned int modelIndex = modelIndexOf(asset->model);
+
+			if (asset->instanced && modelIndex < models.size()) {
+				Instance instance;
+				instance.model = asset->getModelMatrix();
+				instance.normal = asset->getNormalMatrix();
+				instance.overrideColor = asset->overrideColorEnabled ? glm::vec4(asset->overrideColor, 1.0f) : glm::vec4(0.0f);
+				instance.effect = asset->updateEffects();
+				asset->model->instances.push_back(instance);
+
+				instanceDepth[modelIndex] = std::max(instanceDepth[modelIndex], depth);
+				continue;
+			}
+
+			// the per asset uniforms it needs are its material, so assets that look alike are drawn together
+			unsigned int material = asset->overrideColorEnabled ? 1 : 0;
+			renderQueue.add(bucketOf(asset), shader.ID, modelIndex, material, depth, camera.farPlane, asset, asset->model);
+		}
 
-				if (scene[i]->model != nullptr) {
-					scene[i]->model->Draw(shader, camera);
+		for (unsigned int i = 0; i < models.size(); i++) {
+			if (!models[i].instances.empty()) {
+				RenderQueue::Bucket bucket = models[i].transparent ? RenderQueue::TRANSPARENT_BUCKET : RenderQueue::OPAQUE_BUCKET;
+				renderQueue.add(bucket, shader.ID, i, 0, instanceDepth[i], camera.farPlane, nullptr, &models[i]);
+			}
+		}
+
+		renderQueue.sort();
+	}
+
+	// uniforms are only set when they differ from the item before
+	void drawRenderQueue() {
+		bool instanced = false;
+		int overrideColorEnabled = -1;
+		bool depthTest = true;
+
+		for (int i = 0; i < renderQueue.items.size(); i++) {
+			const RenderQueue::Item &item = renderQueue.items[i];
+
+			// the UI goes over everything
+			bool ui = RenderQueue::bucketOf(item.key) == RenderQueue::UI_BUCKET;
+			if (ui == depthTest) {
+				depthTest = !ui;
+				if (depthTest) {
+					glEnable(GL_DEPTH_TEST);
+				}
+				else {
+					glDisable(GL_DEPTH_TEST);
 				}
 			}
+
+			if ((item.asset == nullptr) != instanced) {
+				instanced = item.asset == nullptr;
+				shader.setBool(modelUniforms.instanced, instanced);
+			}
+
+			if (instanced) {
+				drawStats.draws += item.model->DrawInstanced(shader);
+				continue;
+			}
+
+			Asset *asset = item.asset;
+
+			// translate model
+			shader.setMat4(modelUniforms.model, asset->getModelMatrix());
+			shader.setMat3(modelUniforms.normalMatrix, asset->getNormalMatrix());
+
+			// color change
+			if ((int)asset->overrideColorEnabled != overrideColorEnabled) {
+				overrideColorEnabled = asset->overrideColorEnabled;
+				shader.setBool(modelUniforms.overrideColorEnabled, asset->overrideColorEnabled);
+			}
+			if (asset->overrideColorEnabled) {
+				shader.setVec3(modelUniforms.overrideColor, asset->overrideColor);
+			}
+
+			// effects
+			asset->updateEffects(shader);
+
+			item.model->Draw(shader, camera);
+			drawStats.draws += item.model->meshes.size();
 		}
 
-		// render text elements
-		textManager.render();
+		if (instanced) {
+			shader.setBool(modelUniforms.instanced, false);
+		}
+		if (!depthTest) {
+			glEnable(GL_DEPTH_TEST);
+		}
+	}
 
-		glfwSwapBuffers(window);
-		glfwPollEvents();
+	RenderQueue::Bucket bucketOf(const Asset *asset) const {
+		if (asset->ui) {
+			return RenderQueue::UI_BUCKET;
+		}
+		return asset->model->transparent ? RenderQueue::TRANSPARENT_BUCKET : RenderQueue::OPAQUE_BUCKET;
+	}
 
-		return 1;
+	// index of a model in models (past the end for a model that isn't one of them)
+	unsigned int modelIndexOf(const Model *model) const {
+		if (models.empty() || model < &models[0] || model > &models.back()) {
+			return (unsigned int)models.size();
+		}
+		return (unsigned int)(model - &models[0]);
 	}
 
-private:
 	// end opengl and free allocated resources
 	void terminate() {
 		glfwTerminate();
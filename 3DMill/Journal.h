@@ -0,0 +1,368 @@
+// append-only journal of every room's accepted states so in-progress matches survive the server dying.
+// room workers push records onto a lock-free queue and a background thread writes them out, syncing to disk
+// once per batch. On startup the journal is replayed to rebuild the rooms.
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <thread>
+#include <map>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <iostream>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "Tools.h"
+#include "Rules.h"
+
+// how long the writer collects records before writing and syncing them together
+const std::chrono::microseconds JOURNAL_GROUP_COMMIT(5000);
+
+class Journal {
+public:
+	enum RecordType : uint32 {
+		// the whole state of a room (new rooms, and every live room when the journal is compacted)
+		SNAPSHOT = 1,
+		// a numbered change to a room (DeltaPacket)
+		DELTA = 2,
+		// the room is gone and should not be restored
+		CLOSE = 3
+	};
+
+	// written before every record. The check covers the room, type and payload so a torn write at the end is ignored.
+	struct RecordHeader {
+		uint32 size;
+		uint32 check;
+		uint32 roomId;
+		uint32 type;
+	};
+
+	// counters for the server console
+	std::atomic<uint64> recordsWritten{ 0 };
+	std::atomic<uint64> syncs{ 0 };
+
+	Journal() {
+		// the queue always holds one node the writer has already consumed
+		queueHead = &stub;
+		queueTail = &stub;
+	}
+
+	~Journal() {
+		Stop();
+
+		// anything appended after Stop is dropped
+		while (Pop() != nullptr) {
+		}
+		if (queueTail != &stub) {
+			delete queueTail;
+		}
+	}
+
+	// rebuild rooms from a journal. Returns false if there was nothing to read.
+	static bool Recover(const std::string &path, std::map<uint32, DataPacket> &rooms) {
+		FILE *file = OpenExisting(path);
+		if (file == nullptr) {
+			return false;
+		}
+
+		RecordHeader header;
+		alignas(8) char payload[sizeof(Entry::data)];
+		uint64 records = 0;
+		uint64 rejected = 0;
+
+		while (fread(&header, sizeof(header), 1, file) == 1) {
+			if (header.size > sizeof(payload) || fread(payload, 1, header.size, file) != header.size ||
+				Check(header.roomId, header.type, payload, header.size) != header.check) {
+				// torn or corrupt tail, everything before it is good
+				break;
+			}
+			records++;
+
+			switch (header.type) {
+				case SNAPSHOT: {
+					if (header.size == sizeof(DataPacket)) {
+						memcpy(&rooms[header.roomId], payload, sizeof(DataPacket));
+					}
+					break;
+				}
+				case DELTA: {
+					auto itRoom = rooms.find(header.roomId);
+					DeltaPacket *delta = (DeltaPacket*)payload;
+					// the slots are checked before anything is applied, a damaged record could point outside the board
+					if (itRoom == rooms.end() || header.size < offsetof(DeltaPacket, changes) || delta->numChanges < 0 || delta->numChanges > BOARD_SLOTS ||
+						header.size < DeltaPacketSize(*delta) || !Rules::legalChanges(*delta) || delta->sequence != itRoom->second.sequence + 1) {
+						rejected++;
+						break;
+					}
+
+					uint64 checksum = 0;
+					if (!ApplyDelta(itRoom->second, *delta, checksum) || checksum != delta->checksum) {
+						// the state can't be trusted any more
+						rejected++;
+						rooms.erase(itRoom);
+					}
+					break;
+				}
+				case CLOSE: {
+					rooms.erase(header.roomId);
+					break;
+				}
+			}
+		}
+
+		fclose(file);
+
+		if (rejected > 0) {
+			std::cout << "Journal: " << rejected << " of " << records << " records did not follow on from the room state and were skipped" << std::endl;
+		}
+		return true;
+	}
+
+	// start a fresh journal holding only the given rooms and start the writer.
+	// the new file is written beside the old one and swapped in once it is on disk.
+	bool Start(const std::string &path, const std::map<uint32, DataPacket> &rooms) {
+		this->path = path;
+
+		std::string tempPath = path + ".new";
+		FILE *compacted = nullptr;
+		if (fopen_s(&compacted, tempPath.c_str(), "wb") != 0 || compacted == nullptr) {
+			std::cout << "Journal: can't open " << tempPath << std::endl;
+			return false;
+		}
+
+		for (auto &it : rooms) {
+			WriteRecord(compacted, it.first, SNAPSHOT, &it.second, sizeof(DataPacket));
+		}
+		Sync(compacted);
+		fclose(compacted);
+
+		remove(path.c_str());
+		if (rename(tempPath.c_str(), path.c_str()) != 0 || fopen_s(&file, path.c_str(), "ab") != 0 || file == nullptr) {
+			std::cout << "Journal: can't open " << path << std::endl;
+			file = nullptr;
+			return false;
+		}
+
+		running = true;
+		writer = std::thread(&Journal::Run, this);
+		return true;
+	}
+
+	// write out everything queued and stop the writer. Stop the room workers first: a record appended
+	// once this has returned is never written.
+	void Stop() {
+		if (!running) {
+			return;
+		}
+
+		running = false;
+		wakeup.Notify();
+		writer.join();
+
+		// a worker that saw running just before it was cleared can push after the writer's last pass
+		WriteQueued();
+
+		fclose(file);
+		file = nullptr;
+	}
+
+	// called by the room workers. Never blocks. Records appended after Stop are dropped.
+	void Append(uint32 roomId, RecordType type, const void *data, uint32 size) {
+		if (!running || size > sizeof(Entry::data)) {
+			return;
+		}
+
+		Entry *entry = new Entry();
+		entry->roomId = roomId;
+		entry->type = type;
+		entry->size = size;
+		if (size > 0) {
+			memcpy(entry->data, data, size);
+		}
+
+		// multi-producer push: swing the head to the new node, then link the old head to it
+		Entry *prev = queueHead.exchange(entry, std::memory_order_acq_rel);
+		prev->next.store(entry, std::memory_order_release);
+	}
+
+	// write a journal for a number of matches, each with a number of moves, and time recovering it
+	static void Benchmark(const std::string &path, int numMatches, int numMoves) {
+		std::mt19937 rng(1);
+
+		std::map<uint32, DataPacket> empty;
+		{
+			Journal journal;
+			if (!journal.Start(path, empty)) {
+				return;
+			}
+
+			std::chrono::steady_clock::time_point writeStart = std::chrono::steady_clock::now();
+
+			std::vector<DataPacket> states(numMatches, Rules::newGame());
+			for (int i = 0; i < numMatches; i++) {
+				states[i].checksum = ChecksumPacket(states[i]);
+				journal.Append(i + 1, SNAPSHOT, &states[i], sizeof(DataPacket));
+			}
+
+			// moves are interleaved across matches like a busy server
+			for (int move = 0; move < numMoves; move++) {
+				for (int i = 0; i < numMatches; i++) {
+					DataPacket next = states[i];
+
+					int slot = std::uniform_int_distribution<int>(0, BOARD_SLOTS - 1)(rng);
+					int c, x, y, z;
+					slotCoord(slot, c, x, y, z);
+					if (!Rules::isHole(x, y, z)) {
+						next.board[c][x][y][z] = next.board[c][x][y][z] == Rules::NONE ? next.currentTurn : Rules::NONE;
+					}
+					next.currentTurn = next.currentTurn == Rules::RED ? Rules::BLUE : Rules::RED;
+
+					DeltaPacket delta;
+					BuildDelta(states[i], next, delta);
+					delta.sequence = states[i].sequence + 1;
+					ApplyDelta(states[i], delta, delta.checksum);
+					journal.Append(i + 1, DELTA, &delta, DeltaPacketSize(delta));
+				}
+			}
+
+			journal.Stop();
+
+			double writeSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - writeStart).count();
+			std::cout << "Wrote " << journal.recordsWritten << " records with " << journal.syncs << " syncs in " << writeSeconds << " seconds" << std::endl;
+		}
+
+		std::chrono::steady_clock::time_point recoverStart = std::chrono::steady_clock::now();
+
+		std::map<uint32, DataPacket> rooms;
+		Recover(path, rooms);
+
+		double recoverSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - recoverStart).count();
+		std::cout << "Recovered " << rooms.size() << " of " << numMatches << " matches (" << numMoves << " moves each) in " << recoverSeconds * 1000.0 << " ms" << std::endl;
+	}
+
+private:
+	// one queued record
+	struct Entry {
+		std::atomic<Entry*> next{ nullptr };
+		uint32 roomId = 0;
+		uint32 type = 0;
+		uint32 size = 0;
+		alignas(8) char data[sizeof(DataPacket) > sizeof(DeltaPacket) ? sizeof(DataPacket) : sizeof(DeltaPacket)];
+	};
+
+	std::string path;
+	FILE *file = nullptr;
+
+	std::atomic<bool> running{ false };
+	std::thread writer;
+	EventSignal wakeup;
+
+	// producers swap the head, only the writer touches the tail
+	Entry stub;
+	std::atomic<Entry*> queueHead;
+	Entry *queueTail;
+
+	void Run() {
+		while (true) {
+			bool stopping = !running;
+
+			WriteQueued();
+
+			if (stopping) {
+				break;
+			}
+
+			wakeup.WaitFor(JOURNAL_GROUP_COMMIT);
+		}
+	}
+
+	// write everything queued so far, then make it durable with one sync. Only the writer (or Stop once it has
+	// joined the writer) calls this.
+	void WriteQueued() {
+		int written = 0;
+		while (Entry *entry = Pop()) {
+			WriteRecord(file, entry->roomId, entry->type, entry->data, entry->size);
+			written++;
+		}
+
+		if (written > 0) {
+			Sync(file);
+			recordsWritten += written;
+			syncs++;
+		}
+	}
+
+	// single consumer pop. The returned entry's payload stays valid until the next Pop.
+	Entry *Pop() {
+		Entry *tail = queueTail;
+		Entry *next = tail->next.load(std::memory_order_acquire);
+		if (next == nullptr) {
+			return nullptr;
+		}
+
+		// the consumed node becomes the new stub
+		queueTail = next;
+		if (tail != &stub) {
+			delete tail;
+		}
+		return next;
+	}
+
+	static FILE *OpenExisting(const std::string &path) {
+		FILE *file = nullptr;
+		if (fopen_s(&file, path.c_str(), "rb") == 0 && file != nullptr) {
+			return file;
+		}
+
+		// a crash while compacting can leave only the new file
+		std::string tempPath = path + ".new";
+		if (fopen_s(&file, tempPath.c_str(), "rb") == 0 && file != nullptr) {
+			return file;
+		}
+		return nullptr;
+	}
+
+	static void WriteRecord(FILE *file, uint32 roomId, uint32 type, const void *data, uint32 size) {
+		RecordHeader header;
+		header.size = size;
+		header.check = Check(roomId, type, data, size);
+		header.roomId = roomId;
+		header.type = type;
+
+		fwrite(&header, sizeof(header), 1, file);
+		fwrite(data, 1, size, file);
+	}
+
+	// flush to the OS then to the disk
+	static void Sync(FILE *file) {
+		fflush(file);
+#ifdef _WIN32
+		_commit(_fileno(file));
+#else
+		fsync(fileno(file));
+#endif
+	}
+
+	// FNV-1a
+	static uint32 Check(uint32 roomId, uint32 type, const void *data, uint32 size) {
+		uint32 hash = 2166136261u;
+		const unsigned char *bytes = (const unsigned char*)data;
+
+		hash = (hash ^ roomId) * 16777619u;
+		hash = (hash ^ type) * 16777619u;
+		for (uint32 i = 0; i < size; i++) {
+			hash = (hash ^ bytes[i]) * 16777619u;
+		}
+		return hash;
+	}
+};
+
+#endif
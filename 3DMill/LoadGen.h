@@ -0,0 +1,574 @@
+// headless bots that connect to a server in pairs and play random moves, for sizing servers and catching
+// regressions in the relay path. Nothing here touches graphics so thousands of bots fit in one process.
+#ifndef LOADGEN_H
+#define LOADGEN_H
+
+#include <vector>
+#include <map>
+#include <random>
+#include <chrono>
+#include <iostream>
+
+#include <GameNetworkingSockets/steam/steamnetworkingsockets.h>
+#include <GameNetworkingSockets/steam/isteamnetworkingutils.h>
+
+#include "Tools.h"
+#include "Rules.h"
+#include "Analysis.h"
+#include "Metrics.h"
+#include "Transport.h"
+
+// give up waiting for a move to come back after this long
+const SteamNetworkingMicroseconds BOT_ACTION_TIMEOUT = 5000000;
+
+// messages a flooding bot sends every pass of the loop
+const int BOT_FLOOD_BURST = 100;
+
+// wait before going back to the first server after losing the one hosting the bot's room
+const SteamNetworkingMicroseconds BOT_RECONNECT_DELAY = 1000000;
+
+// one headless client. It keeps the numbered state like Client does and plays whenever it is its turn.
+struct Bot
+{
+	HSteamNetConnection conn = k_HSteamNetConnection_Invalid;
+	uint32 roomId = 0;
+	bool connected = false;
+
+	// 1 is red, 2 is blue (0 until the server says)
+	int assignedTurn = 0;
+
+	// checksums are compared every this many actions if the room runs in lockstep
+	int lockstep = 0;
+
+	DataPacket syncState;
+	bool haveState = false;
+
+	// the move waiting to come back from the server (0 if none). In lockstep nothing comes back,
+	// so it waits for the opponent's answer instead.
+	SteamNetworkingMicroseconds actionSentAt = 0;
+	uint32 actionSequence = 0;
+
+	// think time before the next move
+	SteamNetworkingMicroseconds nextActionAt = 0;
+
+	// sent to another server process hosting the room. If that one goes away the bot goes back to the first server
+	// at reconnectAt to find the room again.
+	bool redirected = false;
+	SteamNetworkingMicroseconds reconnectAt = 0;
+};
+
+class LoadGenerator {
+public:
+	int numBots = 1000;
+
+	// how long to run (0 runs until '/quit')
+	int durationSeconds = 30;
+
+	// pause between it becoming a bot's turn and it moving
+	int thinkMillis = 0;
+
+	// bots join rooms firstRoom, firstRoom + 1, ... two to a room
+	uint32 firstRoom = 1;
+
+	// the first numFlooders bots don't play. They send outline pieces and resync requests as fast as they can,
+	// to check one client can't slow down everyone else's rooms.
+	int numFlooders = 0;
+
+	// print how the bots are doing every second (the whole run is always printed at the end)
+	bool printReports = true;
+
+	// action (move sent) to broadcast (the resulting state recieved back) latency
+	LatencyHistogram actionLatency;
+
+	struct Counters {
+		uint64 messagesIn = 0;
+		uint64 messagesOut = 0;
+		uint64 bytesIn = 0;
+		uint64 bytesOut = 0;
+		uint64 moves = 0;
+		uint64 resyncs = 0;
+		uint64 desyncs = 0;
+		uint64 timeouts = 0;
+		uint64 flooded = 0;
+		uint64 redirects = 0;
+		uint64 reconnects = 0;
+	};
+
+	// everything counted since Run started
+	const Counters &Totals() const
+	{
+		return total;
+	}
+
+	void Run(Transport *transport, const SteamNetworkingIPAddr &serverAddr)
+	{
+		m_pTransport = transport;
+		m_pTransport->SetStatusChangedCallback(StatusChangedCallback, this);
+		entryAddr = serverAddr;
+
+		bots.resize(numBots);
+		for (int i = 0; i < numBots; i++)
+		{
+			bots[i].roomId = firstRoom + i / 2;
+			bots[i].conn = m_pTransport->Connect(serverAddr);
+			if (bots[i].conn == k_HSteamNetConnection_Invalid)
+				std::cout << "Failed to create connection for bot " << i << std::endl;
+			else
+				botsByConnection[bots[i].conn] = i;
+		}
+		std::cout << "Started " << numBots << " bots in " << (numBots + 1) / 2 << " rooms";
+		if (numFlooders > 0)
+			std::cout << ", " << numFlooders << " of them flooding";
+		std::cout << std::endl;
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		reportTime = start;
+
+		while (!g_bQuit)
+		{
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			if (durationSeconds > 0 && now - start >= std::chrono::seconds(durationSeconds))
+				break;
+
+			int numMessages = PollIncomingMessages();
+			m_pTransport->RunCallbacks();
+			PlayMoves();
+
+			if (now - reportTime >= std::chrono::seconds(1))
+				PrintReport(now, false);
+
+			// stay busy while the server is talking, otherwise don't spin
+			if (numMessages == 0)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+
+		PrintReport(std::chrono::steady_clock::now(), true);
+
+		for (int i = 0; i < bots.size(); i++)
+		{
+			if (bots[i].conn != k_HSteamNetConnection_Invalid)
+				m_pTransport->CloseConnection(bots[i].conn, 0, "Load test over", true);
+		}
+		bots.clear();
+		botsByConnection.clear();
+
+		m_pTransport->SetStatusChangedCallback(nullptr, nullptr);
+		m_pTransport = nullptr;
+	}
+
+private:
+	Transport *m_pTransport = nullptr;
+	SteamNetworkingIPAddr entryAddr;
+
+	std::vector<Bot> bots;
+	std::map<HSteamNetConnection, int> botsByConnection;
+
+	std::mt19937 rng{ 1 };
+
+	// totals and the totals at the last report
+	Counters total;
+	Counters reported;
+	std::chrono::steady_clock::time_point reportTime;
+
+	// the latency since the last report (actionLatency holds the whole run)
+	LatencyHistogram intervalLatency;
+
+	Bot *FindBot(HSteamNetConnection conn)
+	{
+		auto it = botsByConnection.find(conn);
+		return it == botsByConnection.end() ? nullptr : &bots[it->second];
+	}
+
+	void Send(Bot &bot, const void *data, uint32 size)
+	{
+		m_pTransport->SendMessageToConnection(bot.conn, data, size, k_nSteamNetworkingSend_Reliable);
+		total.messagesOut++;
+		total.bytesOut += size;
+	}
+
+	int PollIncomingMessages()
+	{
+		ISteamNetworkingMessage *messages[256];
+		int numRecieved = 0;
+
+		while (!g_bQuit)
+		{
+			int numMsgs = m_pTransport->ReceiveMessages(messages, 256);
+			if (numMsgs <= 0)
+				break;
+
+			for (int i = 0; i < numMsgs; i++)
+			{
+				total.messagesIn++;
+				total.bytesIn += messages[i]->m_cbSize;
+
+				// the server packs everything it has for a bot in one go into one message
+				Bot *bot = FindBot(messages[i]->m_conn);
+				SteamNetworkingMicroseconds receivedAt = messages[i]->m_usecTimeReceived;
+				if (bot != nullptr)
+					UnpackMessages(messages[i]->m_pData, messages[i]->m_cbSize, [&](const void *payload, int size) { HandleMessage(*bot, payload, size, receivedAt); });
+
+				messages[i]->Release();
+			}
+			numRecieved += numMsgs;
+		}
+
+		return numRecieved;
+	}
+
+	void HandleMessage(Bot &bot, const void *payload, int size, SteamNetworkingMicroseconds receivedAt)
+	{
+		if (size < (int)sizeof(DataPacket::MsgType))
+			return;
+
+		DataPacket *data = (DataPacket*)payload;
+		switch (data->type)
+		{
+			case DataPacket::MsgType::GAME_SETUP: {
+				if (size >= (int)sizeof(DataPacket))
+				{
+					bot.assignedTurn = data->assignedTurn;
+					bot.lockstep = data->lockstep;
+				}
+				break;
+			}
+			// full state (on joining or after a resync)
+			case DataPacket::MsgType::GAME_DATA: {
+				if (size < (int)sizeof(DataPacket))
+					break;
+
+				bot.syncState = *data;
+				bot.haveState = true;
+				ActionReturned(bot, receivedAt);
+				break;
+			}
+			case DataPacket::MsgType::GAME_DELTA: {
+				DeltaPacket *delta = (DeltaPacket*)payload;
+				if (!bot.haveState || size < (int)offsetof(DeltaPacket, changes) || delta->numChanges < 0 || delta->numChanges > BOARD_SLOTS ||
+					size < (int)DeltaPacketSize(*delta))
+					break;
+
+				// same checks as the real client
+				if (delta->sequence != bot.syncState.sequence + 1)
+				{
+					RequestSnapshot(bot);
+					break;
+				}
+				uint64 checksum = 0;
+				if (!ApplyDelta(bot.syncState, *delta, checksum) || checksum != delta->checksum)
+				{
+					total.desyncs++;
+					RequestSnapshot(bot);
+					break;
+				}
+
+				ActionReturned(bot, receivedAt);
+				break;
+			}
+			// the room is hosted by another server process
+			case DataPacket::MsgType::ROOM_REDIRECT: {
+				RedirectPacket *redirect = (RedirectPacket*)payload;
+				SteamNetworkingIPAddr addr;
+				if (size < (int)sizeof(RedirectPacket) || !addr.ParseString(redirect->address))
+					break;
+
+				total.redirects++;
+				bot.redirected = true;
+				ConnectBot(bot, addr);
+				break;
+			}
+			// the opponent's move in a lockstep room
+			case DataPacket::MsgType::GAME_ACTION: {
+				DeltaPacket *action = (DeltaPacket*)payload;
+				if (!bot.haveState || size < (int)offsetof(DeltaPacket, changes) || action->numChanges < 0 || action->numChanges > BOARD_SLOTS ||
+					size < (int)DeltaPacketSize(*action) || !Rules::legalChanges(*action))
+					break;
+
+				if (action->sequence != bot.syncState.sequence + 1)
+				{
+					RequestSnapshot(bot);
+					break;
+				}
+				uint64 checksum = 0;
+				if (!ApplyDelta(bot.syncState, *action, checksum) || (action->checksum != 0 && checksum != action->checksum))
+				{
+					total.desyncs++;
+					RequestSnapshot(bot);
+					break;
+				}
+
+				ActionReturned(bot, receivedAt);
+				break;
+			}
+			default: {
+				break;
+			}
+		}
+	}
+
+	// drop the bot's connection (if it has one) and connect it somewhere else
+	void ConnectBot(Bot &bot, const SteamNetworkingIPAddr &addr)
+	{
+		if (bot.conn != k_HSteamNetConnection_Invalid)
+		{
+			m_pTransport->CloseConnection(bot.conn, 0, "Redirected", false);
+			botsByConnection.erase(bot.conn);
+		}
+
+		bot.connected = false;
+		bot.haveState = false;
+		bot.actionSentAt = 0;
+		bot.conn = m_pTransport->Connect(addr);
+		if (bot.conn != k_HSteamNetConnection_Invalid)
+			botsByConnection[bot.conn] = (int)(&bot - &bots[0]);
+	}
+
+	void RequestSnapshot(Bot &bot)
+	{
+		bot.haveState = false;
+		total.resyncs++;
+
+		DataPacket request;
+		request.type = DataPacket::MsgType::GAME_RESYNC;
+		Send(bot, &request, (uint32)sizeof(request));
+	}
+
+	// a state came back newer than the one the bot moved from
+	void ActionReturned(Bot &bot, SteamNetworkingMicroseconds receivedAt)
+	{
+		if (bot.actionSentAt == 0 || bot.syncState.sequence <= bot.actionSequence)
+			return;
+
+		SteamNetworkingMicroseconds latency = receivedAt - bot.actionSentAt;
+		actionLatency.record(latency);
+		intervalLatency.record(latency);
+
+		bot.actionSentAt = 0;
+		bot.nextActionAt = receivedAt + (SteamNetworkingMicroseconds)thinkMillis * 1000;
+	}
+
+	void PlayMoves()
+	{
+		SteamNetworkingMicroseconds now = m_pTransport->GetLocalTimestamp();
+
+		for (int i = 0; i < bots.size(); i++)
+		{
+			Bot &bot = bots[i];
+			if (bot.reconnectAt != 0 && now >= bot.reconnectAt)
+			{
+				bot.reconnectAt = 0;
+				bot.redirected = false;
+				total.reconnects++;
+				ConnectBot(bot, entryAddr);
+				continue;
+			}
+			if (bot.connected && i < numFlooders)
+			{
+				Flood(bot);
+				continue;
+			}
+			if (!bot.connected || !bot.haveState || bot.assignedTurn == 0)
+				continue;
+
+			// forget a move that never came back
+			if (bot.actionSentAt != 0)
+			{
+				if (now - bot.actionSentAt < BOT_ACTION_TIMEOUT)
+					continue;
+
+				bot.actionSentAt = 0;
+				total.timeouts++;
+			}
+
+			if (bot.syncState.currentTurn != bot.assignedTurn || now < bot.nextActionAt)
+				continue;
+
+			DataPacket next = bot.syncState;
+			next.type = DataPacket::MsgType::GAME_DATA;
+			ChooseMove(bot, next);
+
+			bot.actionSentAt = now;
+			bot.actionSequence = bot.syncState.sequence;
+			total.moves++;
+
+			if (bot.lockstep > 0)
+				SendLockstepAction(bot, next);
+			else
+				Send(bot, &next, (uint32)sizeof(next));
+		}
+	}
+
+	// same as the real client: apply the move here and only send what changed
+	void SendLockstepAction(Bot &bot, const DataPacket &next)
+	{
+		DeltaPacket action;
+		BuildDelta(bot.syncState, next, action);
+		action.type = DataPacket::MsgType::GAME_ACTION;
+		action.sequence = bot.syncState.sequence + 1;
+		action.actionTurn = bot.assignedTurn;
+
+		uint64 checksum = 0;
+		ApplyDelta(bot.syncState, action, checksum);
+		action.checksum = action.sequence % bot.lockstep == 0 ? checksum : 0;
+		bot.actionSequence = action.sequence;
+
+		Send(bot, &action, DeltaPacketSize(action));
+	}
+
+	void Flood(Bot &bot)
+	{
+		SelectionPacket selection;
+		selection.visible = true;
+		for (int i = 0; i < BOT_FLOOD_BURST; i++)
+		{
+			selection.sequence++;
+			m_pTransport->SendMessageToConnection(bot.conn, &selection, (uint32)sizeof(selection), k_nSteamNetworkingSend_UnreliableNoDelay);
+		}
+
+		DataPacket request;
+		request.type = DataPacket::MsgType::GAME_RESYNC;
+		for (int i = 0; i < BOT_FLOOD_BURST; i++)
+			m_pTransport->SendMessageToConnection(bot.conn, &request, (uint32)sizeof(request), k_nSteamNetworkingSend_Reliable);
+
+		total.flooded += BOT_FLOOD_BURST * 2;
+	}
+
+	void SetSlot(DataPacket &data, int slot, int value)
+	{
+		int c, x, y, z;
+		slotCoord(slot, c, x, y, z);
+		data.board[c][x][y][z] = value;
+	}
+
+	// random legal play: a move and the takes for every mill it closes in one submission, with the point for a win
+	// added the way the server does it (lockstep rooms check it). A finished match is started over, as is one the bot
+	// can't move in, though the server only clears that board once the other player asks too. The other bot moves
+	// first after a new game, since in lockstep nothing answers a bot's action until its opponent acts.
+	void ChooseMove(Bot &bot, DataPacket &next)
+	{
+		int me = bot.assignedTurn;
+		int opponent = me == Rules::RED ? Rules::BLUE : Rules::RED;
+
+		AnalysisPosition position;
+		std::vector<AnalysisMove> moves;
+		if (Rules::checkWin(next) == Rules::NONE && position.FromPacket(next))
+			position.GenerateMoves(moves);
+
+		if (moves.empty())
+		{
+			Rules::clearBoard(next);
+			next.piecesLeft1 = 23;
+			next.piecesLeft2 = 23;
+			next.currentTurn = opponent;
+			return;
+		}
+
+		const AnalysisMove &move = moves[std::uniform_int_distribution<int>(0, (int)moves.size() - 1)(rng)];
+		if (move.from < 0)
+			(me == Rules::RED ? next.piecesLeft1 : next.piecesLeft2)--;
+		else
+			SetSlot(next, move.from, Rules::NONE);
+		SetSlot(next, move.to, me);
+
+		for (int i = 0; i < move.numTaken; i++)
+			SetSlot(next, move.taken[i], Rules::NONE);
+
+		next.currentTurn = opponent;
+		Rules::addWin(next, Rules::checkWin(next));
+	}
+
+	void PrintReport(std::chrono::steady_clock::time_point now, bool final)
+	{
+		double seconds = std::chrono::duration<double>(now - reportTime).count();
+		if (seconds <= 0)
+			seconds = 1;
+
+		int connected = 0;
+		for (int i = 0; i < bots.size(); i++)
+		{
+			if (bots[i].connected)
+				connected++;
+		}
+
+		if (printReports)
+		{
+			std::cout << connected << "/" << bots.size() << " bots connected. " <<
+				(total.moves - reported.moves) / seconds << " moves/sec, " <<
+				(total.messagesIn - reported.messagesIn) / seconds << " msgs/sec in, " << (total.messagesOut - reported.messagesOut) / seconds << " msgs/sec out, " <<
+				(total.bytesIn - reported.bytesIn) / seconds << " bytes/sec in, " << (total.bytesOut - reported.bytesOut) / seconds << " bytes/sec out" << std::endl;
+			PrintLatency("  action to broadcast (us):", intervalLatency);
+		}
+
+		intervalLatency.reset();
+		reported = total;
+		reportTime = now;
+
+		if (final)
+		{
+			std::cout << "Whole run: " << total.moves << " moves, " << total.messagesIn << " msgs in, " << total.messagesOut << " msgs out, " <<
+				total.bytesIn << " bytes in, " << total.bytesOut << " bytes out, " << total.resyncs << " resyncs, " << total.desyncs << " checksum mismatches, " << total.timeouts << " timeouts" << std::endl;
+			if (numFlooders > 0)
+				std::cout << numFlooders << " flooding bots sent " << total.flooded << " messages" << std::endl;
+			if (total.redirects > 0)
+				std::cout << total.redirects << " redirects to other shards, " << total.reconnects << " reconnects after losing one" << std::endl;
+			PrintLatency("  action to broadcast (us):", actionLatency);
+		}
+	}
+
+	void PrintLatency(const char *label, const LatencyHistogram &histogram)
+	{
+		std::cout << label << " p50 " << histogram.percentile(0.5) << ", p95 " << histogram.percentile(0.95) << ", p99 " << histogram.percentile(0.99) <<
+			", max " << histogram.max << " over " << histogram.count << " moves" << std::endl;
+	}
+
+	void OnStatusChanged(SteamNetConnectionStatusChangedCallback_t *pInfo)
+	{
+		Bot *bot = FindBot(pInfo->m_hConn);
+		if (bot == nullptr)
+			return;
+
+		switch (pInfo->m_info.m_eState)
+		{
+		case k_ESteamNetworkingConnectionState_Connected:
+		{
+			bot->connected = true;
+
+			// back in the same color after a reconnect
+			RoomPacket room;
+			room.roomId = bot->roomId;
+			room.turn = bot->assignedTurn;
+			Send(*bot, &room, (uint32)sizeof(room));
+			break;
+		}
+
+		case k_ESteamNetworkingConnectionState_ClosedByPeer:
+		case k_ESteamNetworkingConnectionState_ProblemDetectedLocally:
+		{
+			bot->connected = false;
+			m_pTransport->CloseConnection(pInfo->m_hConn, 0, nullptr, false);
+			botsByConnection.erase(pInfo->m_hConn);
+			bot->conn = k_HSteamNetConnection_Invalid;
+
+			// the server hosting the room went away, the first server knows where it is now
+			if (bot->redirected)
+			{
+				bot->reconnectAt = m_pTransport->GetLocalTimestamp() + BOT_RECONNECT_DELAY;
+				break;
+			}
+
+			std::cout << "Bot lost its connection. " << pInfo->m_info.m_szEndDebug << std::endl;
+			break;
+		}
+
+		default:
+			break;
+		}
+	}
+
+	static void StatusChangedCallback(SteamNetConnectionStatusChangedCallback_t *pInfo, void *context)
+	{
+		((LoadGenerator*)context)->OnStatusChanged(pInfo);
+	}
+};
+
+#endif
@@ -0,0 +1,411 @@
+// in-memory transport so whole matches (or thousands of rooms) can run inside one process with no sockets.
+// every endpoint (server or client) gets its own LoopbackTransport, all sharing one LoopbackNetwork.
+#ifndef LOOPBACK_TRANSPORT_H
+#define LOOPBACK_TRANSPORT_H
+
+#include <map>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <random>
+#include <string>
+#include <chrono>
+#include <atomic>
+
+#include "Transport.h"
+
+class LoopbackTransport;
+
+// how long a lost reliable message takes to be noticed and sent again, on top of the round trip
+const SteamNetworkingMicroseconds LOOPBACK_RESEND_DELAY = 20000;
+
+// the wire between loopback endpoints. Latency, jitter and loss are applied to every message sent on it.
+class LoopbackNetwork {
+public:
+	// delay before a sent message can be recieved
+	SteamNetworkingMicroseconds latency = 0;
+
+	// each message waits a random 0 to jitter on top of the latency. Unreliable messages can overtake each other,
+	// reliable ones still arrive in the order they were sent.
+	SteamNetworkingMicroseconds jitter = 0;
+
+	// chance (0-1) that a message is lost. A lost unreliable message is dropped, a lost reliable one is sent again
+	// a round trip later and holds up the reliable messages behind it.
+	float lossChance = 0.0f;
+
+	// the seed makes which messages are dropped and how late they are repeatable. Every connection draws from its
+	// own generator, so what happens to its messages doesn't depend on how threads sending elsewhere were scheduled.
+	LoopbackNetwork(uint32 seed = 1) : seed(seed) {}
+
+	// run on a clock that only moves when AdvanceClock is called instead of the real one. Messages are then recieved
+	// at exact simulated times, so a test that sends from one thread and steps the clock sees the same thing every run.
+	// only call before anything is connected.
+	void UseVirtualClock(SteamNetworkingMicroseconds start = 0) {
+		virtualNow = start;
+		virtualClock = true;
+	}
+
+	void AdvanceClock(SteamNetworkingMicroseconds micros) {
+		virtualNow += micros;
+	}
+
+	// the time every endpoint on this network sees
+	SteamNetworkingMicroseconds Now() const {
+		if (virtualClock)
+			return virtualNow;
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+private:
+	friend class LoopbackTransport;
+
+	// one side of a connection
+	struct End {
+		LoopbackTransport *owner;
+		HSteamNetConnection peer;
+		ESteamNetworkingConnectionState state;
+		std::string name;
+
+		// when the last reliable message sent from this end arrives, nothing reliable may arrive before it
+		SteamNetworkingMicroseconds reliableDeliverAt = 0;
+
+		// decides the jitter and loss of everything sent from this end
+		std::mt19937 rng;
+		// messages sent from this end so far
+		uint64 sent = 0;
+	};
+
+	// guards everything below and the inboxes of every endpoint
+	std::mutex mutexNetwork;
+
+	uint32 seed;
+	bool virtualClock = false;
+	std::atomic<SteamNetworkingMicroseconds> virtualNow{ 0 };
+
+	HSteamNetConnection nextConnection = 1;
+
+	std::map<uint16, LoopbackTransport*> listeners;
+	std::map<HSteamNetConnection, End> ends;
+};
+
+class LoopbackTransport : public Transport {
+public:
+	LoopbackTransport(LoopbackNetwork &network) : m_network(network) {}
+
+	~LoopbackTransport() {
+		std::lock_guard<std::mutex> lock(m_network.mutexNetwork);
+
+		if (m_listenPort != 0)
+			m_network.listeners.erase(m_listenPort);
+
+		// close whatever is still open so the other side finds out
+		std::vector<HSteamNetConnection> open;
+		for (auto &it : m_network.ends) {
+			if (it.second.owner == this)
+				open.push_back(it.first);
+		}
+		for (int i = 0; i < open.size(); i++)
+			CloseLocked(open[i], 0, "Transport destroyed");
+
+		for (int i = 0; i < inbox.size(); i++)
+			inbox[i].msg->Release();
+	}
+
+	bool Listen(uint16 port) {
+		std::lock_guard<std::mutex> lock(m_network.mutexNetwork);
+
+		auto itListener = m_network.listeners.find(port);
+		if (itListener != m_network.listeners.end())
+			return itListener->second == this;
+
+		m_network.listeners[port] = this;
+		m_listenPort = port;
+		return true;
+	}
+
+	HSteamNetConnection Connect(const SteamNetworkingIPAddr &addr) {
+		std::lock_guard<std::mutex> lock(m_network.mutexNetwork);
+
+		HSteamNetConnection conn = m_network.nextConnection++;
+		m_network.ends[conn] = { this, k_HSteamNetConnection_Invalid, k_ESteamNetworkingConnectionState_Connecting, "" };
+		SeedEnd(conn);
+		QueueStatus(this, conn, k_ESteamNetworkingConnectionState_None, 0, "");
+
+		auto itListener = m_network.listeners.find(addr.m_port);
+		if (itListener == m_network.listeners.end()) {
+			m_network.ends[conn].state = k_ESteamNetworkingConnectionState_ProblemDetectedLocally;
+			QueueStatus(this, conn, k_ESteamNetworkingConnectionState_Connecting, k_ESteamNetConnectionEnd_Misc_Generic, "Nothing is listening on that port");
+			return conn;
+		}
+
+		// the listener gets its own handle for the other end
+		HSteamNetConnection remote = m_network.nextConnection++;
+		m_network.ends[remote] = { itListener->second, conn, k_ESteamNetworkingConnectionState_Connecting, "" };
+		SeedEnd(remote);
+		m_network.ends[conn].peer = remote;
+		QueueStatus(itListener->second, remote, k_ESteamNetworkingConnectionState_None, 0, "");
+
+		return conn;
+	}
+
+	bool AcceptConnection(HSteamNetConnection conn) {
+		std::lock_guard<std::mutex> lock(m_network.mutexNetwork);
+
+		LoopbackNetwork::End *end = FindEnd(conn);
+		if (end == nullptr || end->state != k_ESteamNetworkingConnectionState_Connecting)
+			return false;
+
+		LoopbackNetwork::End *peer = FindEnd(end->peer);
+		if (peer == nullptr || peer->state != k_ESteamNetworkingConnectionState_Connecting)
+			return false;
+
+		end->state = k_ESteamNetworkingConnectionState_Connected;
+		peer->state = k_ESteamNetworkingConnectionState_Connected;
+		QueueStatus(this, conn, k_ESteamNetworkingConnectionState_Connecting, 0, "");
+		QueueStatus(peer->owner, end->peer, k_ESteamNetworkingConnectionState_Connecting, 0, "");
+		return true;
+	}
+
+	void CloseConnection(HSteamNetConnection conn, int reason, const char *debug, bool linger) {
+		std::lock_guard<std::mutex> lock(m_network.mutexNetwork);
+		CloseLocked(conn, reason, debug);
+	}
+
+	void SetConnectionName(HSteamNetConnection conn, const char *name) {
+		std::lock_guard<std::mutex> lock(m_network.mutexNetwork);
+
+		LoopbackNetwork::End *end = FindEnd(conn);
+		if (end != nullptr)
+			end->name = name;
+	}
+
+	int ReceiveMessages(ISteamNetworkingMessage **ppOutMessages, int nMaxMessages) {
+		SteamNetworkingMicroseconds now = GetLocalTimestamp();
+
+		std::lock_guard<std::mutex> lock(m_network.mutexNetwork);
+
+		// the inbox is kept in delivery order
+		int count = 0;
+		while (count < nMaxMessages && !inbox.empty() && inbox.front().deliverAt <= now) {
+			ppOutMessages[count] = inbox.front().msg;
+			ppOutMessages[count]->m_usecTimeReceived = inbox.front().deliverAt;
+			inbox.pop_front();
+			count++;
+		}
+		return count;
+	}
+
+	EResult SendMessageToConnection(HSteamNetConnection conn, const void *data, uint32 size, int sendFlags) {
+		SharedBuffer *buffer = SharedBuffer::Create(data, size, 1);
+
+		std::lock_guard<std::mutex> lock(m_network.mutexNetwork);
+		return SendLocked(conn, buffer, size, sendFlags);
+	}
+
+	void SendMessageToConnections(const std::vector<HSteamNetConnection> &conns, const void *data, uint32 size, int sendFlags) {
+		if (conns.empty())
+			return;
+
+		SharedBuffer *buffer = SharedBuffer::Create(data, size, (int)conns.size());
+
+		std::lock_guard<std::mutex> lock(m_network.mutexNetwork);
+		for (int i = 0; i < conns.size(); i++)
+			SendLocked(conns[i], buffer, size, sendFlags);
+	}
+
+	void SendMessages(const std::vector<OutboundMessage> &outbound) {
+		if (outbound.empty())
+			return;
+
+		std::lock_guard<std::mutex> lock(m_network.mutexNetwork);
+		for (int i = 0; i < outbound.size(); i++)
+			SendLocked(outbound[i].conn, outbound[i].buffer, outbound[i].size, outbound[i].sendFlags);
+	}
+
+	void RunCallbacks() {
+		std::vector<SteamNetConnectionStatusChangedCallback_t> changes;
+		{
+			std::lock_guard<std::mutex> lock(m_network.mutexNetwork);
+			changes.swap(statusChanges);
+		}
+
+		// called without the lock so the callback can use the transport
+		for (int i = 0; i < changes.size(); i++)
+			StatusChanged(&changes[i]);
+	}
+
+	// doesn't need the library to be initialized
+	SteamNetworkingMicroseconds GetLocalTimestamp() {
+		return m_network.Now();
+	}
+
+	// nothing ever waits to be sent, so messages still on their way count as sent but unacknowledged
+	bool GetQuickConnectionStatus(HSteamNetConnection conn, SteamNetworkingQuickConnectionStatus *pStatus) {
+		SteamNetworkingMicroseconds now = GetLocalTimestamp();
+
+		std::lock_guard<std::mutex> lock(m_network.mutexNetwork);
+
+		LoopbackNetwork::End *end = FindEnd(conn);
+		if (end == nullptr || end->owner != this)
+			return false;
+
+		memset(pStatus, 0, sizeof(*pStatus));
+		pStatus->m_eState = end->state;
+		pStatus->m_nPing = (int)(m_network.latency * 2 / 1000);
+		pStatus->m_flConnectionQualityLocal = 1.0f - m_network.lossChance;
+		pStatus->m_flConnectionQualityRemote = 1.0f - m_network.lossChance;
+
+		LoopbackNetwork::End *peer = FindEnd(end->peer);
+		if (peer != nullptr) {
+			for (int i = 0; i < peer->owner->inbox.size(); i++) {
+				const Pending &pending = peer->owner->inbox[i];
+				if (pending.msg->m_conn == end->peer && pending.deliverAt > now)
+					pStatus->m_cbSentUnackedReliable += pending.msg->m_cbSize;
+			}
+		}
+		return true;
+	}
+
+private:
+	LoopbackNetwork &m_network;
+	uint16 m_listenPort = 0;
+
+	// recieved messages are owned by the reciever, which frees its reference to the payload
+	struct LoopbackMessage : public SteamNetworkingMessage_t {
+		static void ReleaseMessage(SteamNetworkingMessage_t *msg) {
+			if (msg->m_pfnFreeData != nullptr)
+				msg->m_pfnFreeData(msg);
+			delete (LoopbackMessage*)msg;
+		}
+	};
+
+	struct Pending {
+		SteamNetworkingMicroseconds deliverAt;
+		ISteamNetworkingMessage *msg;
+		// place in what its connection sent
+		uint64 order;
+
+		// messages due at the same time arrive by connection, then in the order they were sent, not in whatever
+		// order the sending threads happened to run
+		bool after(const Pending &other) const {
+			if (deliverAt != other.deliverAt)
+				return deliverAt > other.deliverAt;
+			if (msg->m_conn != other.msg->m_conn)
+				return msg->m_conn > other.msg->m_conn;
+			return order > other.order;
+		}
+	};
+
+	// everything below is guarded by the network mutex
+	std::deque<Pending> inbox;
+	std::vector<SteamNetConnectionStatusChangedCallback_t> statusChanges;
+
+	LoopbackNetwork::End *FindEnd(HSteamNetConnection conn) {
+		auto it = m_network.ends.find(conn);
+		return it == m_network.ends.end() ? nullptr : &it->second;
+	}
+
+	// handles are given out in the order connections are made, so the same connections get the same generators
+	void SeedEnd(HSteamNetConnection conn) {
+		m_network.ends[conn].rng.seed(m_network.seed * 2654435761u ^ conn);
+	}
+
+	// takes one reference to the buffer either way
+	EResult SendLocked(HSteamNetConnection conn, SharedBuffer *buffer, uint32 size, int sendFlags) {
+		LoopbackNetwork::End *end = FindEnd(conn);
+		if (end == nullptr || end->owner != this || end->state != k_ESteamNetworkingConnectionState_Connected) {
+			buffer->Release();
+			return k_EResultInvalidState;
+		}
+
+		LoopbackNetwork::End *peer = FindEnd(end->peer);
+		if (peer == nullptr || peer->state != k_ESteamNetworkingConnectionState_Connected) {
+			buffer->Release();
+			return k_EResultNoConnection;
+		}
+
+		SteamNetworkingMicroseconds deliverAt = GetLocalTimestamp() + m_network.latency;
+		if (m_network.jitter > 0)
+			deliverAt += std::uniform_int_distribution<SteamNetworkingMicroseconds>(0, m_network.jitter)(end->rng);
+
+		if (sendFlags & k_nSteamNetworkingSend_Reliable) {
+			// every time it is lost it goes again once the sender notices
+			while (m_network.lossChance > 0.0f && std::uniform_real_distribution<float>(0.0f, 1.0f)(end->rng) < m_network.lossChance)
+				deliverAt += m_network.latency * 2 + LOOPBACK_RESEND_DELAY;
+
+			if (deliverAt < end->reliableDeliverAt)
+				deliverAt = end->reliableDeliverAt;
+			end->reliableDeliverAt = deliverAt;
+		}
+		// lost on the way
+		else if (m_network.lossChance > 0.0f && std::uniform_real_distribution<float>(0.0f, 1.0f)(end->rng) < m_network.lossChance) {
+			buffer->Release();
+			return k_EResultOK;
+		}
+
+		LoopbackMessage *msg = new LoopbackMessage();
+		msg->m_conn = end->peer;
+		msg->m_nFlags = sendFlags;
+		msg->m_pfnRelease = LoopbackMessage::ReleaseMessage;
+		buffer->Attach(msg, size);
+
+		Pending pending;
+		pending.deliverAt = deliverAt;
+		pending.msg = msg;
+		pending.order = end->sent++;
+
+		std::deque<Pending> &peerInbox = peer->owner->inbox;
+		auto it = peerInbox.end();
+		while (it != peerInbox.begin() && (it - 1)->after(pending))
+			--it;
+		peerInbox.insert(it, pending);
+
+		return k_EResultOK;
+	}
+
+	void CloseLocked(HSteamNetConnection conn, int reason, const char *debug) {
+		auto itEnd = m_network.ends.find(conn);
+		if (itEnd == m_network.ends.end() || itEnd->second.owner != this)
+			return;
+
+		// tell the other side unless it already knows
+		LoopbackNetwork::End *peer = FindEnd(itEnd->second.peer);
+		if (peer != nullptr) {
+			ESteamNetworkingConnectionState oldState = peer->state;
+			if (oldState == k_ESteamNetworkingConnectionState_Connecting || oldState == k_ESteamNetworkingConnectionState_Connected) {
+				peer->state = k_ESteamNetworkingConnectionState_ClosedByPeer;
+				QueueStatus(peer->owner, itEnd->second.peer, oldState, reason, debug);
+			}
+			peer->peer = k_HSteamNetConnection_Invalid;
+		}
+
+		m_network.ends.erase(itEnd);
+
+		// anything not yet recieved on a closed connection is thrown away
+		for (int i = (int)inbox.size() - 1; i >= 0; i--) {
+			if (inbox[i].msg->m_conn == conn) {
+				inbox[i].msg->Release();
+				inbox.erase(inbox.begin() + i);
+			}
+		}
+	}
+
+	// the new state is whatever the end is in now
+	void QueueStatus(LoopbackTransport *owner, HSteamNetConnection conn, ESteamNetworkingConnectionState oldState, int reason, const char *debug) {
+		LoopbackNetwork::End *end = FindEnd(conn);
+
+		SteamNetConnectionStatusChangedCallback_t info;
+		memset(&info, 0, sizeof(info));
+		info.m_hConn = conn;
+		info.m_eOldState = oldState;
+		info.m_info.m_eState = end != nullptr ? end->state : k_ESteamNetworkingConnectionState_None;
+		info.m_info.m_eEndReason = reason;
+		strncpy_s(info.m_info.m_szEndDebug, sizeof(info.m_info.m_szEndDebug), debug != nullptr ? debug : "", _TRUNCATE);
+		sprintf_s(info.m_info.m_szConnectionDescription, "loopback #%u", conn);
+		info.m_info.m_addrRemote.SetIPv6LocalHost();
+
+		owner->statusChanges.push_back(info);
+	}
+};
+
+#endif
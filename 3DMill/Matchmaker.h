@@ -0,0 +1,324 @@
+// pairs up players waiting for a match by rating. Everyone accepts opponents within a rating window that grows
+// the longer they wait, so close matches are made straight away and nobody waits forever.
+// waiting players are kept sorted by rating, so only players next to each other in that order can be the best
+// match for each other. Every neighbouring pair is scheduled for the moment the longer waiter's window reaches
+// the gap between them, and pairs are made in that order. Adding, cancelling and pairing are all O(log n).
+#ifndef MATCHMAKER_H
+#define MATCHMAKER_H
+
+#include <limits.h>
+#include <set>
+#include <queue>
+#include <vector>
+#include <unordered_map>
+#include <random>
+#include <chrono>
+#include <iostream>
+
+#include "Tools.h"
+#include "Metrics.h"
+
+// rating gap anyone accepts straight away
+const int MATCH_RATING_WINDOW = 100;
+// how much wider the window gets for every second waited
+const double MATCH_WINDOW_GROWTH = 50.0;
+
+class Matchmaker {
+public:
+	typedef std::chrono::steady_clock::time_point TimePoint;
+
+	struct Match {
+		uint32 player1;
+		uint32 player2;
+		int rating1;
+		int rating2;
+		std::chrono::microseconds wait1;
+		std::chrono::microseconds wait2;
+	};
+
+	// since the start. Waits are in milliseconds.
+	uint64 matchesMade = 0;
+	LatencyHistogram waitTime;
+	LatencyHistogram ratingGap;
+
+	size_t Waiting() const {
+		return waiting.size();
+	}
+
+	bool IsWaiting(uint32 player) const {
+		return players.find(player) != players.end();
+	}
+
+	// the widest rating gap a player accepts after waiting this long
+	static double Window(std::chrono::microseconds waited) {
+		return MATCH_RATING_WINDOW + MATCH_WINDOW_GROWTH * std::chrono::duration<double>(waited).count();
+	}
+
+	// add a player to the queue. A player already waiting keeps their place.
+	bool Enqueue(uint32 player, int rating, TimePoint now) {
+		if (IsWaiting(player)) {
+			return false;
+		}
+
+		Waiter waiter;
+		waiter.rating = rating;
+		waiter.ticket = ++nextTicket;
+		waiter.player = player;
+		waiter.enqueued = now;
+
+		auto it = waiting.insert(waiter).first;
+		players[player] = it;
+
+		// the new player is the only new neighbour on each side
+		if (it != waiting.begin()) {
+			Schedule(*std::prev(it), *it);
+		}
+		auto next = std::next(it);
+		if (next != waiting.end()) {
+			Schedule(*it, *next);
+		}
+		return true;
+	}
+
+	// take a player out of the queue (they left or joined a room themselves)
+	bool Cancel(uint32 player) {
+		auto itPlayer = players.find(player);
+		if (itPlayer == players.end()) {
+			return false;
+		}
+
+		auto it = itPlayer->second;
+		auto before = it == waiting.begin() ? waiting.end() : std::prev(it);
+		auto after = std::next(it);
+
+		waiting.erase(it);
+		players.erase(itPlayer);
+
+		// the players either side are now next to each other
+		if (before != waiting.end() && after != waiting.end()) {
+			Schedule(*before, *after);
+		}
+		return true;
+	}
+
+	// make every match that has become acceptable by now, longest waiting first. Returns the number made.
+	int Update(TimePoint now, std::vector<Match> &matches) {
+		int made = 0;
+		while (!candidates.empty() && candidates.top().when <= now) {
+			Candidate candidate = candidates.top();
+			candidates.pop();
+
+			// pairs are only valid while both are still waiting and still next to each other
+			auto it1 = Find(candidate.player1, candidate.ticket1);
+			auto it2 = Find(candidate.player2, candidate.ticket2);
+			if (it1 == waiting.end() || it2 == waiting.end() || std::next(it1) != it2) {
+				continue;
+			}
+
+			Match match;
+			match.player1 = it1->player;
+			match.player2 = it2->player;
+			match.rating1 = it1->rating;
+			match.rating2 = it2->rating;
+			match.wait1 = std::chrono::duration_cast<std::chrono::microseconds>(now - it1->enqueued);
+			match.wait2 = std::chrono::duration_cast<std::chrono::microseconds>(now - it2->enqueued);
+			matches.push_back(match);
+
+			matchesMade++;
+			made++;
+			waitTime.record(match.wait1.count() / 1000);
+			waitTime.record(match.wait2.count() / 1000);
+			ratingGap.record(match.rating2 - match.rating1);
+
+			auto before = it1 == waiting.begin() ? waiting.end() : std::prev(it1);
+			auto after = std::next(it2);
+
+			players.erase(it1->player);
+			players.erase(it2->player);
+			waiting.erase(it1);
+			waiting.erase(it2);
+
+			if (before != waiting.end() && after != waiting.end()) {
+				Schedule(*before, *after);
+			}
+		}
+		return made;
+	}
+
+	// when Update will next have a match to make (TimePoint::max() if nobody can be paired)
+	TimePoint NextMatchTime() {
+		// drop pairs that are no longer valid so they don't wake anyone up
+		while (!candidates.empty()) {
+			const Candidate &candidate = candidates.top();
+			auto it1 = Find(candidate.player1, candidate.ticket1);
+			auto it2 = Find(candidate.player2, candidate.ticket2);
+			if (it1 != waiting.end() && it2 != waiting.end() && std::next(it1) == it2) {
+				return candidate.when;
+			}
+			candidates.pop();
+		}
+		return TimePoint::max();
+	}
+
+	// queue players arriving at a steady rate with normally distributed ratings and check what comes out.
+	// runs on simulated time so it measures the matchmaker and not the clock.
+	static void Benchmark(int numPlayers, int playersPerSecond) {
+		if (numPlayers <= 0 || playersPerSecond <= 0) {
+			return;
+		}
+
+		std::mt19937 rng(1);
+		std::normal_distribution<double> ratings(1500.0, 300.0);
+
+		std::vector<int> playerRatings(numPlayers);
+		for (int i = 0; i < numPlayers; i++) {
+			playerRatings[i] = (int)ratings(rng);
+		}
+
+		Matchmaker matchmaker;
+		std::vector<Match> matches;
+		matches.reserve(numPlayers / 2);
+
+		// players arrive in 10ms steps
+		const std::chrono::microseconds step(10000);
+		int perStep = playersPerSecond / 100 > 0 ? playersPerSecond / 100 : 1;
+
+		TimePoint now;
+		int enqueued = 0;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+		while (enqueued < numPlayers || matchmaker.Waiting() > 1) {
+			for (int i = 0; i < perStep && enqueued < numPlayers; i++, enqueued++) {
+				matchmaker.Enqueue((uint32)enqueued + 1, playerRatings[enqueued], now);
+			}
+			matchmaker.Update(now, matches);
+
+			// once everyone is in, skip ahead to the next pair instead of stepping through the wait
+			if (enqueued == numPlayers && matchmaker.Waiting() > 1) {
+				TimePoint next = matchmaker.NextMatchTime();
+				now = next > now ? next : now + step;
+			}
+			else {
+				now += step;
+			}
+		}
+
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		// every player is paired at most once, and never outside the window of the one who waited longer
+		std::vector<char> paired(numPlayers + 1, 0);
+		int duplicates = 0;
+		int outsideWindow = 0;
+		for (int i = 0; i < matches.size(); i++) {
+			Match &match = matches[i];
+			duplicates += paired[match.player1]++ != 0;
+			duplicates += paired[match.player2]++ != 0;
+
+			double window = Window(match.wait1 > match.wait2 ? match.wait1 : match.wait2);
+			if (match.rating2 - match.rating1 > window + 1) {
+				outsideWindow++;
+			}
+		}
+
+		std::cout << "Paired " << matches.size() * 2 << " of " << numPlayers << " players (" << playersPerSecond << " arriving/sec) in " <<
+			seconds * 1000.0 << " ms, " << (numPlayers + matches.size()) / seconds << " enqueues and matches/sec" << std::endl;
+		std::cout << "Wait (ms): p50 " << matchmaker.waitTime.percentile(0.5) << ", p99 " << matchmaker.waitTime.percentile(0.99) <<
+			", max " << matchmaker.waitTime.max << std::endl;
+		std::cout << "Rating gap: p50 " << matchmaker.ratingGap.percentile(0.5) << ", p99 " << matchmaker.ratingGap.percentile(0.99) <<
+			", max " << matchmaker.ratingGap.max << std::endl;
+
+		// players far from the average rating have fewer neighbours and wait longer, but not without bound
+		const int NUM_BANDS = 5;
+		const int bandEdges[NUM_BANDS + 1] = { INT_MIN, 900, 1300, 1700, 2100, INT_MAX };
+		LatencyHistogram bandWait[NUM_BANDS];
+		for (int i = 0; i < matches.size(); i++) {
+			for (int b = 0; b < NUM_BANDS; b++) {
+				if (matches[i].rating1 >= bandEdges[b] && matches[i].rating1 < bandEdges[b + 1]) {
+					bandWait[b].record(matches[i].wait1.count() / 1000);
+				}
+				if (matches[i].rating2 >= bandEdges[b] && matches[i].rating2 < bandEdges[b + 1]) {
+					bandWait[b].record(matches[i].wait2.count() / 1000);
+				}
+			}
+		}
+		const char *bandNames[NUM_BANDS] = { "< 900", "900-1300", "1300-1700", "1700-2100", ">= 2100" };
+		for (int b = 0; b < NUM_BANDS; b++) {
+			std::cout << "  rating " << bandNames[b] << ": " << bandWait[b].count << " players, wait p50 " << bandWait[b].percentile(0.5) <<
+				" ms, p99 " << bandWait[b].percentile(0.99) << " ms" << std::endl;
+		}
+
+		bool ok = duplicates == 0 && outsideWindow == 0 && matches.size() == numPlayers / 2;
+		std::cout << (ok ? "OK" : "FAILED") << ": " << duplicates << " players paired twice, " << outsideWindow << " pairs outside their window, " <<
+			matchmaker.Waiting() << " left waiting" << std::endl;
+	}
+
+private:
+	// sorted by rating, then by who came first
+	struct Waiter {
+		int rating;
+		uint64 ticket;
+		uint32 player;
+		TimePoint enqueued;
+
+		bool operator<(const Waiter &other) const {
+			return rating != other.rating ? rating < other.rating : ticket < other.ticket;
+		}
+	};
+
+	// two neighbouring players and when they become acceptable to each other
+	struct Candidate {
+		TimePoint when;
+		uint64 ticket1;
+		uint64 ticket2;
+		uint32 player1;
+		uint32 player2;
+
+		// earliest first, then whoever has been waiting longest
+		bool operator>(const Candidate &other) const {
+			if (when != other.when) {
+				return when > other.when;
+			}
+			uint64 first = ticket1 < ticket2 ? ticket1 : ticket2;
+			uint64 otherFirst = other.ticket1 < other.ticket2 ? other.ticket1 : other.ticket2;
+			return first > otherFirst;
+		}
+	};
+
+	std::set<Waiter> waiting;
+	std::unordered_map<uint32, std::set<Waiter>::iterator> players;
+	uint64 nextTicket = 0;
+
+	// may hold pairs that are no longer neighbours, they are skipped when they come up
+	std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> candidates;
+
+	// a waiting player, only if they are still on the same ticket
+	std::set<Waiter>::iterator Find(uint32 player, uint64 ticket) {
+		auto it = players.find(player);
+		if (it == players.end() || it->second->ticket != ticket) {
+			return waiting.end();
+		}
+		return it->second;
+	}
+
+	// lower is the lower rated of two neighbours
+	void Schedule(const Waiter &lower, const Waiter &higher) {
+		Candidate candidate;
+		candidate.ticket1 = lower.ticket;
+		candidate.ticket2 = higher.ticket;
+		candidate.player1 = lower.player;
+		candidate.player2 = higher.player;
+
+		// whoever has waited longer gets there first
+		TimePoint earliest = lower.enqueued < higher.enqueued ? lower.enqueued : higher.enqueued;
+		int gap = higher.rating - lower.rating;
+		candidate.when = earliest;
+		if (gap > MATCH_RATING_WINDOW) {
+			candidate.when += std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+				std::chrono::duration<double>((gap - MATCH_RATING_WINDOW) / MATCH_WINDOW_GROWTH));
+		}
+
+		candidates.push(candidate);
+	}
+};
+
+#endif
@@ -46,6 +46,27 @@ struct Material {
 	float opacity;
 };
 
+//per instance data for drawing many copies of a mesh in one call (vertex attributes 5-13)
+struct Instance {
+	glm::mat4 model;
+
+	//rgb, w is 1 if the override color is enabled
+	glm::vec4 overrideColor;
+
+	//rgb effect color, w is its strength
+	glm::vec4 effect;
+
+	//model space to world space for normals
+	glm::mat3 normal;
+
+	bool operator==(const Instance &other) const {
+		return model == other.model && overrideColor == other.overrideColor && effect == other.effect && normal == other.normal;
+	}
+	bool operator!=(const Instance &other) const {
+		return !(*this == other);
+	}
+};
+
 class Mesh {
 public:
 	//mesh Data
@@ -82,6 +103,68 @@ public:
 	{
 		shader.use();
 
+		bindMaterial(shader);
+
+		//draw mesh
+		render();
+
+		//reset back to default settings
+		glActiveTexture(GL_TEXTURE0);
+	}
+
+	//render a copy of the mesh for every instance in the instance buffer (setupInstances first)
+	void DrawInstanced(Shader &shader, int count)
+	{
+		bindMaterial(shader);
+
+		glBindVertexArray(VAO);
+		glDrawElementsInstanced(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, 0, count);
+		glBindVertexArray(0);
+
+		glActiveTexture(GL_TEXTURE0);
+	}
+
+	//read the per instance attributes from a buffer of Instance
+	void setupInstances(unsigned int instanceVBO)
+	{
+		glBindVertexArray(VAO);
+		glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+
+		//a mat4 takes four attribute slots, one per column
+		for (int i = 0; i < 4; i++) {
+			glEnableVertexAttribArray(5 + i);
+			glVertexAttribPointer(5 + i, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), (void*)(offsetof(Instance, model) + sizeof(glm::vec4) * i));
+			glVertexAttribDivisor(5 + i, 1);
+		}
+		glEnableVertexAttribArray(9);
+		glVertexAttribPointer(9, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), (void*)offsetof(Instance, overrideColor));
+		glVertexAttribDivisor(9, 1);
+		glEnableVertexAttribArray(10);
+		glVertexAttribPointer(10, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), (void*)offsetof(Instance, effect));
+		glVertexAttribDivisor(10, 1);
+		//and a mat3 three
+		for (int i = 0; i < 3; i++) {
+			glEnableVertexAttribArray(11 + i);
+			glVertexAttribPointer(11 + i, 3, GL_FLOAT, GL_FALSE, sizeof(Instance), (void*)(offsetof(Instance, normal) + sizeof(glm::vec3) * i));
+			glVertexAttribDivisor(11 + i, 1);
+		}
+
+		glBindVertexArray(0);
+	}
+
+	void render() {
+		glBindVertexArray(VAO);
+		glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, 0);
+		glBindVertexArray(0);
+	}
+
+private:
+	//render data 
+	unsigned int VBO, EBO;
+
+	//textures and material colors
+	void bindMaterial(Shader &shader)
+	{
 		//default
 		shader.setBool("hasDiffuseTex", false);
 		shader.setBool("hasSpecularTex", false);
@@ -148,24 +231,8 @@ public:
 			//shader.setVec3("specular_color", glm::vec3(1.0f));
 			//shader.setVec3("ambient_color", glm::vec3(1.0f));
 		}
-
-		//draw mesh
-		render();
-
-		//reset back to default settings
-		glActiveTexture(GL_TEXTURE0);
 	}
 
-	void render() {
-		glBindVertexArray(VAO);
-		glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, 0);
-		glBindVertexArray(0);
-	}
-
-private:
-	//render data 
-	unsigned int VBO, EBO;
-
 	//initializes all the buffer objects/arrays
 	void setupMesh()
 	{
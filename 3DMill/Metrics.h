@@ -0,0 +1,219 @@
+// lightweight counters for measuring the server while it runs.
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <cmath>
+#include <stdint.h>
+#include <string>
+#include <sstream>
+
+// latency histogram in microseconds with quarter-octave buckets (each bucket is ~19% wider than the last).
+// one thread records, any thread can read. Percentiles are the upper edge of the bucket they land in.
+class LatencyHistogram {
+public:
+	static const int NUM_BUCKETS = 32 * 4;
+
+	std::atomic<uint64_t> buckets[NUM_BUCKETS];
+	std::atomic<uint64_t> count{ 0 };
+	std::atomic<uint64_t> sum{ 0 };
+	std::atomic<uint64_t> max{ 0 };
+
+	LatencyHistogram() {
+		reset();
+	}
+
+	void reset() {
+		for (int i = 0; i < NUM_BUCKETS; i++) {
+			buckets[i] = 0;
+		}
+		count = 0;
+		sum = 0;
+		max = 0;
+	}
+
+	void record(int64_t micros) {
+		uint64_t value = micros > 0 ? (uint64_t)micros : 0;
+
+		buckets[bucketFor(value)].fetch_add(1, std::memory_order_relaxed);
+		count.fetch_add(1, std::memory_order_relaxed);
+		sum.fetch_add(value, std::memory_order_relaxed);
+
+		if (value > max.load(std::memory_order_relaxed)) {
+			max.store(value, std::memory_order_relaxed);
+		}
+	}
+
+	// p is 0-1 (0.5 is the median)
+	uint64_t percentile(double p) const {
+		uint64_t total = count.load(std::memory_order_relaxed);
+		if (total == 0) {
+			return 0;
+		}
+
+		uint64_t target = (uint64_t)std::ceil(p * total);
+		if (target == 0) {
+			target = 1;
+		}
+
+		uint64_t seen = 0;
+		for (int i = 0; i < NUM_BUCKETS; i++) {
+			seen += buckets[i].load(std::memory_order_relaxed);
+			if (seen >= target) {
+				uint64_t edge = bucketEdge(i + 1);
+				uint64_t highest = max.load(std::memory_order_relaxed);
+				return edge < highest ? edge : highest;
+			}
+		}
+
+		return max.load(std::memory_order_relaxed);
+	}
+
+	// add another histogram into this one (used to combine workers)
+	void merge(const LatencyHistogram &other) {
+		for (int i = 0; i < NUM_BUCKETS; i++) {
+			buckets[i].fetch_add(other.buckets[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+		}
+		count.fetch_add(other.count.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		sum.fetch_add(other.sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+		uint64_t otherMax = other.max.load(std::memory_order_relaxed);
+		if (otherMax > max.load(std::memory_order_relaxed)) {
+			max.store(otherMax, std::memory_order_relaxed);
+		}
+	}
+
+private:
+	// bucket 0 holds 0-1us, then 4 buckets per power of two
+	static int bucketFor(uint64_t value) {
+		if (value <= 1) {
+			return 0;
+		}
+
+		int octave = 63;
+		while (!(value >> octave)) {
+			octave--;
+		}
+
+		// the two bits under the top bit pick the quarter
+		int quarter = octave >= 2 ? (int)((value >> (octave - 2)) & 3) : (int)((value << (2 - octave)) & 3);
+		int bucket = octave * 4 + quarter + 1;
+
+		return bucket < NUM_BUCKETS ? bucket : NUM_BUCKETS - 1;
+	}
+
+	// smallest value that lands in a bucket
+	static uint64_t bucketEdge(int bucket) {
+		if (bucket <= 0) {
+			return 0;
+		}
+		if (bucket >= NUM_BUCKETS) {
+			return UINT64_MAX;
+		}
+
+		int octave = (bucket - 1) / 4;
+		int quarter = (bucket - 1) % 4;
+
+		return ((uint64_t)1 << octave) + (((uint64_t)quarter << octave) >> 2);
+	}
+};
+
+// messages and bytes by message type. One thread records, any thread can read.
+class MessageCounters {
+public:
+	// message types past the end are counted in the last slot
+	static const int NUM_TYPES = 16;
+
+	std::atomic<uint64_t> messages[NUM_TYPES];
+	std::atomic<uint64_t> bytes[NUM_TYPES];
+
+	MessageCounters() {
+		reset();
+	}
+
+	void reset() {
+		for (int i = 0; i < NUM_TYPES; i++) {
+			messages[i] = 0;
+			bytes[i] = 0;
+		}
+	}
+
+	// copies is how many connections the same message went to
+	void record(int type, uint64_t size, uint64_t copies = 1) {
+		int slot = type >= 0 && type < NUM_TYPES ? type : NUM_TYPES - 1;
+
+		messages[slot].fetch_add(copies, std::memory_order_relaxed);
+		bytes[slot].fetch_add(size * copies, std::memory_order_relaxed);
+	}
+
+	void merge(const MessageCounters &other) {
+		for (int i = 0; i < NUM_TYPES; i++) {
+			messages[i].fetch_add(other.messages[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+			bytes[i].fetch_add(other.bytes[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+		}
+	}
+
+	uint64_t totalMessages() const {
+		uint64_t total = 0;
+		for (int i = 0; i < NUM_TYPES; i++) {
+			total += messages[i].load(std::memory_order_relaxed);
+		}
+		return total;
+	}
+
+	uint64_t totalBytes() const {
+		uint64_t total = 0;
+		for (int i = 0; i < NUM_TYPES; i++) {
+			total += bytes[i].load(std::memory_order_relaxed);
+		}
+		return total;
+	}
+};
+
+// builds a metrics file in the Prometheus text format.
+// write the family line first, then every sample of that metric (one per label set).
+class MetricsWriter {
+public:
+	MetricsWriter() {
+		// counters get large, keep every digit
+		out.precision(15);
+	}
+
+	// type is "counter", "gauge" or "summary"
+	void family(const std::string &name, const char *type, const char *help) {
+		out << "# HELP " << name << " " << help << "\n";
+		out << "# TYPE " << name << " " << type << "\n";
+	}
+
+	// labels are written as they are, e.g. worker="0"
+	void sample(const std::string &name, const std::string &labels, double value) {
+		out << name;
+		if (!labels.empty()) {
+			out << "{" << labels << "}";
+		}
+		out << " " << value << "\n";
+	}
+
+	// a histogram written as a summary with a few quantiles
+	void summary(const std::string &name, const std::string &labels, const LatencyHistogram &histogram) {
+		static const double quantiles[] = { 0.5, 0.9, 0.99, 1.0 };
+
+		for (int i = 0; i < 4; i++) {
+			std::ostringstream quantileLabels;
+			quantileLabels << labels << (labels.empty() ? "" : ",") << "quantile=\"" << quantiles[i] << "\"";
+
+			sample(name, quantileLabels.str(), (double)(quantiles[i] < 1.0 ? histogram.percentile(quantiles[i]) : histogram.max.load()));
+		}
+		sample(name + "_sum", labels, (double)histogram.sum.load());
+		sample(name + "_count", labels, (double)histogram.count.load());
+	}
+
+	std::string str() const {
+		return out.str();
+	}
+
+private:
+	std::ostringstream out;
+};
+
+#endif
@@ -39,6 +39,12 @@ public:
 	//multisampling
 	int samples;
 
+	//copies of the model to draw in one call, filled in again every frame by the graphics engine
+	vector<Instance> instances;
+
+	//a material is see through, so the model is blended and has to be drawn back to front
+	bool transparent = false;
+
 	//expects file path to 3d model with multisampling
 	Model(string const &path, int samples, bool gamma = false) : gammaCorrection(gamma)
 	{
@@ -98,7 +104,51 @@ public:
 		}
 	}
 
+	//draws every instance with one call per mesh. The instance buffer is only written when the instances changed.
+	//returns the number of draw calls
+	int DrawInstanced(Shader &shader) {
+		if (instances.empty()) {
+			return 0;
+		}
+
+		if (instanceVBO == 0) {
+			glGenBuffers(1, &instanceVBO);
+			for (unsigned int i = 0; i < meshes.size(); i++) {
+				meshes[i].setupInstances(instanceVBO);
+			}
+		}
+
+		if (instances != uploadedInstances) {
+			glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+			//grow the buffer when there are more instances than ever before, otherwise overwrite it
+			if (instances.size() > instanceCapacity) {
+				instanceCapacity = instances.size();
+				glBufferData(GL_ARRAY_BUFFER, instanceCapacity * sizeof(Instance), &instances[0], GL_DYNAMIC_DRAW);
+			}
+			else {
+				glBufferSubData(GL_ARRAY_BUFFER, 0, instances.size() * sizeof(Instance), &instances[0]);
+			}
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+			uploadedInstances = instances;
+			instanceUploads++;
+		}
+
+		for (unsigned int i = 0; i < meshes.size(); i++) {
+			meshes[i].DrawInstanced(shader, (int)instances.size());
+		}
+		return (int)meshes.size();
+	}
+
+	//times the instance buffer was written
+	uint64_t instanceUploads = 0;
+
 private:
+	//instance buffer and what is in it
+	unsigned int instanceVBO = 0;
+	size_t instanceCapacity = 0;
+	vector<Instance> uploadedInstances;
+
 	void loadModel(string const &path)
 	{
 		//read file via ASSIMP
@@ -122,6 +172,14 @@ private:
 
 		//process ASSIMP's root node recursively
 		processNode(scene->mRootNode, scene);
+
+		for (unsigned int i = 0; i < meshes.size(); i++) {
+			for (unsigned int j = 0; j < meshes[i].materials.size(); j++) {
+				if (meshes[i].materials[j].opacity < 1.0f) {
+					transparent = true;
+				}
+			}
+		}
 	}
 
 	//seperate and process each mesh from the nodes in the scene
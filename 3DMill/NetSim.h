@@ -0,0 +1,208 @@
+// scripted network conditions, to try the protocol on something worse than the machine it was written on.
+// a profile can be put on GameNetworkingSockets' fake lag and loss (real sockets) or on a LoopbackNetwork.
+// netsim plays bot matches over loopback under each profile in turn and prints move latency and resync/desync
+// counts side by side, so a protocol change can be compared before and after under the same conditions.
+#ifndef NETSIM_H
+#define NETSIM_H
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+
+#include <GameNetworkingSockets/steam/steamnetworkingsockets.h>
+#include <GameNetworkingSockets/steam/isteamnetworkingutils.h>
+
+#include "Tools.h"
+#include "Server.h"
+#include "LoadGen.h"
+#include "LoopbackTransport.h"
+
+struct NetworkProfile {
+	const char *name;
+
+	// one way, so the round trip is twice this
+	int lagMillis;
+
+	// extra delay of up to this much on top of the lag
+	int jitterMillis;
+
+	// packets lost in each direction
+	float lossPercent;
+};
+
+// from a wired connection next door to a phone on a busy cell
+const NetworkProfile NETWORK_PROFILES[] = {
+	{ "lan", 0, 0, 0.0f },
+	{ "broadband", 15, 5, 0.1f },
+	{ "wifi", 30, 20, 1.0f },
+	{ "mobile", 75, 40, 2.0f },
+	{ "congested", 125, 100, 5.0f },
+};
+const int NUM_NETWORK_PROFILES = sizeof(NETWORK_PROFILES) / sizeof(NETWORK_PROFILES[0]);
+
+// nullptr if there is no profile with that name
+static const NetworkProfile *FindNetworkProfile(const std::string &name) {
+	for (int i = 0; i < NUM_NETWORK_PROFILES; i++) {
+		if (name == NETWORK_PROFILES[i].name) {
+			return &NETWORK_PROFILES[i];
+		}
+	}
+	return nullptr;
+}
+
+static void PrintNetworkProfiles() {
+	for (int i = 0; i < NUM_NETWORK_PROFILES; i++) {
+		const NetworkProfile &profile = NETWORK_PROFILES[i];
+		std::cout << "  " << profile.name << ": " << profile.lagMillis * 2 << " ms round trip, " << profile.jitterMillis << " ms jitter, " <<
+			profile.lossPercent << "% loss" << std::endl;
+	}
+}
+
+// fake the profile on every GameNetworkingSockets connection of this process. Both directions are delayed here, so
+// only one end of a connection may use it: the server or a loadgen, never both (clients aren't offered it).
+// The library can't spread delays out, instead half the packets are held back by the whole jitter (and end up out of order).
+static void ApplyNetworkProfile(const NetworkProfile &profile) {
+	ISteamNetworkingUtils *utils = SteamNetworkingUtils();
+	utils->SetGlobalConfigValueInt32(k_ESteamNetworkingConfig_FakePacketLag_Send, profile.lagMillis);
+	utils->SetGlobalConfigValueInt32(k_ESteamNetworkingConfig_FakePacketLag_Recv, profile.lagMillis);
+	utils->SetGlobalConfigValueFloat(k_ESteamNetworkingConfig_FakePacketLoss_Send, profile.lossPercent);
+	utils->SetGlobalConfigValueFloat(k_ESteamNetworkingConfig_FakePacketLoss_Recv, profile.lossPercent);
+	utils->SetGlobalConfigValueFloat(k_ESteamNetworkingConfig_FakePacketReorder_Send, profile.jitterMillis > 0 ? 50.0f : 0.0f);
+	utils->SetGlobalConfigValueFloat(k_ESteamNetworkingConfig_FakePacketReorder_Recv, profile.jitterMillis > 0 ? 50.0f : 0.0f);
+	utils->SetGlobalConfigValueInt32(k_ESteamNetworkingConfig_FakePacketReorder_Time, profile.jitterMillis);
+}
+
+// the loopback network applies it to every message, so it is the same for both ends
+static void ApplyNetworkProfile(const NetworkProfile &profile, LoopbackNetwork &network) {
+	network.latency = (SteamNetworkingMicroseconds)profile.lagMillis * 1000;
+	network.jitter = (SteamNetworkingMicroseconds)profile.jitterMillis * 1000;
+	network.lossChance = profile.lossPercent / 100.0f;
+}
+
+class NetworkSimulation {
+public:
+	int numBots = 200;
+
+	// how long to play under each profile
+	int durationSeconds = 10;
+
+	int thinkMillis = 0;
+	int numWorkers = 0;
+
+	// room mode the server runs, so both protocols can be compared
+	int lockstep = 0;
+
+	// only run this profile (empty runs all of them)
+	std::string profileName;
+
+	// false if there is no profile with that name
+	bool Run() {
+		std::vector<const NetworkProfile*> profiles;
+		for (int i = 0; i < NUM_NETWORK_PROFILES; i++) {
+			if (profileName.empty() || profileName == NETWORK_PROFILES[i].name) {
+				profiles.push_back(&NETWORK_PROFILES[i]);
+			}
+		}
+		if (profiles.empty()) {
+			std::cout << "There is no network profile '" << profileName << "'. The profiles are:" << std::endl;
+			PrintNetworkProfiles();
+			return false;
+		}
+
+		std::vector<Result> results;
+		for (int i = 0; i < profiles.size() && !g_bQuit; i++) {
+			results.push_back(RunProfile(*profiles[i]));
+		}
+
+		PrintResults(results);
+		return true;
+	}
+
+private:
+	struct Result {
+		const NetworkProfile *profile;
+		double seconds;
+		LoadGenerator::Counters counters;
+
+		// action to broadcast, microseconds
+		uint64 p50;
+		uint64 p95;
+		uint64 p99;
+		uint64 max;
+	};
+
+	Result RunProfile(const NetworkProfile &profile) {
+		std::cout << "Network profile " << profile.name << ": " << profile.lagMillis * 2 << " ms round trip, " << profile.jitterMillis <<
+			" ms jitter, " << profile.lossPercent << "% loss" << std::endl;
+
+		// same seed every time so each run sees the same losses
+		LoopbackNetwork network;
+		ApplyNetworkProfile(profile, network);
+
+		LoopbackTransport serverTransport(network);
+		LoopbackTransport botTransport(network);
+		serverTransport.Listen(NETSIM_PORT);
+
+		Server server;
+		server.numWorkers = numWorkers;
+		server.logConnections = false;
+		server.rateLimit = false;
+		server.lockstep = lockstep;
+		std::thread serverThread([&]() { server.Run(&serverTransport, NETSIM_PORT); });
+
+		LoadGenerator loadGen;
+		loadGen.numBots = numBots;
+		loadGen.durationSeconds = durationSeconds;
+		loadGen.thinkMillis = thinkMillis;
+		loadGen.printReports = false;
+
+		SteamNetworkingIPAddr addr;
+		addr.Clear();
+		addr.SetIPv6LocalHost(NETSIM_PORT);
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		loadGen.Run(&botTransport, addr);
+
+		Result result;
+		result.profile = &profile;
+		result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		result.counters = loadGen.Totals();
+		result.p50 = loadGen.actionLatency.percentile(0.5);
+		result.p95 = loadGen.actionLatency.percentile(0.95);
+		result.p99 = loadGen.actionLatency.percentile(0.99);
+		result.max = loadGen.actionLatency.max;
+
+		server.Stop();
+		serverThread.join();
+		return result;
+	}
+
+	void PrintResults(const std::vector<Result> &results) {
+		std::cout << std::endl << numBots << " bots, " << durationSeconds << " seconds per profile, " <<
+			(lockstep > 0 ? "lockstep rooms (checksum every " + std::to_string(lockstep) + " actions)" : "delta rooms") << std::endl;
+		std::cout << std::left << std::setw(12) << "profile" << std::right << std::setw(10) << "moves/sec" << std::setw(10) << "p50 ms" <<
+			std::setw(10) << "p95 ms" << std::setw(10) << "p99 ms" << std::setw(10) << "max ms" << std::setw(12) << "bytes/move" <<
+			std::setw(10) << "resyncs" << std::setw(10) << "desyncs" << std::setw(10) << "timeouts" << std::endl;
+
+		for (int i = 0; i < results.size(); i++) {
+			const Result &result = results[i];
+			const LoadGenerator::Counters &counters = result.counters;
+			uint64 moves = counters.moves > 0 ? counters.moves : 1;
+
+			std::cout << std::left << std::setw(12) << result.profile->name << std::right << std::fixed << std::setprecision(1) <<
+				std::setw(10) << counters.moves / result.seconds <<
+				std::setw(10) << result.p50 / 1000.0 << std::setw(10) << result.p95 / 1000.0 <<
+				std::setw(10) << result.p99 / 1000.0 << std::setw(10) << result.max / 1000.0 <<
+				std::setw(12) << (double)(counters.bytesIn + counters.bytesOut) / moves <<
+				std::setw(10) << counters.resyncs << std::setw(10) << counters.desyncs << std::setw(10) << counters.timeouts << std::endl;
+		}
+		std::cout << std::defaultfloat;
+	}
+
+	static const uint16 NETSIM_PORT = 27100;
+};
+
+#endif
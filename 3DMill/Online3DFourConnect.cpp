@@ -2,6 +2,7 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <algorithm>
@@ -28,6 +29,10 @@
 #include "Tools.h"
 #include "Server.h"
 #include "Client.h"
+#include "LoadGen.h"
+#include "LoopbackTransport.h"
+#include "ReplayPlayer.h"
+#include "NetSim.h"
 
 // Board and game classes
 #include "GameManager.h"
@@ -37,18 +42,28 @@
 // callback setup
 void winCallback(Piece::Color color);
 
-Server *Server::s_pCallbackInstance = nullptr;
-
-Client *Client::s_pCallbackInstance = nullptr;
-
 const uint16 DEFAULT_SERVER_PORT = 25565;
 
 void PrintUsageAndExit()
 {
 	std::cout << "The information entered was invalid.\n" <<
 		"Cmd argument usage:\n" << 
-		"3DFourConnect.exe client SERVER_ADDR\n" <<
-		"3DFourConnect.exe server [--port PORT]" << std::endl;
+		"3DFourConnect.exe client SERVER_ADDR [--room ROOM_ID | --match [--rating RATING]] [--spectate] [--selection-rate UPDATES_PER_SEC]\n" <<
+		"3DFourConnect.exe server [--port PORT] [--workers NUM_THREADS] [--journal FILE] [--replays DIRECTORY] [--metrics FILE] [--metrics-interval SECONDS] [--clock SECONDS [--increment SECONDS]] [--lockstep HASH_INTERVAL] [--no-rate-limit] [--shards ADDR,ADDR,... --shard INDEX] [--analysis-threads NUM_THREADS] [--profile NETWORK_PROFILE]\n" <<
+		"3DFourConnect.exe replay FILE [--speed MOVES_PER_SEC]\n" <<
+		"3DFourConnect.exe replaystats DIRECTORY\n" <<
+		"3DFourConnect.exe journalbench [--journal FILE] [--matches NUM_MATCHES] [--moves MOVES_PER_MATCH]\n" <<
+		"3DFourConnect.exe matchbench [--players NUM_PLAYERS] [--arrivals PLAYERS_PER_SEC]\n" <<
+		"3DFourConnect.exe directorybench [--shards NUM_SHARDS] [--rooms NUM_ROOMS]\n" <<
+		"3DFourConnect.exe analysisbench [--positions NUM_POSITIONS] [--nodes NODES_PER_POSITION]\n" <<
+		"3DFourConnect.exe loadgen SERVER_ADDR [--bots NUM_BOTS] [--flood NUM_BOTS] [--duration SECONDS] [--think MS] [--profile NETWORK_PROFILE]\n" <<
+		"3DFourConnect.exe loadgen --loopback [--workers NUM_THREADS] [--latency MS] [--loss PERCENT] [--profile NETWORK_PROFILE] [--clock SECONDS [--increment SECONDS]] [--lockstep HASH_INTERVAL] [--rate-limit] [--bots NUM_BOTS] [--flood NUM_BOTS] [--duration SECONDS] [--think MS]\n" <<
+		"3DFourConnect.exe netsim [--profile NETWORK_PROFILE] [--workers NUM_THREADS] [--lockstep HASH_INTERVAL] [--bots NUM_BOTS] [--duration SECONDS_PER_PROFILE] [--think MS]\n" <<
+		"--profile fakes the whole network profile in both directions on the end it is given to. Give it to the server or to a\n"
+		"loadgen connecting to it, not both, or the lag and loss add up.\n" <<
+		"Network profiles:" << std::endl;
+	PrintNetworkProfiles();
+	exit(1);
 }
 
 // start up options
@@ -57,13 +72,56 @@ int main(int argc, const char *argv[])
 	bool bServer = false;
 	bool bClient = false;
 	bool bLocal = false;
+	bool bLoadGen = false;
+	bool bLoopback = false;
+	bool bJournalBench = false;
+	bool bReplay = false;
+	bool bReplayStats = false;
+	bool bMatchBench = false;
+	bool bDirectoryBench = false;
+	bool bNetSim = false;
+	bool bAnalysisBench = false;
 	int nPort = DEFAULT_SERVER_PORT;
+	int nSelectionRate = 20;
+	int nRoom = 1;
+	bool bSpectate = false;
+	bool bMatch = false;
+	int nRating = 1500;
+	int nPlayers = 100000;
+	int nArrivals = 1000;
+	int nWorkers = 0;
+	int nBots = 1000;
+	int nDuration = -1;
+	int nThink = 0;
+	int nLatency = 0;
+	float flLoss = 0.0f;
+	std::string sJournal;
+	int nMatches = 10000;
+	int nMoves = 50;
+	std::string sReplays;
+	std::string sReplayPath;
+	float flSpeed = 2.0f;
+	std::string sMetrics;
+	int nMetricsInterval = 10;
+	float flClock = 0.0f;
+	bool bRateLimit = true;
+	bool bLoopbackRateLimit = false;
+	int nFlooders = 0;
+	float flIncrement = 0.0f;
+	int nLockstep = 0;
+	std::string sShards;
+	int nShard = 0;
+	int nRooms = 100000;
+	std::string sProfile;
+	int nAnalysisThreads = 1;
+	int nPositions = 200;
+	int nNodes = 100000;
 	SteamNetworkingIPAddr addrServer; addrServer.Clear();
 
 	// test exe cmd args
 	for (int i = 1; i < argc; ++i)
 	{
-		if (!bClient && !bServer)
+		if (!bClient && !bServer && !bLoadGen && !bJournalBench && !bReplay && !bReplayStats && !bMatchBench && !bDirectoryBench && !bNetSim && !bAnalysisBench)
 		{
 			if (!strcmp(argv[i], "client"))
 			{
@@ -75,6 +133,46 @@ int main(int argc, const char *argv[])
 				bServer = true;
 				continue;
 			}
+			if (!strcmp(argv[i], "loadgen"))
+			{
+				bLoadGen = true;
+				continue;
+			}
+			if (!strcmp(argv[i], "journalbench"))
+			{
+				bJournalBench = true;
+				continue;
+			}
+			if (!strcmp(argv[i], "replay"))
+			{
+				bReplay = true;
+				continue;
+			}
+			if (!strcmp(argv[i], "replaystats"))
+			{
+				bReplayStats = true;
+				continue;
+			}
+			if (!strcmp(argv[i], "matchbench"))
+			{
+				bMatchBench = true;
+				continue;
+			}
+			if (!strcmp(argv[i], "directorybench"))
+			{
+				bDirectoryBench = true;
+				continue;
+			}
+			if (!strcmp(argv[i], "netsim"))
+			{
+				bNetSim = true;
+				continue;
+			}
+			if (!strcmp(argv[i], "analysisbench"))
+			{
+				bAnalysisBench = true;
+				continue;
+			}
 		}
 		if (!strcmp(argv[i], "--port"))
 		{
@@ -83,15 +181,316 @@ int main(int argc, const char *argv[])
 				PrintUsageAndExit();
 			nPort = atoi(argv[i]);
 			if (nPort <= 0 || nPort > 65535)
+			{
 				std::cout << "Invalid port " << nPort << std::endl;
+				PrintUsageAndExit();
+			}
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--selection-rate"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			nSelectionRate = atoi(argv[i]);
+			if (nSelectionRate <= 0)
+			{
+				std::cout << "Invalid selection rate " << nSelectionRate << std::endl;
+				PrintUsageAndExit();
+			}
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--room"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			nRoom = atoi(argv[i]);
+			if (nRoom <= 0)
+			{
+				std::cout << "Invalid room " << nRoom << std::endl;
+				PrintUsageAndExit();
+			}
+			continue;
+		}
+		if (!strcmp(argv[i], "--spectate"))
+		{
+			bSpectate = true;
+			continue;
+		}
+		if (!strcmp(argv[i], "--match"))
+		{
+			bMatch = true;
+			continue;
+		}
+		if (!strcmp(argv[i], "--rating"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			nRating = atoi(argv[i]);
+			continue;
+		}
+		if (!strcmp(argv[i], "--players"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			nPlayers = atoi(argv[i]);
+			continue;
+		}
+		if (!strcmp(argv[i], "--arrivals"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			nArrivals = atoi(argv[i]);
+			continue;
+		}
+		if (!strcmp(argv[i], "--workers"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			nWorkers = atoi(argv[i]);
+			if (nWorkers < 0)
+			{
+				std::cout << "Invalid number of workers " << nWorkers << std::endl;
+				PrintUsageAndExit();
+			}
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--bots"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			nBots = atoi(argv[i]);
+			if (nBots <= 0)
+			{
+				std::cout << "Invalid number of bots " << nBots << std::endl;
+				PrintUsageAndExit();
+			}
+			continue;
+		}
+		if (!strcmp(argv[i], "--duration"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			nDuration = atoi(argv[i]);
+			continue;
+		}
+		if (!strcmp(argv[i], "--think"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			nThink = atoi(argv[i]);
+			continue;
+		}
+		if (!strcmp(argv[i], "--loopback"))
+		{
+			bLoopback = true;
+			continue;
+		}
+		if (!strcmp(argv[i], "--latency"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			nLatency = atoi(argv[i]);
+			continue;
+		}
+		if (!strcmp(argv[i], "--loss"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			flLoss = (float)atof(argv[i]);
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--journal"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			sJournal = argv[i];
+			continue;
+		}
+		if (!strcmp(argv[i], "--matches"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			nMatches = atoi(argv[i]);
+			continue;
+		}
+		if (!strcmp(argv[i], "--moves"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			nMoves = atoi(argv[i]);
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--replays"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			sReplays = argv[i];
+			continue;
+		}
+		if (!strcmp(argv[i], "--speed"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			flSpeed = (float)atof(argv[i]);
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--metrics"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			sMetrics = argv[i];
+			continue;
+		}
+		if (!strcmp(argv[i], "--metrics-interval"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			nMetricsInterval = atoi(argv[i]);
+			if (nMetricsInterval <= 0)
+			{
+				std::cout << "Invalid metrics interval " << nMetricsInterval << std::endl;
+				PrintUsageAndExit();
+			}
+			continue;
+		}
+		if (!strcmp(argv[i], "--no-rate-limit"))
+		{
+			bRateLimit = false;
+			continue;
+		}
+		if (!strcmp(argv[i], "--rate-limit"))
+		{
+			bLoopbackRateLimit = true;
+			continue;
+		}
+		if (!strcmp(argv[i], "--flood"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			nFlooders = atoi(argv[i]);
+			continue;
+		}
+		if (!strcmp(argv[i], "--clock"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			flClock = (float)atof(argv[i]);
+			continue;
+		}
+		if (!strcmp(argv[i], "--increment"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			flIncrement = (float)atof(argv[i]);
+			continue;
+		}
+		if (!strcmp(argv[i], "--shards"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			sShards = argv[i];
+			continue;
+		}
+		if (!strcmp(argv[i], "--shard"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			nShard = atoi(argv[i]);
+			continue;
+		}
+		if (!strcmp(argv[i], "--rooms"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			nRooms = atoi(argv[i]);
+			continue;
+		}
+		if (!strcmp(argv[i], "--profile"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			sProfile = argv[i];
+			continue;
+		}
+		if (!strcmp(argv[i], "--analysis-threads"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			nAnalysisThreads = atoi(argv[i]);
+			continue;
+		}
+		if (!strcmp(argv[i], "--positions"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			nPositions = atoi(argv[i]);
+			continue;
+		}
+		if (!strcmp(argv[i], "--nodes"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			nNodes = atoi(argv[i]);
+			continue;
+		}
+		if (!strcmp(argv[i], "--lockstep"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			nLockstep = atoi(argv[i]);
+			continue;
+		}
+
+		// the replay file or directory
+		if ((bReplay || bReplayStats) && sReplayPath.empty())
+		{
+			sReplayPath = argv[i];
 			continue;
 		}
 
 		// Anything else, must be server address to connect to
-		if (bClient && addrServer.IsIPv6AllZeros())
+		if ((bClient || bLoadGen) && addrServer.IsIPv6AllZeros())
 		{
 			if (!addrServer.ParseString(argv[i]))
+			{
 				std::cout << "Invalid server address " << argv[i] << std::endl;
+				PrintUsageAndExit();
+			}
 			if (addrServer.m_port == 0)
 				addrServer.m_port = DEFAULT_SERVER_PORT;
 			continue;
@@ -121,7 +520,10 @@ int main(int argc, const char *argv[])
 			std::cin >> additionalInfo;
 
 			if (!addrServer.ParseString(additionalInfo.c_str()))
+			{
 				std::cout << "Invalid server address " << additionalInfo.c_str() << std::endl;
+				PrintUsageAndExit();
+			}
 			if (addrServer.m_port == 0)
 				addrServer.m_port = DEFAULT_SERVER_PORT;
 		}
@@ -143,16 +545,85 @@ int main(int argc, const char *argv[])
 	}
 
 	// if invalid entries for some reason
-	if ((bClient == bServer || (bClient && addrServer.IsIPv6AllZeros())) && bLocal == false)
+	int nModes = (bClient ? 1 : 0) + (bServer ? 1 : 0) + (bLoadGen ? 1 : 0) + (bJournalBench ? 1 : 0) + (bReplay ? 1 : 0) + (bReplayStats ? 1 : 0) + (bMatchBench ? 1 : 0) + (bDirectoryBench ? 1 : 0) + (bNetSim ? 1 : 0) + (bAnalysisBench ? 1 : 0);
+	if ((nModes != 1 || (bClient && addrServer.IsIPv6AllZeros()) || (bLoadGen && !bLoopback && addrServer.IsIPv6AllZeros()) ||
+		((bReplay || bReplayStats) && sReplayPath.empty())) && bLocal == false)
 		PrintUsageAndExit();
 
+	const NetworkProfile *pProfile = nullptr;
+	if (!sProfile.empty() && !bNetSim)
+	{
+		// the server already fakes it for every client, so a client doing it too would double it
+		if (bClient)
+		{
+			std::cout << "A client can't take --profile, give it to the server" << std::endl;
+			PrintUsageAndExit();
+		}
+
+		pProfile = FindNetworkProfile(sProfile);
+		if (pProfile == nullptr)
+		{
+			std::cout << "There is no network profile '" << sProfile << "'" << std::endl;
+			PrintUsageAndExit();
+		}
+	}
+
 	// get the base path and send it to the game
 	// char basePath[255] = "";
 	// _fullpath(basePath, argv[0], sizeof(basePath));
 	// std::cout << basePath << std::endl;
 
-	// Create client and server sockets
-	InitSteamDatagramConnectionSockets();
+	// the journal benchmark doesn't touch the network
+	if (bJournalBench)
+	{
+		Journal::Benchmark(sJournal.empty() ? "journalbench.bin" : sJournal, nMatches, nMoves);
+		return 0;
+	}
+
+	if (bMatchBench)
+	{
+		Matchmaker::Benchmark(nPlayers, nArrivals);
+		return 0;
+	}
+
+	if (bDirectoryBench)
+	{
+		RoomDirectory::Benchmark(sShards.empty() ? 4 : atoi(sShards.c_str()), nRooms);
+		return 0;
+	}
+
+	if (bAnalysisBench)
+	{
+		AnalysisPool::Benchmark(nPositions, nNodes > 0 ? (uint32)nNodes : 100000);
+		return 0;
+	}
+
+	if (bReplayStats)
+	{
+		ReplayReader::Stats(sReplayPath);
+		return 0;
+	}
+
+	// replays play back offline
+	if (bReplay)
+	{
+		LocalUserInput_Init();
+
+		ReplayPlayer player;
+		player.movesPerSecond = flSpeed > 0 ? flSpeed : 2.0f;
+		player.Run(sReplayPath);
+		return 0;
+	}
+
+	// Create client and server sockets (not needed when everything runs in memory)
+	if (!bLoopback && !bNetSim)
+	{
+		InitSteamDatagramConnectionSockets();
+
+		// pretend this end is on a worse network
+		if (pProfile != nullptr)
+			ApplyNetworkProfile(*pProfile);
+	}
 	LocalUserInput_Init();
 
 	// decide which game to make
@@ -164,15 +635,98 @@ int main(int argc, const char *argv[])
 	else if (bClient)
 	{
 		Client client;
+		client.maxSelectionRate = nSelectionRate;
+		client.roomId = (uint32)nRoom;
+		client.spectate = bSpectate;
+		client.matchmake = bMatch;
+		client.rating = nRating;
 		client.Run(addrServer);
 	}
+	else if (bNetSim)
+	{
+		NetworkSimulation netSim;
+		netSim.numBots = nBots;
+		netSim.durationSeconds = nDuration > 0 ? nDuration : 10;
+		netSim.thinkMillis = nThink;
+		netSim.numWorkers = nWorkers;
+		netSim.lockstep = nLockstep;
+		netSim.profileName = sProfile;
+		netSim.Run();
+	}
+	else if (bLoadGen)
+	{
+		LoadGenerator loadGen;
+		loadGen.numBots = nBots;
+		loadGen.durationSeconds = nDuration >= 0 ? nDuration : 30;
+		loadGen.thinkMillis = nThink;
+		loadGen.numFlooders = nFlooders;
+
+		if (bLoopback)
+		{
+			// the server and bots run in this process and talk through memory
+			LoopbackNetwork network;
+			network.latency = (SteamNetworkingMicroseconds)nLatency * 1000;
+			network.lossChance = flLoss / 100.0f;
+			if (pProfile != nullptr)
+				ApplyNetworkProfile(*pProfile, network);
+
+			LoopbackTransport serverTransport(network);
+			LoopbackTransport botTransport(network);
+
+			// listen before the server thread starts so the bots can't connect too early
+			serverTransport.Listen((uint16)nPort);
+
+			Server server;
+			server.numWorkers = nWorkers;
+			server.logConnections = false;
+			// bots move as fast as the server answers, which is far over what a person can do
+			server.rateLimit = bLoopbackRateLimit;
+			server.clockTime = std::chrono::milliseconds((int64)(flClock * 1000.0f));
+			server.clockIncrement = std::chrono::milliseconds((int64)(flIncrement * 1000.0f));
+			server.lockstep = nLockstep;
+			std::thread serverThread([&]() { server.Run(&serverTransport, (uint16)nPort); });
+
+			SteamNetworkingIPAddr addrLoopback;
+			addrLoopback.Clear();
+			addrLoopback.SetIPv6LocalHost((uint16)nPort);
+			loadGen.Run(&botTransport, addrLoopback);
+
+			server.Stop();
+			serverThread.join();
+		}
+		else
+		{
+			GnsTransport transport(SteamNetworkingSockets());
+			loadGen.Run(&transport, addrServer);
+		}
+	}
 	else
 	{
 		Server server;
+		server.numWorkers = nWorkers;
+		server.journalPath = sJournal;
+		server.replayDirectory = sReplays;
+		server.metricsPath = sMetrics;
+		server.metricsInterval = std::chrono::seconds(nMetricsInterval > 0 ? nMetricsInterval : 10);
+		server.rateLimit = bRateLimit;
+		server.clockTime = std::chrono::milliseconds((int64)(flClock * 1000.0f));
+		server.clockIncrement = std::chrono::milliseconds((int64)(flIncrement * 1000.0f));
+		server.lockstep = nLockstep;
+		server.analysisThreads = nAnalysisThreads;
+
+		// with other shards this process listens on its own address from the list and journals to JOURNAL.INDEX
+		if (!sShards.empty())
+		{
+			if (!server.directory.Configure(sShards, nShard, sJournal))
+				PrintUsageAndExit();
+			server.journalPath = server.directory.GetShard(nShard).journalPath;
+			nPort = server.directory.GetShard(nShard).addr.m_port;
+		}
 		server.Run((uint16)nPort);
 	}
 
-	ShutdownSteamDatagramConnectionSockets();
+	if (!bLoopback && !bNetSim)
+		ShutdownSteamDatagramConnectionSockets();
 
 	// Ug, why is there no simple solution for portable, non-blocking console user input?
 	// Just nuke the process
@@ -0,0 +1,85 @@
+// per connection limits on how fast a client can send, so one flooding client can't slow down everyone else.
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <chrono>
+
+#include "Tools.h"
+
+// how many messages of each class a connection may send per second, and how many it can save up for a burst.
+// a real client coalesces its outline piece to 20 updates a second and only sends a board when it moves.
+const double RATE_SELECTION_PER_SEC = 60.0;
+const double RATE_SELECTION_BURST = 30.0;
+const double RATE_MOVE_PER_SEC = 10.0;
+const double RATE_MOVE_BURST = 20.0;
+// everything else (resync requests, joining rooms, matchmaking)
+const double RATE_CONTROL_PER_SEC = 5.0;
+const double RATE_CONTROL_BURST = 10.0;
+
+// a connection is disconnected once it keeps going over its limits faster than this
+const double RATE_FLOOD_PER_SEC = 50.0;
+const double RATE_FLOOD_BURST = 500.0;
+
+// tokens refill at a steady rate up to the burst size and every message takes one
+class TokenBucket {
+public:
+	void reset(double perSecond, double burst, std::chrono::steady_clock::time_point now) {
+		rate = perSecond;
+		capacity = burst;
+		tokens = burst;
+		last = now;
+	}
+
+	// false if there are no tokens left
+	bool take(std::chrono::steady_clock::time_point now, double cost = 1.0) {
+		if (now > last) {
+			tokens += std::chrono::duration<double>(now - last).count() * rate;
+			if (tokens > capacity) {
+				tokens = capacity;
+			}
+			last = now;
+		}
+
+		if (tokens < cost) {
+			return false;
+		}
+		tokens -= cost;
+		return true;
+	}
+
+private:
+	double rate = 0.0;
+	double capacity = 0.0;
+	double tokens = 0.0;
+	std::chrono::steady_clock::time_point last;
+};
+
+// one bucket for each class of message a connection sends
+struct ConnectionLimits {
+	TokenBucket selection;
+	TokenBucket move;
+	TokenBucket control;
+
+	// throttled messages, once this runs out the connection is flooding
+	TokenBucket flood;
+
+	void reset(std::chrono::steady_clock::time_point now) {
+		selection.reset(RATE_SELECTION_PER_SEC, RATE_SELECTION_BURST, now);
+		move.reset(RATE_MOVE_PER_SEC, RATE_MOVE_BURST, now);
+		control.reset(RATE_CONTROL_PER_SEC, RATE_CONTROL_BURST, now);
+		flood.reset(RATE_FLOOD_PER_SEC, RATE_FLOOD_BURST, now);
+	}
+
+	// the bucket a message type is charged to
+	TokenBucket &forType(int type) {
+		if (type == DataPacket::MsgType::GAME_SELECTION) {
+			return selection;
+		}
+		if (type == DataPacket::MsgType::GAME_DATA || type == DataPacket::MsgType::GAME_ACTION) {
+			return move;
+		}
+		return control;
+	}
+};
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef RENDERQUEUE_H
+#define RENDERQUEUE_H
+
+#include <glm/glm.hpp>
+
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+
+// graphics tools
+#include "Asset.h"
+#include "Model.h"
+
+// everything drawn in one frame, sorted so blending comes out right no matter what order assets were added in.
+// opaque draws are grouped by state (shader, model, material) and go front to back inside a group so the depth test
+// throws away hidden pixels early. Transparent draws go back to front after them, and the UI goes on top of everything.
+class RenderQueue {
+public:
+	// Windows already defines OPAQUE and TRANSPARENT
+	enum Bucket { OPAQUE_BUCKET = 0, TRANSPARENT_BUCKET = 1, UI_BUCKET = 2 };
+
+	struct Item {
+		uint64_t key;
+
+		// nullptr for every instance of a model at once (Model::instances)
+		Asset *asset;
+		Model *model;
+	};
+
+	std::vector<Item> items;
+
+	void clear() {
+		items.clear();
+	}
+
+	// depth is the distance in front of the camera (0 to maxDepth)
+	void add(Bucket bucket, unsigned int shader, unsigned int model, unsigned int material, float depth, float maxDepth, Asset *asset, Model *modelPtr) {
+		Item item;
+		item.key = makeKey(bucket, shader, model, material, depth, maxDepth);
+		item.asset = asset;
+		item.model = modelPtr;
+		items.push_back(item);
+	}
+
+	void sort() {
+		std::sort(items.begin(), items.end(), [](const Item &a, const Item &b) { return a.key < b.key; });
+	}
+
+	static Bucket bucketOf(uint64_t key) {
+		return (Bucket)(key >> 62);
+	}
+
+	// bucket (2 bits) first. Opaque and UI keys then hold shader (6), model (12), material (12) and depth (32), nearest
+	// first. Transparent keys put the depth (farthest first) before the state, since the order matters more than the cost.
+	static uint64_t makeKey(Bucket bucket, unsigned int shader, unsigned int model, unsigned int material, float depth, float maxDepth) {
+		uint64_t state = ((uint64_t)(shader & 0x3F) << 24) | ((uint64_t)(model & 0xFFF) << 12) | (uint64_t)(material & 0xFFF);
+
+		uint64_t quantized = 0;
+		if (maxDepth > 0.0f && depth > 0.0f) {
+			float scaled = depth / maxDepth;
+			quantized = scaled >= 1.0f ? 0xFFFFFFFFULL : (uint64_t)(scaled * 4294967295.0f);
+		}
+
+		if (bucket == TRANSPARENT_BUCKET) {
+			return ((uint64_t)bucket << 62) | ((0xFFFFFFFFULL - quantized) << 30) | (state & 0x3FFFFFFF);
+		}
+		return ((uint64_t)bucket << 62) | (state << 32) | quantized;
+	}
+};
+
+#endif
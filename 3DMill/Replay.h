@@ -0,0 +1,539 @@
+// replay files for finished matches. A replay is the stream of numbered changes (deltas) the server sent,
+// with a full keyframe of the state every few moves and an index of where the keyframes are, so a viewer
+// can jump to any move by reading one keyframe and at most REPLAY_KEYFRAME_INTERVAL deltas.
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <iostream>
+#include <filesystem>
+
+#include "Tools.h"
+#include "Rules.h"
+
+// moves between keyframes. Seeking costs at most this many deltas.
+const uint32 REPLAY_KEYFRAME_INTERVAL = 16;
+
+// 2 added the action fields to DeltaPacket
+const uint32 REPLAY_VERSION = 2;
+
+const char REPLAY_EXTENSION[] = ".3dr";
+
+// how often the replay writer looks for finished matches
+const std::chrono::milliseconds REPLAY_WRITER_POLL(100);
+
+// file layout:
+//   ReplayHeader
+//   for each move number 0 to numMoves: a ReplayKeyframe if the number is a multiple of the interval,
+//   then (except after the last move) the next move as [uint16 size][DeltaPacket cut to DeltaPacketSize]
+//   the seek index: one uint32 file offset per keyframe
+struct ReplayHeader
+{
+	char magic[4] = { '3', 'D', 'M', 'R' };
+	uint32 version = REPLAY_VERSION;
+
+	uint32 roomId = 0;
+	uint32 numMoves = 0;
+
+	uint32 keyframeInterval = REPLAY_KEYFRAME_INTERVAL;
+	uint32 numKeyframes = 0;
+	uint32 indexOffset = 0;
+
+	// Rules color that won, NONE if nobody did
+	int winner = 0;
+
+	// counters at the end of the match
+	int score1 = 0;
+	int score2 = 0;
+	int piecesLeft1 = 0;
+	int piecesLeft2 = 0;
+
+	// seconds since the epoch when the match finished
+	int64 finishedAt = 0;
+};
+
+// a full game state without the parts of a DataPacket that only matter on the network
+struct ReplayKeyframe
+{
+	int score1;
+	int score2;
+	int piecesLeft1;
+	int piecesLeft2;
+	int currentTurn;
+
+	uint32 sequence;
+	uint64 checksum;
+
+	int8 board[BOARD_SLOTS];
+
+	void FromPacket(const DataPacket &data) {
+		score1 = data.score1;
+		score2 = data.score2;
+		piecesLeft1 = data.piecesLeft1;
+		piecesLeft2 = data.piecesLeft2;
+		currentTurn = data.currentTurn;
+		sequence = data.sequence;
+		checksum = data.checksum;
+
+		for (int slot = 0; slot < BOARD_SLOTS; slot++) {
+			int c, x, y, z;
+			slotCoord(slot, c, x, y, z);
+			board[slot] = (int8)data.board[c][x][y][z];
+		}
+	}
+
+	void ToPacket(DataPacket &data) const {
+		data.type = DataPacket::MsgType::GAME_DATA;
+		data.score1 = score1;
+		data.score2 = score2;
+		data.piecesLeft1 = piecesLeft1;
+		data.piecesLeft2 = piecesLeft2;
+		data.currentTurn = currentTurn;
+		data.sequence = sequence;
+		data.checksum = checksum;
+
+		for (int slot = 0; slot < BOARD_SLOTS; slot++) {
+			int c, x, y, z;
+			slotCoord(slot, c, x, y, z);
+			data.board[c][x][y][z] = board[slot];
+		}
+	}
+};
+
+// collects the moves of the match a room is playing. Moves are kept in their file form so a long match stays small.
+class ReplayRecorder
+{
+public:
+	// start over from the state the next match begins at
+	void Start(const DataPacket &state) {
+		start = state;
+		moves.clear();
+		numMoves = 0;
+	}
+
+	void Add(const DeltaPacket &delta) {
+		uint16 size = (uint16)DeltaPacketSize(delta);
+
+		size_t offset = moves.size();
+		moves.resize(offset + sizeof(size) + size);
+		memcpy(&moves[offset], &size, sizeof(size));
+		memcpy(&moves[offset + sizeof(size)], &delta, size);
+		numMoves++;
+	}
+
+	uint32 NumMoves() const {
+		return numMoves;
+	}
+
+	// write the match out as a replay file. Returns false if it could not be written.
+	bool Write(const std::string &path, uint32 roomId, int winner) const {
+		ReplayHeader header;
+		header.roomId = roomId;
+		header.numMoves = numMoves;
+		header.winner = winner;
+		header.finishedAt = (int64)std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+		// the whole file is built in memory and written at once
+		std::vector<char> file(sizeof(header));
+		std::vector<uint32> index;
+
+		DataPacket state = start;
+		size_t cursor = 0;
+		for (uint32 move = 0; move <= numMoves; move++) {
+			if (move % REPLAY_KEYFRAME_INTERVAL == 0) {
+				ReplayKeyframe keyframe;
+				keyframe.FromPacket(state);
+
+				index.push_back((uint32)file.size());
+				Append(file, &keyframe, sizeof(keyframe));
+			}
+
+			if (move == numMoves) {
+				break;
+			}
+
+			uint16 size;
+			memcpy(&size, &moves[cursor], sizeof(size));
+
+			DeltaPacket delta;
+			memcpy(&delta, &moves[cursor + sizeof(size)], size);
+			uint64 checksum = 0;
+			ApplyDelta(state, delta, checksum);
+
+			Append(file, &moves[cursor], sizeof(size) + size);
+			cursor += sizeof(size) + size;
+		}
+
+		header.numKeyframes = (uint32)index.size();
+		header.indexOffset = (uint32)file.size();
+		header.score1 = state.score1;
+		header.score2 = state.score2;
+		header.piecesLeft1 = state.piecesLeft1;
+		header.piecesLeft2 = state.piecesLeft2;
+
+		Append(file, index.data(), index.size() * sizeof(uint32));
+		memcpy(file.data(), &header, sizeof(header));
+
+		FILE *out = nullptr;
+		if (fopen_s(&out, path.c_str(), "wb") != 0 || out == nullptr) {
+			return false;
+		}
+		bool written = fwrite(file.data(), 1, file.size(), out) == file.size();
+		fclose(out);
+		return written;
+	}
+
+private:
+	DataPacket start;
+	std::vector<char> moves;
+	uint32 numMoves = 0;
+
+	static void Append(std::vector<char> &buffer, const void *data, size_t size) {
+		size_t offset = buffer.size();
+		buffer.resize(offset + size);
+		memcpy(&buffer[offset], data, size);
+	}
+};
+
+// writes finished matches out on its own thread so a room worker never waits on the disk. Workers hand their
+// recordings over on a lock-free queue, the same way they journal.
+class ReplayWriter
+{
+public:
+	// counters for the server console
+	std::atomic<uint64> replaysWritten{ 0 };
+	std::atomic<uint64> replaysFailed{ 0 };
+
+	ReplayWriter() {
+		// the queue always holds one node the writer has already consumed
+		queueHead = &stub;
+		queueTail = &stub;
+	}
+
+	~ReplayWriter() {
+		Stop();
+
+		// anything added after Stop is dropped
+		while (Pop() != nullptr) {
+		}
+		if (queueTail != &stub) {
+			delete queueTail;
+		}
+	}
+
+	// replays are written into directory, which has to exist
+	void Start(const std::string &directory) {
+		this->directory = directory;
+		running = true;
+		writer = std::thread(&ReplayWriter::Run, this);
+	}
+
+	// write out everything queued and stop the writer. The room workers have to be stopped first.
+	void Stop() {
+		if (!running) {
+			return;
+		}
+
+		running = false;
+		wakeup.Notify();
+		writer.join();
+
+		// a worker that saw running just before it was cleared can push after the writer's last pass
+		WriteQueued();
+	}
+
+	// called by the room workers when a match ends. Never blocks. The recording is moved out and left empty,
+	// the room Starts it again for the next match.
+	void Add(ReplayRecorder &recording, const std::string &name, uint32 roomId, int winner) {
+		if (!running) {
+			return;
+		}
+
+		Entry *entry = new Entry();
+		entry->recording = std::move(recording);
+		recording = ReplayRecorder();
+		entry->name = name;
+		entry->roomId = roomId;
+		entry->winner = winner;
+
+		// multi-producer push: swing the head to the new node, then link the old head to it
+		Entry *prev = queueHead.exchange(entry, std::memory_order_acq_rel);
+		prev->next.store(entry, std::memory_order_release);
+	}
+
+private:
+	// one finished match
+	struct Entry {
+		std::atomic<Entry*> next{ nullptr };
+		ReplayRecorder recording;
+		std::string name;
+		uint32 roomId = 0;
+		int winner = 0;
+	};
+
+	std::string directory;
+
+	std::atomic<bool> running{ false };
+	std::thread writer;
+	EventSignal wakeup;
+
+	// producers swap the head, only the writer touches the tail
+	Entry stub;
+	std::atomic<Entry*> queueHead;
+	Entry *queueTail;
+
+	void Run() {
+		while (true) {
+			bool stopping = !running;
+
+			WriteQueued();
+
+			if (stopping) {
+				break;
+			}
+
+			wakeup.WaitFor(REPLAY_WRITER_POLL);
+		}
+	}
+
+	// only the writer (or Stop once it has joined the writer) calls this
+	void WriteQueued() {
+		while (Entry *entry = Pop()) {
+			if (entry->recording.Write((std::filesystem::path(directory) / entry->name).string(), entry->roomId, entry->winner)) {
+				replaysWritten++;
+			}
+			else {
+				replaysFailed++;
+				std::cout << "Could not write replay " << entry->name << std::endl;
+			}
+
+			// the node lives on as the stub, it doesn't need the moves any more
+			entry->recording = ReplayRecorder();
+		}
+	}
+
+	// single consumer pop. The returned entry stays valid until the next Pop.
+	Entry *Pop() {
+		Entry *tail = queueTail;
+		Entry *next = tail->next.load(std::memory_order_acquire);
+		if (next == nullptr) {
+			return nullptr;
+		}
+
+		// the consumed node becomes the new stub
+		queueTail = next;
+		if (tail != &stub) {
+			delete tail;
+		}
+		return next;
+	}
+};
+
+// reads a replay and moves through it. The file is small so it is read into memory whole.
+class ReplayReader
+{
+public:
+	ReplayHeader header;
+
+	// load a replay. Returns false if it is missing or not a valid replay.
+	bool Open(const std::string &path) {
+		FILE *file = nullptr;
+		if (fopen_s(&file, path.c_str(), "rb") != 0 || file == nullptr) {
+			return false;
+		}
+
+		fseek(file, 0, SEEK_END);
+		long size = ftell(file);
+		fseek(file, 0, SEEK_SET);
+
+		bytes.resize(size > 0 ? (size_t)size : 0);
+		bool read = fread(bytes.data(), 1, bytes.size(), file) == bytes.size();
+		fclose(file);
+
+		if (!read || bytes.size() < sizeof(header)) {
+			return false;
+		}
+		memcpy(&header, bytes.data(), sizeof(header));
+
+		if (!ValidHeader(header) || header.numKeyframes == 0 ||
+			(uint64)header.indexOffset + header.numKeyframes * sizeof(uint32) > bytes.size()) {
+			return false;
+		}
+
+		index.resize(header.numKeyframes);
+		memcpy(index.data(), &bytes[header.indexOffset], header.numKeyframes * sizeof(uint32));
+		for (int i = 0; i < index.size(); i++) {
+			if ((uint64)index[i] + sizeof(ReplayKeyframe) > header.indexOffset) {
+				return false;
+			}
+		}
+
+		DataPacket state;
+		return Seek(0, state);
+	}
+
+	// read only the header of a replay. This is all the batch stats need.
+	static bool ReadHeader(const std::string &path, ReplayHeader &header) {
+		FILE *file = nullptr;
+		if (fopen_s(&file, path.c_str(), "rb") != 0 || file == nullptr) {
+			return false;
+		}
+		bool read = fread(&header, sizeof(header), 1, file) == 1;
+		fclose(file);
+
+		return read && ValidHeader(header);
+	}
+
+	// number of moves applied to the last state returned
+	uint32 Position() const {
+		return position;
+	}
+
+	// set state to how it was after the given number of moves (clamped to the end).
+	// starts from the nearest keyframe at or before it so it never applies more than one interval of moves.
+	bool Seek(uint32 move, DataPacket &state) {
+		if (move > header.numMoves) {
+			move = header.numMoves;
+		}
+
+		uint32 keyframeIndex = move / header.keyframeInterval;
+		if (keyframeIndex >= index.size()) {
+			keyframeIndex = (uint32)index.size() - 1;
+		}
+
+		ReplayKeyframe keyframe;
+		memcpy(&keyframe, &bytes[index[keyframeIndex]], sizeof(keyframe));
+		keyframe.ToPacket(state);
+
+		position = keyframeIndex * header.keyframeInterval;
+		cursor = index[keyframeIndex] + sizeof(keyframe);
+
+		while (position < move) {
+			if (!Next(state)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// apply the next move to state, which must be the last state this reader returned.
+	// returns false at the end or if the move does not follow on.
+	bool Next(DataPacket &state) {
+		if (position >= header.numMoves || cursor + sizeof(uint16) > header.indexOffset) {
+			return false;
+		}
+
+		uint16 size;
+		memcpy(&size, &bytes[cursor], sizeof(size));
+		if (size > sizeof(DeltaPacket) || cursor + sizeof(size) + size > header.indexOffset) {
+			return false;
+		}
+
+		// replay files can come from anywhere, so every slot is checked before the move touches the board
+		DeltaPacket delta;
+		memcpy(&delta, &bytes[cursor + sizeof(size)], size);
+		uint64 checksum = 0;
+		if (size < offsetof(DeltaPacket, changes) || delta.numChanges < 0 || delta.numChanges > BOARD_SLOTS || size < DeltaPacketSize(delta) ||
+			!Rules::legalChanges(delta) || !ApplyDelta(state, delta, checksum) || checksum != delta.checksum) {
+			return false;
+		}
+
+		position++;
+		cursor += sizeof(size) + size;
+
+		// moves on the interval are preceded by their keyframe, which Next doesn't need
+		if (position % header.keyframeInterval == 0) {
+			cursor += sizeof(ReplayKeyframe);
+		}
+		return true;
+	}
+
+	// print a summary of every replay in a directory, reading only their headers
+	static void Stats(const std::string &directory) {
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+		uint64 files = 0;
+		uint64 invalid = 0;
+		uint64 wins[3] = { 0, 0, 0 };
+		uint64 totalMoves = 0;
+		uint32 shortest = 0;
+		uint32 longest = 0;
+
+		// match lengths in buckets of 25 moves, the last one holds everything longer
+		const int bucketMoves = 25;
+		const int lengthBuckets = 20;
+		uint64 lengths[lengthBuckets] = {};
+
+		std::error_code error;
+		for (std::filesystem::directory_iterator it(directory, error), end; !error && it != end; it.increment(error)) {
+			if (it->path().extension() != REPLAY_EXTENSION) {
+				continue;
+			}
+
+			ReplayHeader header;
+			if (!ReadHeader(it->path().string(), header)) {
+				invalid++;
+				continue;
+			}
+
+			if (files == 0 || header.numMoves < shortest) {
+				shortest = header.numMoves;
+			}
+			if (header.numMoves > longest) {
+				longest = header.numMoves;
+			}
+			files++;
+			totalMoves += header.numMoves;
+			wins[header.winner >= Rules::NONE && header.winner <= Rules::BLUE ? header.winner : Rules::NONE]++;
+
+			int bucket = header.numMoves / bucketMoves;
+			lengths[bucket < lengthBuckets ? bucket : lengthBuckets - 1]++;
+		}
+
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		if (error) {
+			std::cout << "Can't read " << directory << ": " << error.message() << std::endl;
+		}
+
+		std::cout << "Scanned " << files << " replays (" << invalid << " invalid) in " << seconds * 1000.0 << " ms, " <<
+			(seconds > 0 ? (uint64)(files / seconds) : files) << " per second" << std::endl;
+		if (files == 0) {
+			return;
+		}
+
+		std::cout << "Red wins " << wins[Rules::RED] << ", blue wins " << wins[Rules::BLUE] << ", no winner " << wins[Rules::NONE] << std::endl;
+		std::cout << "Moves per match: average " << (double)totalMoves / files << ", shortest " << shortest << ", longest " << longest << std::endl;
+		for (int i = 0; i < lengthBuckets; i++) {
+			if (lengths[i] == 0) {
+				continue;
+			}
+
+			if (i == lengthBuckets - 1)
+				std::cout << "  " << i * bucketMoves << "+ moves: " << lengths[i] << std::endl;
+			else
+				std::cout << "  " << i * bucketMoves << "-" << (i + 1) * bucketMoves - 1 << " moves: " << lengths[i] << std::endl;
+		}
+	}
+
+private:
+	std::vector<char> bytes;
+	std::vector<uint32> index;
+
+	uint32 position = 0;
+	// file offset of the record of move position + 1
+	size_t cursor = 0;
+
+	static bool ValidHeader(const ReplayHeader &header) {
+		return memcmp(header.magic, ReplayHeader().magic, sizeof(header.magic)) == 0 && header.version == REPLAY_VERSION &&
+			header.keyframeInterval > 0 && header.numKeyframes == header.numMoves / header.keyframeInterval + 1;
+	}
+};
+
+#endif
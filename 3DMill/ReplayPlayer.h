@@ -0,0 +1,179 @@
+// plays a replay file back on the normal game renderer. Controlled from the console.
+
+#ifndef REPLAY_PLAYER_H
+#define REPLAY_PLAYER_H
+
+#include <string.h>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <iostream>
+
+#include "Local3DMill.h"
+
+#include "Tools.h"
+#include "Replay.h"
+
+// prototypes
+// callbacks
+void replayPlacePieceCallback(Piece::Color color, glm::vec4 pos);
+void replayClearBoardCallback();
+void replayOutlinePieceMoveCallback(bool visible, glm::vec3 pos);
+
+void* replayPlayerPtr;
+
+class ReplayPlayer
+{
+public:
+	Local3DMill game;
+
+	// playback speed. Anything past the frame rate applies several moves per frame and only draws the last one.
+	float movesPerSecond = 2.0f;
+
+	void Run(const std::string &path)
+	{
+		if (!reader.Open(path)) {
+			std::cout << "Can't read replay " << path << std::endl;
+			return;
+		}
+
+		std::cout << "Replay of room " << reader.header.roomId << ": " << reader.header.numMoves << " moves, " <<
+			(reader.header.winner == Rules::RED ? "red won" : reader.header.winner == Rules::BLUE ? "blue won" : "no winner") << std::endl;
+		PrintCommands();
+
+		// the board only shows the replay, anything done to it locally is put back
+		replayPlayerPtr = this;
+		game.gameManager.setPiecePlaceCallback(replayPlacePieceCallback);
+		game.gameManager.setClearBoardCallback(replayClearBoardCallback);
+		game.gameManager.setOutlinePieceMoveCallback(replayOutlinePieceMoveCallback);
+
+		game.enableFPSCounter = false;
+
+		reader.Seek(0, state);
+		ApplyState();
+
+		std::chrono::steady_clock::time_point lastFrame = std::chrono::steady_clock::now();
+		double pendingMoves = 0;
+
+		while (!g_bQuit && game.run() == 1)
+		{
+			PollLocalUserInput();
+
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			double seconds = std::chrono::duration<double>(now - lastFrame).count();
+			lastFrame = now;
+
+			if (playing) {
+				pendingMoves += seconds * movesPerSecond;
+
+				bool moved = false;
+				while (pendingMoves >= 1.0) {
+					pendingMoves -= 1.0;
+					if (!reader.Next(state)) {
+						playing = false;
+						pendingMoves = 0;
+						std::cout << "End of replay at move " << reader.Position() << std::endl;
+						break;
+					}
+					moved = true;
+				}
+
+				if (moved)
+					ApplyState();
+			}
+			else {
+				pendingMoves = 0;
+			}
+
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+	}
+
+	// show the current replay state on the board
+	void ApplyState() {
+		// the win banner belongs to the move it was shown on
+		if (game.gameManager.winPause) {
+			game.gameManager.winPause = false;
+			game.gameManager.graphics->textManager.removeText("win_msg");
+		}
+
+		game.gameManager.board.setBoardToData(&state);
+		game.gameManager.setScores(state.score1, state.score2);
+		game.gameManager.setPiecesLeft(state.piecesLeft1, state.piecesLeft2);
+		game.gameManager.setTurnToInt(state.currentTurn);
+	}
+
+private:
+	ReplayReader reader;
+	DataPacket state;
+
+	bool playing = true;
+
+	void PrintCommands()
+	{
+		std::cout << "Replay commands include: '/play', '/pause', '/seek MOVE', '/speed MOVES_PER_SEC' and '/quit'" << std::endl;
+	}
+
+	void PollLocalUserInput()
+	{
+		std::string cmd;
+		while (!g_bQuit && LocalUserInput_GetNext(cmd))
+		{
+			if (strcmp(cmd.c_str(), "/quit") == 0)
+			{
+				g_bQuit = true;
+				break;
+			}
+
+			if (strcmp(cmd.c_str(), "/play") == 0) {
+				// playing from the end starts over
+				if (reader.Position() >= reader.header.numMoves) {
+					reader.Seek(0, state);
+					ApplyState();
+				}
+				playing = true;
+				continue;
+			}
+
+			if (strcmp(cmd.c_str(), "/pause") == 0) {
+				playing = false;
+				std::cout << "Paused at move " << reader.Position() << " of " << reader.header.numMoves << std::endl;
+				continue;
+			}
+
+			if (strncmp(cmd.c_str(), "/seek ", 6) == 0) {
+				int move = atoi(cmd.c_str() + 6);
+				if (!reader.Seek(move > 0 ? (uint32)move : 0, state)) {
+					std::cout << "The replay is damaged after move " << reader.Position() << std::endl;
+				}
+				ApplyState();
+				std::cout << "Move " << reader.Position() << " of " << reader.header.numMoves << std::endl;
+				continue;
+			}
+
+			if (strncmp(cmd.c_str(), "/speed ", 7) == 0) {
+				float speed = (float)atof(cmd.c_str() + 7);
+				if (speed > 0)
+					movesPerSecond = speed;
+				std::cout << "Playing at " << movesPerSecond << " moves/sec" << std::endl;
+				continue;
+			}
+
+			PrintCommands();
+		}
+	}
+};
+
+// local changes are not part of the replay so put the board back
+void replayPlacePieceCallback(Piece::Color color, glm::vec4 pos) {
+	((ReplayPlayer*)replayPlayerPtr)->ApplyState();
+}
+
+void replayClearBoardCallback() {
+	((ReplayPlayer*)replayPlayerPtr)->ApplyState();
+}
+
+void replayOutlinePieceMoveCallback(bool visible, glm::vec3 pos) {
+}
+
+#endif
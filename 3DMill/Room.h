@@ -0,0 +1,1024 @@
+// rooms hold one match each. Every room belongs to exactly one worker thread (picked by room id) which owns all of its state.
+#ifndef ROOM_H
+#define ROOM_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <iostream>
+
+#include <GameNetworkingSockets/steam/steamnetworkingsockets.h>
+#include <GameNetworkingSockets/steam/isteamnetworkingutils.h>
+
+#include "Tools.h"
+#include "Rules.h"
+#include "Metrics.h"
+#include "Transport.h"
+#include "Journal.h"
+#include "Replay.h"
+#include "TimerWheel.h"
+#include "SendQueue.h"
+
+// most spectators watching one room (on top of the two players)
+const int MAX_ROOM_SPECTATORS = 1000;
+
+// how often a worker works out its busiest rooms for the stats
+const std::chrono::seconds ROOM_LOAD_INTERVAL(1);
+
+// number of busiest rooms each worker reports
+const int ROOM_LOAD_TOP = 5;
+
+// a connection that is in a room
+struct RoomMember
+{
+	HSteamNetConnection conn;
+	std::string nick;
+
+	// 1 is red, 2 is blue, 0 is a spectator
+	int assignedTurn;
+
+	// newest selection sequence recieved from this member
+	uint32 lastSelection = 0;
+	// the settled repeat of lastSelection was already passed on
+	bool lastSelectionSettled = false;
+
+	// number of the last state this member submitted that was answered (accepted or not)
+	uint32 lastAction = 0;
+};
+
+struct Room
+{
+	uint32 id;
+
+	// the last numbered state sent to the members. Deltas are always built against this.
+	DataPacket state;
+
+	// sequence stamped on every relayed selection
+	uint32 selectionSequence = 0;
+
+	// set while the board is in a won position so a win is only counted once
+	bool finished = false;
+
+	// the opponent's pieces the player to move still has to take (see Rules::legalSubmission).
+	// it isn't journaled, so a room restored from the journal starts with none owed.
+	int millsLeft = 0;
+
+	// the player who asked for a new game while the match was still going (NONE if nobody has).
+	// the board is only cleared once the other player asks too, and a move in between withdraws the request.
+	int resetRequested = Rules::NONE;
+
+	// moves of the match being played, written out as a replay when it is won
+	ReplayRecorder replay;
+
+	// time left for red and blue (only used if the worker has a time control).
+	// the running clock is charged for the time since clockStarted when it stops.
+	int64 clockMillis[2] = { 0, 0 };
+	int clockRunning = Rules::NONE;
+	std::chrono::steady_clock::time_point clockStarted;
+	// fires when the running clock reaches zero
+	TimerWheel::TimerId clockTimer = 0;
+	// the player who ran out of time. Only a new game is accepted until the board is cleared.
+	int flagged = Rules::NONE;
+
+	// load since the worker last looked
+	uint64 messages = 0;
+	uint64 busyMicros = 0;
+
+	std::vector<RoomMember> members;
+
+	RoomMember *findMember(HSteamNetConnection conn) {
+		for (int i = 0; i < members.size(); i++) {
+			if (members[i].conn == conn) {
+				return &members[i];
+			}
+		}
+		return nullptr;
+	}
+
+	int numPlayers() {
+		int count = 0;
+		for (int i = 0; i < members.size(); i++) {
+			if (members[i].assignedTurn != Rules::NONE) {
+				count++;
+			}
+		}
+		return count;
+	}
+};
+
+// how busy a room was over the last ROOM_LOAD_INTERVAL
+struct RoomLoad
+{
+	uint32 roomId;
+	int members;
+	uint64 messages;
+	uint64 busyMicros;
+};
+
+// a join the worker turned away, handed back to the network thread so it stops sending the client's messages there
+struct RefusedJoin
+{
+	HSteamNetConnection conn;
+	uint32 joinId;
+};
+
+// work handed from the network thread to the worker that owns a room
+struct RoomJob
+{
+	// restore brings back a room another server process was hosting (from its journal). Throttled answers a move the
+	// network thread dropped for going over the rate limit.
+	enum Type { JOIN, LEAVE, MESSAGE, RESTORE, THROTTLED };
+	Type type;
+
+	uint32 roomId;
+	HSteamNetConnection conn;
+
+	// JOIN only
+	std::string nick;
+	bool spectate = false;
+	// the color to take if it is free (0 for either)
+	int turn = 0;
+	// counts the client's joins so a refusal is only matched to the join it answers
+	uint32 joinId = 0;
+
+	// LEAVE only, told to the rest of the room (optional)
+	std::string message;
+
+	// MESSAGE only. The worker releases it when it is done.
+	ISteamNetworkingMessage *msg = nullptr;
+
+	// RESTORE only
+	std::shared_ptr<const DataPacket> state;
+
+	// THROTTLED only, the number the client gave the dropped move
+	uint32 action = 0;
+};
+
+class RoomWorker {
+public:
+	int index;
+
+	// print every room join
+	bool logJoins = true;
+
+	// every accepted state is appended here if set
+	Journal *journal = nullptr;
+
+	// finished matches are handed here to be saved as replays if set
+	ReplayWriter *replayWriter = nullptr;
+
+	// each player's time for a match and what they get back for every move (no clocks if clockTime is 0).
+	// only set before Start.
+	std::chrono::milliseconds clockTime{ 0 };
+	std::chrono::milliseconds clockIncrement{ 0 };
+
+	// rooms run in lockstep if this is set: players send only the slots their move changed, the worker checks it and
+	// passes the same bytes on, and checksums are compared every lockstep actions. Only set before Start.
+	int lockstep = 0;
+
+	// counters read by the server console. They are only written by the worker thread.
+	std::atomic<uint64> messagesProcessed{ 0 };
+	std::atomic<uint64> matchesFinished{ 0 };
+	std::atomic<int> roomCount{ 0 };
+	std::atomic<uint64> wakeups{ 0 };
+	std::atomic<uint64> movesRejected{ 0 };
+	std::atomic<uint64> movesThrottled{ 0 };
+	std::atomic<uint64> flagFalls{ 0 };
+	// lockstep actions passed on, and players whose checksum did not match and had to be resynced
+	std::atomic<uint64> lockstepActions{ 0 };
+	std::atomic<uint64> desyncs{ 0 };
+	// jobs handed over but not yet picked up. Read by the network thread for admission control.
+	std::atomic<int> pendingJobs{ 0 };
+
+	// time from a move arriving at the server to the worker sending it on
+	LatencyHistogram relayLatency;
+	// the same for outline piece updates, kept apart because there are many more of them
+	LatencyHistogram selectionRelayLatency;
+
+	// time (us) spent checking a move against the rules
+	LatencyHistogram validateTime;
+	// time (us) spent queueing one message for every member of a room
+	LatencyHistogram fanoutTime;
+	// time (us) to handle one message for a room
+	LatencyHistogram roomTime;
+	// time (us) to hand everything sent in one wakeup to the transport
+	LatencyHistogram flushTime;
+	// time (us) to work through everything queued at one wakeup, and how many jobs that was
+	LatencyHistogram loopTime;
+	LatencyHistogram queueDepth;
+	std::atomic<uint64> busyMicros{ 0 };
+
+	// everything this worker sent (the network thread counts what comes in)
+	MessageCounters sent;
+
+	// sends are queued here and handed to the transport once per wakeup
+	SendQueue outbox;
+
+	RoomWorker(int index, Transport *transport) {
+		this->index = index;
+		m_pTransport = transport;
+	}
+
+	void Start() {
+		running = true;
+		thread = std::thread(&RoomWorker::Run, this);
+	}
+
+	// bring back a room from the journal. Only call before Start (after that it is a RESTORE job).
+	// it waits with no members until its players rejoin.
+	void Restore(uint32 roomId, const DataPacket &state) {
+		Room room;
+		room.id = roomId;
+		room.state = state;
+		room.finished = Rules::checkWin(state) != Rules::NONE;
+		room.replay.Start(state);
+		ResetClock(room);
+
+		rooms[roomId] = room;
+		roomCount = (int)rooms.size();
+	}
+
+	// finish whatever is queued and stop the thread
+	void Stop() {
+		{
+			std::lock_guard<std::mutex> lock(mutexInbox);
+			running = false;
+		}
+		inboxCondition.notify_one();
+
+		if (thread.joinable()) {
+			thread.join();
+		}
+	}
+
+	// the busiest rooms over the last ROOM_LOAD_INTERVAL, busiest first. Safe to call from any thread.
+	std::vector<RoomLoad> BusiestRooms() {
+		std::lock_guard<std::mutex> lock(mutexLoad);
+		return busiestRooms;
+	}
+
+	// called from the network thread. Adds the joins refused since the last call to refused.
+	void TakeRefusedJoins(std::vector<RefusedJoin> &refused) {
+		std::lock_guard<std::mutex> lock(mutexRefused);
+		refused.insert(refused.end(), refusedJoins.begin(), refusedJoins.end());
+		refusedJoins.clear();
+	}
+
+	// called from the network thread. Many jobs are handed over with one lock and one wakeup. Leaves jobs empty.
+	void PushBatch(std::vector<RoomJob> &jobs) {
+		if (jobs.empty()) {
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutexInbox);
+			if (inbox.empty()) {
+				inbox.swap(jobs);
+			}
+			else {
+				inbox.insert(inbox.end(), std::make_move_iterator(jobs.begin()), std::make_move_iterator(jobs.end()));
+			}
+			pendingJobs = (int)inbox.size();
+		}
+		inboxCondition.notify_one();
+		jobs.clear();
+	}
+
+private:
+	Transport *m_pTransport;
+
+	// everything sent to a whole room is encoded once and shared by all of its members
+	std::vector<HSteamNetConnection> recipients;
+
+	std::thread thread;
+	bool running = false;
+
+	std::mutex mutexInbox;
+	std::condition_variable inboxCondition;
+	std::vector<RoomJob> inbox;
+
+	// only touched by the worker thread
+	std::map<uint32, Room> rooms;
+
+	// the clocks of every room on this worker. The owner of a timer is its room id.
+	TimerWheel timers;
+	std::vector<TimerWheel::Expired> expired;
+
+	std::chrono::steady_clock::time_point lastLoad = std::chrono::steady_clock::now();
+	std::mutex mutexLoad;
+	std::vector<RoomLoad> busiestRooms;
+
+	std::mutex mutexRefused;
+	std::vector<RefusedJoin> refusedJoins;
+
+	void Run() {
+		std::vector<RoomJob> jobs;
+		std::vector<ISteamNetworkingMessage*> handled;
+
+		while (true) {
+			// sleep until there is work or a clock could run out, then take all of it at once
+			{
+				std::unique_lock<std::mutex> lock(mutexInbox);
+				TimerWheel::TimePoint nextTimer = timers.NextExpiry();
+				if (nextTimer == TimerWheel::TimePoint::max()) {
+					inboxCondition.wait(lock, [this] { return !inbox.empty() || !running; });
+				}
+				else {
+					inboxCondition.wait_until(lock, nextTimer, [this] { return !inbox.empty() || !running; });
+				}
+
+				if (inbox.empty() && !running) {
+					break;
+				}
+
+				jobs.swap(inbox);
+				pendingJobs = 0;
+			}
+			wakeups++;
+
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+			// work through one room at a time. Jobs for the same room keep their order.
+			std::stable_sort(jobs.begin(), jobs.end(), [](const RoomJob &a, const RoomJob &b) { return a.roomId < b.roomId; });
+			for (int i = 0; i < jobs.size(); i++) {
+				Process(jobs[i]);
+
+				if (jobs[i].msg != nullptr) {
+					handled.push_back(jobs[i].msg);
+				}
+			}
+
+			// the messages are only read in place, so they are all given back once the batch is done
+			for (int i = 0; i < handled.size(); i++) {
+				handled[i]->Release();
+			}
+			handled.clear();
+
+			// clocks that ran out while we slept or worked
+			if (timers.Armed() > 0) {
+				expired.clear();
+				timers.Advance(std::chrono::steady_clock::now(), expired);
+				for (int i = 0; i < expired.size(); i++) {
+					auto itRoom = rooms.find(expired[i].owner);
+					if (itRoom != rooms.end() && itRoom->second.clockTimer == expired[i].timer) {
+						itRoom->second.clockTimer = 0;
+						FlagFall(itRoom->second, std::chrono::steady_clock::now());
+					}
+				}
+			}
+
+			// everything this wakeup sent goes out in one call
+			if (!outbox.Empty()) {
+				std::chrono::steady_clock::time_point flushStart = std::chrono::steady_clock::now();
+				outbox.Flush(m_pTransport);
+				flushTime.record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - flushStart).count());
+			}
+
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			uint64 micros = std::chrono::duration_cast<std::chrono::microseconds>(now - start).count();
+			loopTime.record(micros);
+			queueDepth.record(jobs.size());
+			busyMicros += micros;
+			jobs.clear();
+
+			if (now - lastLoad >= ROOM_LOAD_INTERVAL) {
+				lastLoad = now;
+				UpdateBusiestRooms();
+			}
+		}
+	}
+
+	// rank the rooms by time spent on them and start counting again
+	void UpdateBusiestRooms() {
+		std::vector<RoomLoad> loads;
+		for (auto &it : rooms) {
+			Room &room = it.second;
+			if (room.busyMicros > 0) {
+				loads.push_back({ room.id, (int)room.members.size(), room.messages, room.busyMicros });
+			}
+			room.messages = 0;
+			room.busyMicros = 0;
+		}
+
+		int top = (int)loads.size() < ROOM_LOAD_TOP ? (int)loads.size() : ROOM_LOAD_TOP;
+		std::partial_sort(loads.begin(), loads.begin() + top, loads.end(), [](const RoomLoad &a, const RoomLoad &b) { return a.busyMicros > b.busyMicros; });
+		loads.resize(top);
+
+		std::lock_guard<std::mutex> lock(mutexLoad);
+		busiestRooms.swap(loads);
+	}
+
+	void Process(RoomJob &job) {
+		switch (job.type) {
+			case RoomJob::JOIN: {
+				if (!Join(job.roomId, job.conn, job.nick, job.spectate, job.turn)) {
+					std::lock_guard<std::mutex> lock(mutexRefused);
+					refusedJoins.push_back({ job.conn, job.joinId });
+				}
+				break;
+			}
+			case RoomJob::RESTORE: {
+				// a room that is already here is newer than the journal
+				if (rooms.find(job.roomId) == rooms.end()) {
+					Restore(job.roomId, *job.state);
+
+					// this worker's journal has it from now on
+					if (journal != nullptr)
+						journal->Append(job.roomId, Journal::SNAPSHOT, job.state.get(), (uint32)sizeof(DataPacket));
+				}
+				break;
+			}
+			case RoomJob::LEAVE: {
+				Leave(job.roomId, job.conn, job.message);
+				break;
+			}
+			case RoomJob::THROTTLED: {
+				Throttled(job.roomId, job.conn, job.action);
+				break;
+			}
+			case RoomJob::MESSAGE: {
+				auto itRoom = rooms.find(job.roomId);
+				if (itRoom != rooms.end()) {
+					std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+					HandleMessage(itRoom->second, job.msg);
+					uint64 micros = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+					roomTime.record(micros);
+					itRoom->second.messages++;
+					itRoom->second.busyMicros += micros;
+				}
+
+				messagesProcessed++;
+				break;
+			}
+		}
+	}
+
+	// returns false if the room had no place for them
+	bool Join(uint32 roomId, HSteamNetConnection conn, const std::string &nick, bool spectate, int turn) {
+		// joining a room that does not exist creates it
+		auto itRoom = rooms.find(roomId);
+		if (itRoom == rooms.end()) {
+			Room room;
+			room.id = roomId;
+
+			// the first numbered state is the empty board
+			room.state = Rules::newGame();
+			room.state.sequence = 0;
+			room.state.checksum = ChecksumPacket(room.state);
+			room.replay.Start(room.state);
+			ResetClock(room);
+
+			itRoom = rooms.emplace(roomId, room).first;
+			roomCount = (int)rooms.size();
+
+			if (journal != nullptr)
+				journal->Append(roomId, Journal::SNAPSHOT, &room.state, (uint32)sizeof(room.state));
+		}
+		Room &room = itRoom->second;
+
+		// only two people can play in a room, everyone else watches
+		int numPlayers = room.numPlayers();
+		if (!spectate && numPlayers >= 2) {
+			SendStringToClient(conn, ("Room " + std::to_string(roomId) + " already has two players, joining as a spectator.").c_str());
+			spectate = true;
+		}
+		if (spectate && (int)room.members.size() - numPlayers >= MAX_ROOM_SPECTATORS) {
+			SendStringToClient(conn, ("Room " + std::to_string(roomId) + " is full.").c_str());
+			return false;
+		}
+
+		RoomMember member;
+		member.conn = conn;
+		member.nick = nick;
+		member.assignedTurn = Rules::NONE;
+
+		if (!spectate) {
+			// take the color asked for if it is free, otherwise whichever one is
+			bool redTaken = false;
+			for (int i = 0; i < room.members.size(); i++) {
+				if (room.members[i].assignedTurn == Rules::RED) {
+					redTaken = true;
+				}
+			}
+			member.assignedTurn = redTaken || (turn == Rules::BLUE && numPlayers == 0) ? Rules::BLUE : Rules::RED;
+
+			// send message to the room that somebody joined. Spectators come and go quietly.
+			SendStringToRoom(room, nick + " joined room " + std::to_string(roomId) + ". Current # of players in room: " + std::to_string(numPlayers + 1));
+		}
+
+		room.members.push_back(member);
+
+		// send game setup info to the new connection so they know what turn they are
+		DataPacket data;
+		data.type = data.GAME_SETUP;
+		data.assignedTurn = member.assignedTurn;
+		data.lockstep = lockstep;
+		data.roomId = roomId;
+		SendDataToClient(conn, &data);
+
+		// then the full state
+		DataPacket snapshot = room.state;
+		snapshot.millsLeft = room.millsLeft;
+		SendDataToClient(conn, &snapshot);
+
+		// the clock starts once both players are here. A new spectator is the only one who needs telling about it.
+		if (clockTime.count() > 0) {
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			StartClock(room, now);
+			if (spectate) {
+				SendClockToClient(room, conn, now);
+			}
+			else {
+				SendClockToRoom(room, now);
+			}
+		}
+
+		if (logJoins)
+			std::cout << nick << " joined room " << roomId << " on worker " << index << std::endl;
+		return true;
+	}
+
+	// the player predicted a move the server never looked at, so they get the real state to roll back to
+	void Throttled(uint32 roomId, HSteamNetConnection conn, uint32 action) {
+		auto itRoom = rooms.find(roomId);
+		if (itRoom == rooms.end()) {
+			return;
+		}
+		RoomMember *member = itRoom->second.findMember(conn);
+		if (member == nullptr || member->assignedTurn == Rules::NONE) {
+			return;
+		}
+
+		if (action > member->lastAction) {
+			member->lastAction = action;
+		}
+		movesThrottled++;
+		SendStringToClient(conn, "Slow down, that move was sent too soon after the last ones and was dropped.");
+		SendStateToMember(itRoom->second, *member);
+	}
+
+	void Leave(uint32 roomId, HSteamNetConnection conn, const std::string &message) {
+		auto itRoom = rooms.find(roomId);
+		if (itRoom == rooms.end()) {
+			return;
+		}
+		Room &room = itRoom->second;
+
+		for (int i = 0; i < room.members.size(); i++) {
+			if (room.members[i].conn == conn) {
+				std::string nick = room.members[i].nick;
+				bool player = room.members[i].assignedTurn != Rules::NONE;
+				room.members.erase(room.members.begin() + i);
+
+				// Send a message so everybody else knows what happened
+				if (player)
+					SendStringToRoom(room, message.empty() ? nick + " left the room" : message);
+
+				// nobody's time runs while a player is missing
+				if (player && room.clockRunning != Rules::NONE) {
+					std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+					StopClock(room, now);
+					SendClockToRoom(room, now);
+				}
+				break;
+			}
+		}
+
+		// rooms only live as long as somebody is in them
+		if (room.members.empty()) {
+			timers.Cancel(room.clockTimer);
+			rooms.erase(itRoom);
+			roomCount = (int)rooms.size();
+
+			if (journal != nullptr)
+				journal->Append(roomId, Journal::CLOSE, nullptr, 0);
+		}
+	}
+
+	void HandleMessage(Room &room, ISteamNetworkingMessage *pIncomingMsg) {
+		RoomMember *member = room.findMember(pIncomingMsg->m_conn);
+		if (member == nullptr || pIncomingMsg->m_cbSize < (int)sizeof(DataPacket::MsgType)) {
+			return;
+		}
+
+		DataPacket *data = (DataPacket*)pIncomingMsg->m_pData;
+
+		// spectators can only ask for the state again
+		if (member->assignedTurn == Rules::NONE && data->type != DataPacket::MsgType::GAME_RESYNC) {
+			return;
+		}
+
+		switch (data->type) {
+			// parse the outline piece recieved
+			case DataPacket::MsgType::GAME_SELECTION: {
+				if (pIncomingMsg->m_cbSize < (int)sizeof(SelectionPacket)) {
+					break;
+				}
+
+				// drop anything older than what this member already sent. The settled repeat of the last update is
+				// passed on again, the first relay of it may not have reached everyone.
+				SelectionPacket selection = *(SelectionPacket*)pIncomingMsg->m_pData;
+				if (selection.sequence < member->lastSelection ||
+					(selection.sequence == member->lastSelection && (!selection.settled || member->lastSelectionSettled))) {
+					break;
+				}
+				member->lastSelection = selection.sequence;
+				member->lastSelectionSettled = selection.settled;
+
+				// send the selected piece as opponent to everyone else in the room
+				selection.sequence = ++room.selectionSequence;
+				SendSelectionToRoom(room, &selection, pIncomingMsg->m_conn);
+
+				selectionRelayLatency.record(m_pTransport->GetLocalTimestamp() - pIncomingMsg->m_usecTimeReceived);
+				break;
+			}
+			// parse data recieved from clients (sorry it is not secure)
+			case DataPacket::MsgType::GAME_DATA: {
+				if (pIncomingMsg->m_cbSize < (int)sizeof(DataPacket)) {
+					break;
+				}
+
+				// a move that comes in after the mover's time is up loses instead, even if the timer hasn't fired yet
+				std::chrono::steady_clock::time_point validateStart = std::chrono::steady_clock::now();
+				if (ClockExpired(room, validateStart)) {
+					FlagFall(room, validateStart);
+				}
+
+				// once someone has run out of time only a new game can be started
+				int previousTurn = room.state.currentTurn;
+				int millsLeft = room.millsLeft;
+				bool newGame = Rules::isNewGame(*data);
+				bool legal = newGame ? ResetAgreed(room, *member) :
+					room.flagged == Rules::NONE && Rules::legalSubmission(room.state, *data, member->assignedTurn, millsLeft);
+				DataPacket next = room.state;
+				if (legal) {
+					Rules::applySubmission(next, *data);
+				}
+				validateTime.record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - validateStart).count());
+
+				if (data->action > member->lastAction) {
+					member->lastAction = data->action;
+				}
+
+				// the member predicted this move, so give it the real state to roll back to
+				if (!legal) {
+					movesRejected++;
+					SendStateToMember(room, *member);
+					break;
+				}
+
+				room.millsLeft = newGame ? 0 : millsLeft;
+				room.resetRequested = Rules::NONE;
+
+				// send the change to all the members. The rules only need to look at the board again if it changed.
+				if (!CommitState(room, next, member->assignedTurn, data->action)) {
+					// nothing changed so no delta will answer the member's prediction
+					SendStateToMember(room, *member);
+				}
+				else {
+					relayLatency.record(m_pTransport->GetLocalTimestamp() - pIncomingMsg->m_usecTimeReceived);
+					FinishMove(room, member->assignedTurn, previousTurn);
+				}
+				break;
+			}
+			// a move in a lockstep room. The mover already applied it, so it is only answered if it is refused.
+			case DataPacket::MsgType::GAME_ACTION: {
+				DeltaPacket *action = (DeltaPacket*)pIncomingMsg->m_pData;
+				if (lockstep <= 0 || pIncomingMsg->m_cbSize < (int)offsetof(DeltaPacket, changes) || action->numChanges < 0 ||
+					action->numChanges > BOARD_SLOTS || pIncomingMsg->m_cbSize < (int)DeltaPacketSize(*action)) {
+					break;
+				}
+
+				std::chrono::steady_clock::time_point validateStart = std::chrono::steady_clock::now();
+				if (ClockExpired(room, validateStart)) {
+					FlagFall(room, validateStart);
+				}
+
+				// it has to follow the last state (the other player may have moved first) and the slots come first
+				// since applying a bad one would write outside the board
+				int previousTurn = room.state.currentTurn;
+				DataPacket next = room.state;
+				uint64 checksum = 0;
+				int millsLeft = room.millsLeft;
+				bool newGame = false;
+				bool legal = action->sequence == room.state.sequence + 1 && Rules::legalChanges(*action) && ApplyDelta(next, *action, checksum);
+				if (legal) {
+					// the mover worked out the scores itself, they have to be the ones the rules give
+					DataPacket expected = room.state;
+					Rules::applySubmission(expected, next);
+					newGame = Rules::isNewGame(next);
+					legal = expected.score1 == next.score1 && expected.score2 == next.score2 && (newGame ? ResetAgreed(room, *member) :
+						room.flagged == Rules::NONE && Rules::legalSubmission(room.state, next, member->assignedTurn, millsLeft));
+				}
+				validateTime.record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - validateStart).count());
+
+				if (action->action > member->lastAction) {
+					member->lastAction = action->action;
+				}
+
+				if (!legal) {
+					movesRejected++;
+					SendStateToMember(room, *member);
+					break;
+				}
+
+				room.millsLeft = newGame ? 0 : millsLeft;
+				room.resetRequested = Rules::NONE;
+
+				// the journal and replays hold the change like any other, with its full checksum
+				DeltaPacket delta;
+				memcpy(&delta, action, DeltaPacketSize(*action));
+				delta.type = DataPacket::MsgType::GAME_DELTA;
+				delta.actionTurn = member->assignedTurn;
+				delta.checksum = checksum;
+				RecordDelta(room, delta);
+				room.state = next;
+
+				// everyone else applies the same bytes. Every lockstep actions the checksum goes along so they can tell
+				// if they went wrong, and the mover's own one is checked here.
+				bool verify = delta.sequence % lockstep == 0;
+				delta.type = DataPacket::MsgType::GAME_ACTION;
+				delta.checksum = verify ? checksum : 0;
+				SendToRoom(room, &delta, DeltaPacketSize(delta), k_nSteamNetworkingSend_Reliable, member->conn);
+				lockstepActions++;
+
+				if (verify && action->checksum != checksum) {
+					desyncs++;
+					SendStateToMember(room, *member);
+				}
+
+				relayLatency.record(m_pTransport->GetLocalTimestamp() - pIncomingMsg->m_usecTimeReceived);
+				FinishMove(room, member->assignedTurn, previousTurn);
+				break;
+			}
+			// a client missed a state or its checksum did not match, so give it the full state again
+			case DataPacket::MsgType::GAME_RESYNC: {
+				SendStateToMember(room, *member);
+				break;
+			}
+			default: {
+				break;
+			}
+		}
+	}
+
+	// if the next state differs from the last numbered one, give it the next sequence id and send it to every member as a delta.
+	// actionTurn and action say whose submission it was so that player can match it to its prediction.
+	// returns true if a new state was sent
+	bool CommitState(Room &room, const DataPacket &next, int actionTurn = 0, uint32 action = 0) {
+		DeltaPacket delta;
+		BuildDelta(room.state, next, delta);
+		delta.actionTurn = actionTurn;
+		delta.action = action;
+
+		// nothing changed so there is nothing to number
+		if (delta.numChanges == 0 && next.score1 == room.state.score1 && next.score2 == room.state.score2 &&
+			next.piecesLeft1 == room.state.piecesLeft1 && next.piecesLeft2 == room.state.piecesLeft2 && next.currentTurn == room.state.currentTurn) {
+			return false;
+		}
+
+		delta.sequence = room.state.sequence + 1;
+		ApplyDelta(room.state, delta, delta.checksum);
+		RecordDelta(room, delta);
+
+		SendToRoom(room, &delta, DeltaPacketSize(delta), k_nSteamNetworkingSend_Reliable);
+		return true;
+	}
+
+	// the journal gets every change before anyone is told about it
+	void RecordDelta(Room &room, const DeltaPacket &delta) {
+		if (journal != nullptr)
+			journal->Append(room.id, Journal::DELTA, &delta, DeltaPacketSize(delta));
+
+		// changes while the board shows a win are not part of any match
+		if (replayWriter != nullptr && !room.finished)
+			room.replay.Add(delta);
+	}
+
+	// a player's move changed the state
+	void FinishMove(Room &room, int mover, int previousTurn) {
+		// count each finished match once
+		int winner = Rules::checkWin(room.state);
+		bool won = winner != Rules::NONE;
+		if (won && !room.finished) {
+			matchesFinished++;
+			SaveReplay(room, winner);
+		}
+		// the board was cleared after a win so the next match starts here
+		else if (!won && room.finished) {
+			room.replay.Start(room.state);
+		}
+		room.finished = won;
+
+		UpdateClock(room, mover, previousTurn);
+	}
+
+	// a new game can start once the match is over. While it is still going both players have to ask for one,
+	// so the first to ask is only told to wait for the other.
+	bool ResetAgreed(Room &room, RoomMember &member) {
+		if (room.finished || Rules::isNewGame(room.state)) {
+			return true;
+		}
+		if (room.resetRequested != Rules::NONE && room.resetRequested != member.assignedTurn) {
+			return true;
+		}
+
+		if (room.resetRequested == Rules::NONE) {
+			room.resetRequested = member.assignedTurn;
+			SendStringToRoom(room, member.nick + " wants to start a new game, type /clear to agree");
+		}
+		return false;
+	}
+
+	// the full numbered state, answering everything the member has submitted so far
+	void SendStateToMember(Room &room, RoomMember &member) {
+		DataPacket snapshot = room.state;
+		snapshot.millsLeft = room.millsLeft;
+		snapshot.action = member.lastAction;
+		SendDataToClient(member.conn, &snapshot);
+	}
+
+	// clocks
+
+	// a new match, both players get the full time
+	void ResetClock(Room &room) {
+		room.clockMillis[0] = clockTime.count();
+		room.clockMillis[1] = clockTime.count();
+		room.flagged = Rules::NONE;
+	}
+
+	// start the clock of the player to move, as long as both players are here and the match is still going
+	void StartClock(Room &room, std::chrono::steady_clock::time_point now) {
+		int turn = room.state.currentTurn;
+		if (clockTime.count() <= 0 || room.clockRunning != Rules::NONE || room.finished || room.flagged != Rules::NONE ||
+			(turn != Rules::RED && turn != Rules::BLUE) || room.numPlayers() < 2) {
+			return;
+		}
+
+		room.clockRunning = turn;
+		room.clockStarted = now;
+		room.clockTimer = timers.Arm(room.id, now + std::chrono::milliseconds(room.clockMillis[turn - 1]));
+	}
+
+	// charge the running clock for the time since it started
+	void StopClock(Room &room, std::chrono::steady_clock::time_point now) {
+		if (room.clockRunning == Rules::NONE) {
+			return;
+		}
+
+		room.clockMillis[room.clockRunning - 1] -= std::chrono::duration_cast<std::chrono::milliseconds>(now - room.clockStarted).count();
+		timers.Cancel(room.clockTimer);
+		room.clockTimer = 0;
+		room.clockRunning = Rules::NONE;
+	}
+
+	bool ClockExpired(Room &room, std::chrono::steady_clock::time_point now) {
+		return room.clockRunning != Rules::NONE && now - room.clockStarted >= std::chrono::milliseconds(room.clockMillis[room.clockRunning - 1]);
+	}
+
+	// a move was made. The mover gets the increment if it passed the turn on, then the next player's clock starts.
+	void UpdateClock(Room &room, int mover, int previousTurn) {
+		if (clockTime.count() <= 0) {
+			return;
+		}
+
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		StopClock(room, now);
+
+		if (Rules::isNewGame(room.state)) {
+			ResetClock(room);
+		}
+		else if (room.state.currentTurn != previousTurn && (mover == Rules::RED || mover == Rules::BLUE)) {
+			room.clockMillis[mover - 1] += clockIncrement.count();
+		}
+
+		StartClock(room, now);
+		SendClockToRoom(room, now);
+	}
+
+	// the player whose clock is running lost on time
+	void FlagFall(Room &room, std::chrono::steady_clock::time_point now) {
+		int loser = room.clockRunning;
+		if (loser == Rules::NONE) {
+			return;
+		}
+		int winner = loser == Rules::RED ? Rules::BLUE : Rules::RED;
+
+		StopClock(room, now);
+		room.clockMillis[loser - 1] = 0;
+		room.flagged = loser;
+		flagFalls++;
+
+		std::string nick = loser == Rules::RED ? "Red" : "Blue";
+		for (int i = 0; i < room.members.size(); i++) {
+			if (room.members[i].assignedTurn == loser) {
+				nick = room.members[i].nick;
+			}
+		}
+		SendStringToRoom(room, nick + " ran out of time");
+
+		if (!room.finished) {
+			matchesFinished++;
+			SaveReplay(room, winner);
+			room.finished = true;
+
+			// the point for a win on time is given like any other
+			DataPacket next = room.state;
+			Rules::addWin(next, winner);
+			CommitState(room, next);
+		}
+		room.finished = true;
+
+		SendClockToRoom(room, now);
+	}
+
+	// the clocks as they are right now
+	ClockPacket BuildClock(Room &room, std::chrono::steady_clock::time_point now) {
+		ClockPacket clock;
+		int64 left[2] = { room.clockMillis[0], room.clockMillis[1] };
+		if (room.clockRunning != Rules::NONE) {
+			left[room.clockRunning - 1] -= std::chrono::duration_cast<std::chrono::milliseconds>(now - room.clockStarted).count();
+		}
+
+		clock.millisLeft1 = (int)(left[0] > 0 ? left[0] : 0);
+		clock.millisLeft2 = (int)(left[1] > 0 ? left[1] : 0);
+		clock.running = room.clockRunning;
+		clock.flagged = room.flagged;
+		return clock;
+	}
+
+	void SendClockToRoom(Room &room, std::chrono::steady_clock::time_point now) {
+		ClockPacket clock = BuildClock(room, now);
+		SendToRoom(room, &clock, (uint32)sizeof(clock), k_nSteamNetworkingSend_Reliable);
+	}
+
+	void SendClockToClient(Room &room, HSteamNetConnection conn, std::chrono::steady_clock::time_point now) {
+		ClockPacket clock = BuildClock(room, now);
+		outbox.Send(conn, &clock, (uint32)sizeof(clock), k_nSteamNetworkingSend_Reliable);
+		sent.record(clock.type, sizeof(clock));
+	}
+
+	// the file is written on the replay writer's thread, the room starts its next recording when the board is cleared
+	void SaveReplay(Room &room, int winner) {
+		if (replayWriter == nullptr) {
+			return;
+		}
+
+		// room, time and a count so rooms that finish more than one match a second don't overwrite each other
+		std::string name = "room" + std::to_string(room.id) + "-" +
+			std::to_string(std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count()) + "-" +
+			std::to_string(index) + "-" + std::to_string(matchesFinished.load()) + REPLAY_EXTENSION;
+
+		replayWriter->Add(room.replay, name, room.id, winner);
+	}
+
+	// sending
+	void SendStringToClient(HSteamNetConnection conn, const char* str) {
+		DataPacket data;
+		data.type = data.CONNECTION_STATUS;
+		strncpy_s(data.msg, sizeof(data.msg), str, _TRUNCATE);
+		SendDataToClient(conn, &data);
+	}
+
+	void SendStringToRoom(Room &room, const std::string &str, HSteamNetConnection except = k_HSteamNetConnection_Invalid) {
+		DataPacket data;
+		data.type = data.CONNECTION_STATUS;
+		strncpy_s(data.msg, sizeof(data.msg), str.c_str(), _TRUNCATE);
+		SendToRoom(room, &data, (uint32)sizeof(data), k_nSteamNetworkingSend_Reliable, except);
+	}
+
+	// encode once, queue for every member
+	void SendToRoom(Room &room, const void *data, uint32 size, int sendFlags, HSteamNetConnection except = k_HSteamNetConnection_Invalid) {
+		recipients.clear();
+		for (int i = 0; i < room.members.size(); i++) {
+			if (room.members[i].conn != except)
+				recipients.push_back(room.members[i].conn);
+		}
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		outbox.SendToMany(recipients, data, size, sendFlags);
+		fanoutTime.record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+
+		sent.record(*(const int*)data, size, recipients.size());
+	}
+
+	void SendDataToClient(HSteamNetConnection conn, DataPacket *data) {
+		outbox.Send(conn, data, (uint32)sizeof(*data), k_nSteamNetworkingSend_Reliable);
+		sent.record(data->type, sizeof(*data));
+	}
+
+	// selections are sent unreliably without delay. If they can't go out right away they are stale anyway.
+	void SendSelectionToRoom(Room &room, SelectionPacket *selection, HSteamNetConnection except) {
+		SendToRoom(room, selection, (uint32)sizeof(*selection), selection->settled ? k_nSteamNetworkingSend_Reliable : k_nSteamNetworkingSend_UnreliableNoDelay, except);
+	}
+};
+
+#endif
@@ -0,0 +1,339 @@
+// the rules of 3D Mill on plain packet data (no graphics), so the server can run thousands of games at once.
+#ifndef RULES_H
+#define RULES_H
+
+#include <stdlib.h>
+
+#include "Tools.h"
+
+// packet board values
+// -1 is EMPTY (center holes), 0 is None, 1 is red, 2 is blue
+class Rules {
+public:
+	enum Slot { EMPTY = -1, NONE = 0, RED = 1, BLUE = 2 };
+
+	// centers of each cube face and the cube center can never hold a piece
+	static bool isHole(int x, int y, int z) {
+		int centerCount = 0;
+		if (x == 1)
+			centerCount++;
+		if (y == 1)
+			centerCount++;
+		if (z == 1)
+			centerCount++;
+
+		return centerCount >= 2;
+	}
+
+	// a new game with an empty board and full reserves
+	static DataPacket newGame() {
+		DataPacket data;
+		data.type = DataPacket::MsgType::GAME_DATA;
+
+		clearBoard(data);
+
+		data.score1 = 0;
+		data.score2 = 0;
+
+		data.piecesLeft1 = 23;
+		data.piecesLeft2 = 23;
+
+		data.currentTurn = RED;
+
+		return data;
+	}
+
+	static void clearBoard(DataPacket &data) {
+		for (int c = 0; c < 3; c++) {
+			for (int x = 0; x < 3; x++) {
+				for (int y = 0; y < 3; y++) {
+					for (int z = 0; z < 3; z++) {
+						data.board[c][x][y][z] = isHole(x, y, z) ? EMPTY : NONE;
+					}
+				}
+			}
+		}
+	}
+
+	// get the current number of pieces with a certain color on the board
+	static int piecesOnBoard(const DataPacket &data, int color) {
+		int count = 0;
+
+		for (int c = 0; c < 3; c++) {
+			for (int x = 0; x < 3; x++) {
+				for (int y = 0; y < 3; y++) {
+					for (int z = 0; z < 3; z++) {
+						if (data.board[c][x][y][z] == color) {
+							count++;
+						}
+					}
+				}
+			}
+		}
+
+		return count;
+	}
+
+	// returns the winner or NONE. A player loses once they have less than three pieces on the board and in reserve.
+	static int checkWin(const DataPacket &data) {
+		// Check if Blue Wins
+		if (data.piecesLeft1 + piecesOnBoard(data, RED) < 3) {
+			return BLUE;
+		}
+
+		// Check if Red Wins
+		if (data.piecesLeft2 + piecesOnBoard(data, BLUE) < 3) {
+			return RED;
+		}
+
+		return NONE;
+	}
+
+	// an empty board with full reserves, how clients start a new game
+	static bool isNewGame(const DataPacket &data) {
+		if (data.piecesLeft1 != 23 || data.piecesLeft2 != 23) {
+			return false;
+		}
+		return piecesOnBoard(data, RED) == 0 && piecesOnBoard(data, BLUE) == 0;
+	}
+
+	static int slotValue(const DataPacket &data, int slot) {
+		int c, x, y, z;
+		slotCoord(slot, c, x, y, z);
+		return data.board[c][x][y][z];
+	}
+
+	// whether a piece can move between two slots without flying: along a cube edge, or from the middle of an edge
+	// to the same spot on the next cube (same as GameManager::validMoveLocation)
+	static bool adjacent(int from, int to) {
+		int c1, x1, y1, z1, c2, x2, y2, z2;
+		slotCoord(from, c1, x1, y1, z1);
+		slotCoord(to, c2, x2, y2, z2);
+		if (isHole(x1, y1, z1) || isHole(x2, y2, z2)) {
+			return false;
+		}
+
+		if (c1 == c2) {
+			return abs(x1 - x2) + abs(y1 - y2) + abs(z1 - z2) == 1;
+		}
+		return abs(c1 - c2) == 1 && x1 == x2 && y1 == y2 && z1 == z2 && (x1 == 1 || y1 == 1 || z1 == 1);
+	}
+
+	// mills the piece on a slot is part of: the edges of its cube, and the line through all three cubes if it is
+	// in the middle of an edge (same as GameManager::checkMill)
+	static int millsThrough(const DataPacket &data, int slot) {
+		int c, p[3];
+		slotCoord(slot, c, p[0], p[1], p[2]);
+		int color = data.board[c][p[0]][p[1]][p[2]];
+		if (color != RED && color != BLUE) {
+			return 0;
+		}
+
+		int mills = 0;
+		for (int axis = 0; axis < 3; axis++) {
+			int a = p[(axis + 1) % 3];
+			int b = p[(axis + 2) % 3];
+			if (a == 1 || b == 1) {
+				continue;
+			}
+
+			int count = 0;
+			for (int i = 0; i < 3; i++) {
+				int q[3];
+				q[axis] = i;
+				q[(axis + 1) % 3] = a;
+				q[(axis + 2) % 3] = b;
+				if (data.board[c][q[0]][q[1]][q[2]] == color) {
+					count++;
+				}
+			}
+			if (count == 3) {
+				mills++;
+			}
+		}
+
+		if ((p[0] == 1) + (p[1] == 1) + (p[2] == 1) == 1 && data.board[0][p[0]][p[1]][p[2]] == color &&
+			data.board[1][p[0]][p[1]][p[2]] == color && data.board[2][p[0]][p[1]][p[2]] == color) {
+			mills++;
+		}
+
+		return mills;
+	}
+
+	// pieces of a color that can be taken (any that aren't part of a mill)
+	static int takeablePieces(const DataPacket &data, int color) {
+		int count = 0;
+		for (int slot = 0; slot < BOARD_SLOTS; slot++) {
+			if (slotValue(data, slot) == color && millsThrough(data, slot) == 0) {
+				count++;
+			}
+		}
+		return count;
+	}
+
+	// whether a player (turn) may submit this as the next state. millsLeft is the number of the opponent's pieces the
+	// player still has to take, and is updated if the submission is legal.
+	// on their turn a player places a piece from the reserve or moves one to a slot next to it (anywhere once they are
+	// down to three), and closing mills with it earns one take per mill (of a piece that isn't in a mill itself). The
+	// takes can come in the same submission or one at a time after it, and the turn passes to the opponent as soon as
+	// there are none left to make. Scores aren't checked, applySubmission works them out.
+	// a new game is not a move, the room decides when one can start (see isNewGame).
+	// the server uses this to accept or reject a move and the client to check its own moves before predicting them.
+	static bool legalSubmission(const DataPacket &state, const DataPacket &submitted, int turn, int &millsLeft) {
+		if ((turn != RED && turn != BLUE) || turn != state.currentTurn || checkWin(state) != NONE) {
+			return false;
+		}
+		int opponent = turn == RED ? BLUE : RED;
+
+		DataPacket next = state;
+		applySubmission(next, submitted);
+
+		int reserve = turn == RED ? state.piecesLeft1 : state.piecesLeft2;
+		int nextReserve = turn == RED ? next.piecesLeft1 : next.piecesLeft2;
+		if ((opponent == RED ? next.piecesLeft1 : next.piecesLeft2) != (opponent == RED ? state.piecesLeft1 : state.piecesLeft2)) {
+			return false;
+		}
+
+		int placed = -1;
+		int vacated = -1;
+		int numPlaced = 0;
+		int numVacated = 0;
+		int numTaken = 0;
+		for (int slot = 0; slot < BOARD_SLOTS; slot++) {
+			int before = slotValue(state, slot);
+			int after = slotValue(next, slot);
+			if (before == after) {
+				continue;
+			}
+
+			if (before == NONE && after == turn) {
+				placed = slot;
+				numPlaced++;
+			}
+			else if (before == turn && after == NONE) {
+				vacated = slot;
+				numVacated++;
+			}
+			else if (before == opponent && after == NONE && millsThrough(state, slot) == 0) {
+				numTaken++;
+			}
+			else {
+				return false;
+			}
+		}
+
+		int owed = millsLeft;
+		if (owed == 0) {
+			if (numPlaced != 1 || numVacated > 1) {
+				return false;
+			}
+
+			// from the reserve, or along the board
+			if (numVacated == 0) {
+				if (reserve <= 0 || nextReserve != reserve - 1) {
+					return false;
+				}
+			}
+			else {
+				bool flying = reserve + piecesOnBoard(state, turn) <= 3;
+				if (nextReserve != reserve || (!flying && !adjacent(vacated, placed))) {
+					return false;
+				}
+			}
+
+			owed = millsThrough(next, placed);
+		}
+		// only takes until they are done
+		else if (numPlaced != 0 || numVacated != 0 || nextReserve != reserve) {
+			return false;
+		}
+
+		if (numTaken > owed) {
+			return false;
+		}
+		owed -= numTaken;
+		if (owed > 0 && takeablePieces(next, opponent) == 0) {
+			owed = 0;
+		}
+
+		if (next.currentTurn != (owed > 0 ? turn : opponent)) {
+			return false;
+		}
+
+		millsLeft = owed;
+		return true;
+	}
+
+	// whether a lockstep action only puts pieces (or nothing) in slots that can hold one.
+	// run before it is applied since a bad slot number would write outside the board.
+	static bool legalChanges(const DeltaPacket &action) {
+		if (action.numChanges < 0 || action.numChanges > BOARD_SLOTS) {
+			return false;
+		}
+
+		for (int i = 0; i < action.numChanges; i++) {
+			int value = action.changes[i].value;
+			if (action.changes[i].slot >= BOARD_SLOTS || (value != NONE && value != RED && value != BLUE)) {
+				return false;
+			}
+
+			int c, x, y, z;
+			slotCoord(action.changes[i].slot, c, x, y, z);
+			if (isHole(x, y, z)) {
+				return false;
+			}
+		}
+
+		return action.currentTurn == RED || action.currentTurn == BLUE;
+	}
+
+	// take the board, reserves and turn a client sent as the new state.
+	// a turn of 0 means neutral (the board was cleared) so the turn stays the same.
+	// scores are never taken from the client, the winner gets a point when the move that wins the match is applied.
+	static void applySubmission(DataPacket &state, const DataPacket &submitted) {
+		bool won = checkWin(state) != NONE;
+
+		for (int c = 0; c < 3; c++) {
+			for (int x = 0; x < 3; x++) {
+				for (int y = 0; y < 3; y++) {
+					for (int z = 0; z < 3; z++) {
+						int value = submitted.board[c][x][y][z];
+
+						if (isHole(x, y, z)) {
+							state.board[c][x][y][z] = EMPTY;
+						}
+						else if (value == RED || value == BLUE) {
+							state.board[c][x][y][z] = value;
+						}
+						else {
+							state.board[c][x][y][z] = NONE;
+						}
+					}
+				}
+			}
+		}
+
+		state.piecesLeft1 = submitted.piecesLeft1;
+		state.piecesLeft2 = submitted.piecesLeft2;
+
+		if (submitted.currentTurn == RED || submitted.currentTurn == BLUE) {
+			state.currentTurn = submitted.currentTurn;
+		}
+
+		if (!won) {
+			addWin(state, checkWin(state));
+		}
+	}
+
+	// a point for the winner of a match (nothing for NONE)
+	static void addWin(DataPacket &state, int winner) {
+		if (winner == RED) {
+			state.score1++;
+		}
+		else if (winner == BLUE) {
+			state.score2++;
+		}
+	}
+};
+
+#endif
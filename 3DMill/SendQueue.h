@@ -0,0 +1,182 @@
+// everything a room worker sends during one pass of its loop. Messages are copied into pooled buffers as they are
+// queued and handed to the transport together in one call when the pass is done. Reliable messages to the same
+// connection are packed into one batch message, and only the newest unreliable one is kept.
+#ifndef SENDQUEUE_H
+#define SENDQUEUE_H
+
+#include <vector>
+#include <algorithm>
+#include <atomic>
+
+#include "Tools.h"
+#include "Broadcast.h"
+#include "Transport.h"
+
+// biggest batch message. Anything more for the same connection goes in another one.
+const uint32 SEND_QUEUE_MAX_BATCH = 64 * 1024;
+
+class SendQueue {
+public:
+	// counters since the start. Read by the server console, only written by the owning thread.
+	// calls to the transport, messages that went out, messages queued, messages saved by packing them into batches
+	// and unreliable ones that were replaced by a newer one before they went out
+	std::atomic<uint64> flushes{ 0 };
+	std::atomic<uint64> wireMessages{ 0 };
+	std::atomic<uint64> queued{ 0 };
+	std::atomic<uint64> coalesced{ 0 };
+	std::atomic<uint64> superseded{ 0 };
+
+	~SendQueue() {
+		for (int i = 0; i < entries.size(); i++) {
+			entries[i].buffer->Release();
+		}
+	}
+
+	bool Empty() const {
+		return entries.empty();
+	}
+
+	void Send(HSteamNetConnection conn, const void *data, uint32 size, int sendFlags) {
+		Add(conn, SharedBuffer::Create(data, size, 1), size, sendFlags);
+	}
+
+	// the payload is copied once and shared by every connection
+	void SendToMany(const std::vector<HSteamNetConnection> &conns, const void *data, uint32 size, int sendFlags) {
+		if (conns.empty()) {
+			return;
+		}
+
+		SharedBuffer *buffer = SharedBuffer::Create(data, size, (int)conns.size());
+		for (int i = 0; i < conns.size(); i++) {
+			Add(conns[i], buffer, size, sendFlags);
+		}
+	}
+
+	// hand everything queued to the transport
+	void Flush(Transport *transport) {
+		if (entries.empty()) {
+			return;
+		}
+
+		// group by connection. Each connection's messages stay in the order they were queued.
+		std::stable_sort(entries.begin(), entries.end(), [](const OutboundMessage &a, const OutboundMessage &b) { return a.conn < b.conn; });
+
+		for (int first = 0; first < entries.size();) {
+			int last = first;
+			while (last < entries.size() && entries[last].conn == entries[first].conn) {
+				last++;
+			}
+
+			int newestUnreliable = -1;
+			for (int i = first; i < last; i++) {
+				if (entries[i].sendFlags & k_nSteamNetworkingSend_Reliable) {
+					AddToBatch(i);
+					continue;
+				}
+
+				if (newestUnreliable >= 0) {
+					entries[newestUnreliable].buffer->Release();
+					superseded++;
+				}
+				newestUnreliable = i;
+			}
+			EndBatch();
+
+			if (newestUnreliable >= 0) {
+				outbound.push_back(entries[newestUnreliable]);
+			}
+
+			first = last;
+		}
+
+		wireMessages += outbound.size();
+		flushes++;
+		transport->SendMessages(outbound);
+
+		outbound.clear();
+		entries.clear();
+	}
+
+private:
+	std::vector<OutboundMessage> entries;
+	std::vector<OutboundMessage> outbound;
+
+	// reliable messages for the connection being flushed that haven't gone into outbound yet
+	std::vector<int> batch;
+	uint32 batchSize = 0;
+
+	void Add(HSteamNetConnection conn, SharedBuffer *buffer, uint32 size, int sendFlags) {
+		OutboundMessage message;
+		message.conn = conn;
+		message.buffer = buffer;
+		message.size = size;
+		message.sendFlags = sendFlags;
+		entries.push_back(message);
+		queued++;
+	}
+
+	void AddToBatch(int index) {
+		uint32 size = BatchEntrySize(entries[index].size);
+		if (!batch.empty() && batchSize + size > SEND_QUEUE_MAX_BATCH) {
+			EndBatch();
+		}
+
+		if (batch.empty()) {
+			batchSize = (uint32)sizeof(BatchHeader);
+		}
+		batch.push_back(index);
+		batchSize += size;
+	}
+
+	// a lone message goes out as it is, more than one are copied into a batch
+	void EndBatch() {
+		if (batch.empty()) {
+			return;
+		}
+
+		if (batch.size() == 1) {
+			outbound.push_back(entries[batch[0]]);
+			batch.clear();
+			return;
+		}
+
+		SharedBuffer *buffer = SharedBuffer::Allocate(batchSize, 1);
+		char *data = (char*)buffer->data();
+
+		BatchHeader header;
+		header.count = (uint32)batch.size();
+		memcpy(data, &header, sizeof(header));
+		uint32 offset = (uint32)sizeof(header);
+
+		int sendFlags = 0;
+		for (int i = 0; i < batch.size(); i++) {
+			OutboundMessage &message = entries[batch[i]];
+
+			BatchEntry entry;
+			entry.size = message.size;
+			entry.reserved = 0;
+			memcpy(data + offset, &entry, sizeof(entry));
+			memcpy(data + offset + sizeof(entry), message.buffer->data(), message.size);
+
+			// zero the padding so nothing left over in the block goes out
+			uint32 padded = BatchEntrySize(message.size);
+			memset(data + offset + sizeof(entry) + message.size, 0, padded - sizeof(entry) - message.size);
+			offset += padded;
+
+			sendFlags |= message.sendFlags;
+			message.buffer->Release();
+		}
+
+		OutboundMessage message;
+		message.conn = entries[batch[0]].conn;
+		message.buffer = buffer;
+		message.size = offset;
+		message.sendFlags = sendFlags;
+		outbound.push_back(message);
+
+		coalesced += batch.size() - 1;
+		batch.clear();
+	}
+};
+
+#endif
@@ -29,49 +29,215 @@
 #include <signal.h>
 
 #include "Tools.h"
-
-#include "Local3DMill.h"
-
+#include "Metrics.h"
+#include "Transport.h"
+#include "Room.h"
+#include "Matchmaker.h"
+#include "RateLimit.h"
+#include "Directory.h"
+#include "Analysis.h"
+
+// the most connections the server holds at once (in the lobby and in rooms)
+const int MAX_SERVER_CLIENTS = 20000;
+
+// GameNetworkingSockets can't wake us up when a message arrives, so the network loop polls fast while clients are active
+// and backs off while everyone is quiet. Console input wakes it immediately.
+// how long after the last message or connection change the server counts as active
+const std::chrono::milliseconds SERVER_ACTIVE_WINDOW(5000);
+// wait between polls while active
+const std::chrono::microseconds SERVER_ACTIVE_POLL(1000);
+// the longest wait between polls while clients are connected but quiet. A player who thought for longer than the
+// active window waits up to this long for their move to be picked up, so keep it under the 10 ms the server used to poll at
+const std::chrono::microseconds SERVER_IDLE_POLL(5000);
+// wait between polls with nobody connected (only new connections can show up)
+const std::chrono::microseconds SERVER_EMPTY_POLL(250000);
+
+// number of connections with the worst ping listed by '/stats'
+const int STATS_WORST_CONNECTIONS = 5;
+
+// most messages taken from the transport at once
+const int SERVER_RECEIVE_BATCH = 256;
+
+// a worker with this many jobs waiting is saturated. New connections are turned away and outline pieces
+// for its rooms are dropped until it catches up.
+const int WORKER_QUEUE_SATURATED = 20000;
+
+// a link to another shard that isn't up yet is tried again this often
+const std::chrono::milliseconds SHARD_LINK_RETRY(1000);
+// a shard whose link dropped is probed again for this long before its rooms are taken over. A shard that is busy or
+// briefly cut off gets back in time and keeps its rooms.
+const std::chrono::milliseconds SHARD_DOWN_GRACE(15000);
+
+// rooms made by the matchmaker are numbered from here so they don't run into rooms players pick themselves.
+// players can only join one of these once it has been handed out (see Server::MatchRoomIssued)
+const uint32 MATCH_ROOM_FIRST = 0x80000000;
+
+// the network thread accepts connections and hands every message to the worker that owns the sender's room.
+// rooms are sharded across the workers by room id so a room is only ever touched by one thread.
 class Server {
 public:
+	// number of room worker threads (0 picks one per core)
+	int numWorkers = 0;
+
+	// print every connection and room join (too much with thousands of bots)
+	bool logConnections = true;
+
+	// hold every connection to the limits in RateLimit.h (off for load tests that move as fast as they can)
+	bool rateLimit = true;
+
+	// file to journal matches to so they survive a crash (empty for none)
+	std::string journalPath;
+
+	// directory finished matches are saved to as replays (empty for none)
+	std::string replayDirectory;
+
+	// time control for every match: each player's time and what they get back per move (no clocks if clockTime is 0)
+	std::chrono::milliseconds clockTime{ 0 };
+	std::chrono::milliseconds clockIncrement{ 0 };
+
+	// run every room in lockstep, comparing checksums every this many actions (0 sends every state from the server)
+	int lockstep = 0;
+
+	// threads searching positions for clients that ask for analysis (0 turns every request away)
+	int analysisThreads = 1;
+
+	// the other server processes sharing the rooms, if there are any. Rooms this process doesn't host are redirected,
+	// and the rooms of a shard that goes away are brought back from its journal by whichever shards host them now.
+	RoomDirectory directory;
+
+	// file the metrics are written to every metricsInterval in the Prometheus text format (empty for none)
+	std::string metricsPath;
+	std::chrono::seconds metricsInterval{ 10 };
+
 	// Start and run the server
 	void Run(uint16 nPort)
 	{
-		// init game stuff
-		game = GameManager();
-
 		// Select instance to use.  For now we'll always use the default.
-		m_pInterface = SteamNetworkingSockets();
+		GnsTransport transport(SteamNetworkingSockets());
+		Run(&transport, nPort);
+	}
+
+	// run the server on any transport until '/quit' or Stop
+	void Run(Transport *transport, uint16 nPort)
+	{
+		m_pTransport = transport;
+		m_pTransport->SetStatusChangedCallback(StatusChangedCallback, this);
+		stopRequested = false;
+
+		// start the room workers
+		if (numWorkers <= 0)
+			numWorkers = (int)std::thread::hardware_concurrency();
+		if (numWorkers <= 0)
+			numWorkers = 1;
+
+		for (int i = 0; i < numWorkers; i++)
+		{
+			workers.push_back(std::unique_ptr<RoomWorker>(new RoomWorker(i, m_pTransport)));
+			workers.back()->logJoins = logConnections;
+			workers.back()->clockTime = clockTime;
+			workers.back()->clockIncrement = clockIncrement;
+			workers.back()->lockstep = lockstep;
+		}
+		workerJobs.resize(numWorkers);
+		matchRoomsUsed.assign(numWorkers, 0);
+
+		if (!replayDirectory.empty())
+		{
+			std::error_code error;
+			std::filesystem::create_directories(replayDirectory, error);
+			if (error)
+				std::cout << "Can't create replay directory " << replayDirectory << ": " << error.message() << std::endl;
+
+			replayWriter.Start(replayDirectory);
+			for (int i = 0; i < numWorkers; i++)
+				workers[i]->replayWriter = &replayWriter;
+		}
+
+		// bring back the matches that were going when the server last stopped
+		if (!journalPath.empty())
+			RecoverJournal();
+
+		for (int i = 0; i < numWorkers; i++)
+			workers[i]->Start();
+		analysis.Start(analysisThreads, m_pTransport);
+		statsTime = std::chrono::steady_clock::now();
 
 		// Start listening
-		SteamNetworkingIPAddr serverLocalAddr;
-		serverLocalAddr.Clear();
-		serverLocalAddr.m_port = nPort;
-		SteamNetworkingConfigValue_t opt;
-		opt.SetPtr(k_ESteamNetworkingConfig_Callback_ConnectionStatusChanged, (void*)SteamNetConnectionStatusChangedCallback);
-		m_hListenSock = m_pInterface->CreateListenSocketIP(serverLocalAddr, 1, &opt);
-		if (m_hListenSock == k_HSteamListenSocket_Invalid)
-			std::cout << "Failed to listen on port " << nPort << std::endl;
-		m_hPollGroup = m_pInterface->CreatePollGroup();
-		if (m_hPollGroup == k_HSteamNetPollGroup_Invalid)
+		if (!m_pTransport->Listen(nPort))
 			std::cout << "Failed to listen on port " << nPort << std::endl;
-		std::cout << "Server listening on port " << nPort << std::endl;
+		std::cout << "Server listening on port " << nPort << " with " << numWorkers << " room workers" << std::endl;
+
+		// every shard keeps a link to every other one to find out when it goes away
+		if (directory.Enabled())
+		{
+			std::cout << "Shard " << directory.self << " of " << directory.NumShards() << std::endl;
+			shardLinks.resize(directory.NumShards());
+		}
 
-		std::cout << "Server commands include: '/quit' and '/test'" << std::endl;
+		std::cout << "Server commands include: '/quit', '/test', '/rooms' and '/stats'" << std::endl;
+
+		// console input wakes the loop up
+		LocalUserInput_SetSignal(&wakeup);
+
+		std::chrono::steady_clock::time_point lastActivity = std::chrono::steady_clock::now();
+		std::chrono::microseconds pollWait = SERVER_ACTIVE_POLL;
+		std::chrono::steady_clock::time_point nextMetrics = std::chrono::steady_clock::now() + metricsInterval;
 
 		// Main server loop
-		while (!g_bQuit)
+		while (!g_bQuit && !stopRequested)
 		{
-			PollIncomingMessages();
+			size_t numClients = m_mapClients.size();
+
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			CollectRefusedJoins();
+			int numMessages = PollIncomingMessages();
+			if (numMessages > 0)
+			{
+				ingestMessages += numMessages;
+				ingestMicros += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+			}
 			PollConnectionStateChanges();
+			UpdateShardLinks();
 			PollLocalUserInput();
+			PlaceMatches();
+			FlushJobs();
+			loopWakeups++;
+
+			// sleep until the next poll or until something wakes us
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			pollTime.record(std::chrono::duration_cast<std::chrono::microseconds>(now - start).count());
+
+			if (!metricsPath.empty() && now >= nextMetrics)
+			{
+				nextMetrics = now + metricsInterval;
+				SampleConnections();
+				WriteMetrics();
+			}
+
+			if (numMessages > 0 || numClients != m_mapClients.size())
+				lastActivity = now;
+
+			if (now - lastActivity < SERVER_ACTIVE_WINDOW)
+				pollWait = SERVER_ACTIVE_POLL;
+			else if (m_mapClients.empty())
+				pollWait = SERVER_EMPTY_POLL;
+			else
+				pollWait = std::chrono::microseconds(pollWait.count() * 2 < SERVER_IDLE_POLL.count() ? pollWait.count() * 2 : SERVER_IDLE_POLL.count());
+
+			// don't sleep through the next metrics write
+			if (!metricsPath.empty() && nextMetrics - now < pollWait)
+				pollWait = std::chrono::duration_cast<std::chrono::microseconds>(nextMetrics - now);
 
-			game.update();
+			// or the next pair the matchmaker can make
+			std::chrono::steady_clock::time_point nextMatch = matchmaker.NextMatchTime();
+			if (nextMatch != std::chrono::steady_clock::time_point::max() && nextMatch - now < pollWait)
+				pollWait = nextMatch > now ? std::chrono::duration_cast<std::chrono::microseconds>(nextMatch - now) : std::chrono::microseconds(0);
 
-			//delay server update
-			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			wakeup.WaitFor(pollWait, stopRequested);
 		}
 
+		LocalUserInput_SetSignal(nullptr);
+
 		// Close all the connections
 		std::cout << "Closing connections..." << std::endl;
 		for (auto it : m_mapClients)
@@ -80,66 +246,351 @@ public:
 			// SendStringToClient(it.first, "Server is shutting down.  Goodbye.");
 
 			// Close Connection
-			m_pInterface->CloseConnection(it.first, 0, "Server Shutdown", true);
+			m_pTransport->CloseConnection(it.first, 0, "Server Shutdown", true);
 		}
 		// Reset and destroy vars
 		m_mapClients.clear();
 
-		m_pInterface->CloseListenSocket(m_hListenSock);
-		m_hListenSock = k_HSteamListenSocket_Invalid;
+		for (int i = 0; i < shardLinks.size(); i++)
+		{
+			if (shardLinks[i].conn != k_HSteamNetConnection_Invalid)
+				m_pTransport->CloseConnection(shardLinks[i].conn, 0, "Server Shutdown", false);
+		}
+		shardLinks.clear();
+
+		FlushJobs();
+		analysis.Stop();
+		for (int i = 0; i < workers.size(); i++)
+			workers[i]->Stop();
+		workers.clear();
+		workerJobs.clear();
+
+		// the workers are stopped first so nothing is journaled after the journal stops. Everything they journaled is
+		// on disk once this returns, and every replay they finished
+		journal.Stop();
+		replayWriter.Stop();
+
+		// how fast the network thread took messages in and handed them to the workers
+		if (ingestMicros > 0)
+			std::cout << "Ingested " << ingestMessages << " messages in " << ingestMicros / 1000 << " ms of network thread time (" <<
+				(uint64)(ingestMessages * 1000000.0 / ingestMicros) << " messages/sec)" << std::endl;
+
+		m_pTransport->SetStatusChangedCallback(nullptr, nullptr);
+		m_pTransport = nullptr;
+	}
 
-		m_pInterface->DestroyPollGroup(m_hPollGroup);
-		m_hPollGroup = k_HSteamNetPollGroup_Invalid;
+	// ask Run to return. Safe to call from any thread.
+	void Stop()
+	{
+		stopRequested = true;
+		wakeup.Notify();
 	}
 private:
 
-	// Game vars
-	GameManager game;
-
 	// Networking vars
-	HSteamListenSocket m_hListenSock;
-	HSteamNetPollGroup m_hPollGroup;
-	ISteamNetworkingSockets *m_pInterface;
+	Transport *m_pTransport = nullptr;
+	std::atomic<bool> stopRequested{ false };
 
 	struct Client_t
 	{
 		std::string m_sNick;
+
+		// room the client is in (0 means still in the lobby). Set when the join is sent and put back to 0 if the
+		// worker refuses it (see CollectRefusedJoins)
+		uint32 m_nRoom = 0;
+		// joins sent so far, so a refusal is only applied if the client hasn't joined anywhere since
+		uint32 m_nJoins = 0;
+
+		ConnectionLimits limits;
+		// went over its limits for too long and is disconnected once the current batch is done
+		bool flooding = false;
 	};
 
 	std::map< HSteamNetConnection, Client_t > m_mapClients;
 
-	void SendStringToClient(HSteamNetConnection conn, const char* str)
+	// used to give every connection a unique name
+	int nextPlayerNumber = 0;
+
+	// wakes up the network loop
+	EventSignal wakeup;
+	uint64 loopWakeups = 0;
+
+	// network thread metrics. The workers count what they send themselves.
+	MessageCounters received;
+	MessageCounters sent;
+	// messages thrown away for going over a connection's limits, and for anything else (malformed, shed from a saturated worker
+	// or sent by a connection being disconnected)
+	MessageCounters throttled;
+	MessageCounters dropped;
+	uint64 connectionsRejected = 0;
+	uint64 connectionsKicked = 0;
+	// connections to disconnect once the current batch is done
+	std::vector<HSteamNetConnection> flooders;
+	// time (us) for one pass of the network loop
+	LatencyHistogram pollTime;
+	// network thread time spent recieving and dispatching messages
+	uint64 ingestMessages = 0;
+	uint64 ingestMicros = 0;
+
+	// connection quality from the last SampleConnections
+	struct ConnectionSample
 	{
-		DataPacket data;
-		data.type = data.CONNECTION_STATUS;
-		data.msg = str;
-		m_pInterface->SendMessageToConnection(conn, &data, (uint32)sizeof(data), k_nSteamNetworkingSend_Reliable, nullptr);
+		HSteamNetConnection conn;
+		SteamNetworkingQuickConnectionStatus status;
+	};
+	LatencyHistogram connectionPing;
+	LatencyHistogram connectionQuality;
+	LatencyHistogram sendQueueBytes;
+	LatencyHistogram sendQueueTime;
+	std::vector<ConnectionSample> worstConnections;
+
+	// room workers
+	std::vector<std::unique_ptr<RoomWorker>> workers;
+
+	// jobs waiting to be handed to each worker by FlushJobs
+	std::vector<std::vector<RoomJob>> workerJobs;
+
+	// filled by the transport each time PollIncomingMessages asks for messages
+	ISteamNetworkingMessage *incomingMessages[SERVER_RECEIVE_BATCH];
+	// messages the network thread is done with, released together
+	std::vector<ISteamNetworkingMessage*> releaseMessages;
+
+	Journal journal;
+	ReplayWriter replayWriter;
+
+	// links to the other shards. A shard is only taken off the ring once its link was up, went down and couldn't be
+	// brought back within SHARD_DOWN_GRACE.
+	struct ShardLink
+	{
+		HSteamNetConnection conn = k_HSteamNetConnection_Invalid;
+		bool connected = false;
+		std::chrono::steady_clock::time_point retryAt;
+		// set while a link that was up is being probed again
+		bool lost = false;
+		std::chrono::steady_clock::time_point lostAt;
+	};
+	std::vector<ShardLink> shardLinks;
+	uint64 redirects = 0;
+	uint64 roomsTakenOver = 0;
+
+	// players waiting to be paired. The connection handle is the player.
+	Matchmaker matchmaker;
+	std::vector<Matchmaker::Match> matches;
+	// match rooms handed out on each worker
+	std::vector<uint32> matchRoomsUsed;
+
+	// joins the workers turned away, gathered each time around the loop
+	std::vector<RefusedJoin> refusedJoins;
+
+	// searches positions for clients on its own threads
+	AnalysisPool analysis;
+
+	// throughput counters at the last '/rooms' command
+	std::chrono::steady_clock::time_point statsTime;
+	uint64 statsMessages = 0;
+	uint64 statsMatches = 0;
+	uint64 statsWakeups = 0;
+
+	RoomWorker *GetRoomWorker(uint32 roomId) {
+		return workers[roomId % workers.size()].get();
 	}
 
-	void SendDataToClient(HSteamNetConnection conn, DataPacket *data) {
-		m_pInterface->SendMessageToConnection(conn, data, (uint32)sizeof(*data), k_nSteamNetworkingSend_Reliable, nullptr);
+	// queue a job for the worker that owns its room. Nothing is handed over until FlushJobs.
+	void Dispatch(RoomJob &job) {
+		workerJobs[job.roomId % workers.size()].push_back(job);
 	}
 
-	void SendCurrentDataToClient(HSteamNetConnection conn) {
-		// get the base packet
-		DataPacket data = convertBoardToPacket();
-		data.type = DataPacket::MsgType::GAME_DATA;
+	// give every worker what was queued for it
+	void FlushJobs() {
+		for (int i = 0; i < workerJobs.size(); i++)
+			workers[i]->PushBatch(workerJobs[i]);
+	}
 
-		// set scores
-		data.score1 = game.score1;
-		data.score2 = game.score2;
+	// whether any worker is too far behind to take more load
+	bool WorkersSaturated() {
+		for (int i = 0; i < workers.size(); i++)
+		{
+			if (workers[i]->pendingJobs >= WORKER_QUEUE_SATURATED)
+				return true;
+		}
+		return false;
+	}
 
-		data.piecesLeft1 = game.piecesLeft1;
-		data.piecesLeft2 = game.piecesLeft2;
+	void RecoverJournal()
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 
-		// send turn after the turn has been switched already.
-		data.currentTurn = game.currentTurn;
+		std::map<uint32, DataPacket> rooms;
+		if (Journal::Recover(journalPath, rooms))
+		{
+			for (auto &it : rooms)
+			{
+				GetRoomWorker(it.first)->Restore(it.first, it.second);
+				ReserveMatchRoom(it.first);
+			}
+
+			std::cout << "Restored " << rooms.size() << " rooms from " << journalPath << " in " <<
+				std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * 1000.0 << " ms" << std::endl;
+		}
 
-		// send to server
-		SendDataToClient(conn, &data);
+		// the journal starts over with just the restored rooms
+		if (!journal.Start(journalPath, rooms))
+			return;
+
+		for (int i = 0; i < workers.size(); i++)
+			workers[i]->journal = &journal;
 	}
 
-	void SendStringToAllClients(string str, HSteamNetConnection except = k_HSteamNetConnection_Invalid)
+	// new match rooms must not land on a restored one
+	void ReserveMatchRoom(uint32 roomId)
+	{
+		if (roomId < MATCH_ROOM_FIRST)
+			return;
+
+		uint32 worker = roomId % (uint32)workers.size();
+		uint32 used = (roomId - FirstMatchRoom(worker)) / (uint32)workers.size() + 1;
+		if (used > matchRoomsUsed[worker])
+			matchRoomsUsed[worker] = used;
+	}
+
+	// connect to the shards there is no link to yet and take over the ones that stayed away past the grace period
+	void UpdateShardLinks()
+	{
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		for (int i = 0; i < shardLinks.size(); i++)
+		{
+			ShardLink &link = shardLinks[i];
+			if (i == directory.self || !directory.GetShard(i).alive)
+				continue;
+
+			if (link.lost && now - link.lostAt >= SHARD_DOWN_GRACE)
+			{
+				if (link.conn != k_HSteamNetConnection_Invalid)
+					m_pTransport->CloseConnection(link.conn, 0, nullptr, false);
+				link.conn = k_HSteamNetConnection_Invalid;
+				link.lost = false;
+				TakeOverShard(i);
+				continue;
+			}
+
+			if (link.conn != k_HSteamNetConnection_Invalid || now < link.retryAt)
+				continue;
+
+			link.conn = m_pTransport->Connect(directory.GetShard(i).addr);
+		}
+	}
+
+	// returns false if the connection isn't a link to another shard
+	bool OnShardLinkStatusChanged(SteamNetConnectionStatusChangedCallback_t *pInfo)
+	{
+		int shard = -1;
+		for (int i = 0; i < shardLinks.size(); i++)
+		{
+			if (shardLinks[i].conn == pInfo->m_hConn)
+				shard = i;
+		}
+		if (shard < 0)
+			return false;
+
+		ShardLink &link = shardLinks[shard];
+		switch (pInfo->m_info.m_eState)
+		{
+		case k_ESteamNetworkingConnectionState_Connected:
+			if (link.lost)
+				std::cout << "Shard " << shard << " at " << directory.GetShard(shard).address << " is back after " <<
+					std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - link.lostAt).count() << " ms" << std::endl;
+			else if (logConnections)
+				std::cout << "Linked to shard " << shard << " at " << directory.GetShard(shard).address << std::endl;
+			link.connected = true;
+			link.lost = false;
+			break;
+
+		case k_ESteamNetworkingConnectionState_ClosedByPeer:
+		case k_ESteamNetworkingConnectionState_ProblemDetectedLocally:
+			m_pTransport->CloseConnection(pInfo->m_hConn, 0, nullptr, false);
+			link.conn = k_HSteamNetConnection_Invalid;
+
+			// a shard that hasn't started yet is tried again. One that was up and went away is probed the same way and
+			// loses its rooms to the others once SHARD_DOWN_GRACE passes without it coming back (see UpdateShardLinks)
+			if (link.connected && !link.lost)
+			{
+				link.lost = true;
+				link.lostAt = std::chrono::steady_clock::now();
+				std::cout << "Lost the link to shard " << shard << " at " << directory.GetShard(shard).address << ", taking over its rooms in " <<
+					SHARD_DOWN_GRACE.count() << " ms unless it comes back" << std::endl;
+			}
+			link.connected = false;
+			link.retryAt = std::chrono::steady_clock::now() + SHARD_LINK_RETRY;
+			break;
+
+		default:
+			break;
+		}
+		return true;
+	}
+
+	// take a shard that went away off the ring and bring back the rooms that are now hosted here from its journal.
+	// every other shard does the same for the rooms it gets, so each room comes back exactly once.
+	// nothing fences the shard that was taken over: if it is still running (cut off from the others for longer than
+	// SHARD_DOWN_GRACE rather than gone) it keeps serving the same rooms and they have two owners. This is only safe
+	// when shards that lose their links really have exited, so run them under something that kills a stuck process.
+	void TakeOverShard(int shard)
+	{
+		if (!directory.MarkDown(shard))
+			return;
+
+		const RoomDirectory::Shard &lost = directory.GetShard(shard);
+		std::cout << "Shard " << shard << " at " << lost.address << " went away" << std::endl;
+		if (lost.journalPath.empty())
+			return;
+
+		std::map<uint32, DataPacket> rooms;
+		Journal::Recover(lost.journalPath, rooms);
+
+		int restored = 0;
+		for (auto &it : rooms)
+		{
+			if (!directory.OwnsRoom(it.first))
+				continue;
+
+			RoomJob job;
+			job.type = RoomJob::RESTORE;
+			job.roomId = it.first;
+			job.state = std::make_shared<DataPacket>(it.second);
+			Dispatch(job);
+
+			ReserveMatchRoom(it.first);
+			restored++;
+		}
+		roomsTakenOver += restored;
+
+		std::cout << "Took over " << restored << " of its " << rooms.size() << " rooms from " << lost.journalPath << std::endl;
+	}
+
+	// the room is hosted by another shard, send the client there
+	void RedirectClient(HSteamNetConnection conn, const RoomPacket &room)
+	{
+		RedirectPacket redirect;
+		redirect.roomId = room.roomId;
+		redirect.spectate = room.spectate;
+		redirect.turn = room.turn;
+		strncpy_s(redirect.address, sizeof(redirect.address), directory.GetShard(directory.Owner(room.roomId)).address.c_str(), _TRUNCATE);
+
+		m_pTransport->SendMessageToConnection(conn, &redirect, (uint32)sizeof(redirect), k_nSteamNetworkingSend_Reliable);
+		sent.record(redirect.type, sizeof(redirect));
+		redirects++;
+	}
+
+	void SendStringToClient(HSteamNetConnection conn, const char* str)
+	{
+		DataPacket data;
+		data.type = data.CONNECTION_STATUS;
+		strncpy_s(data.msg, sizeof(data.msg), str, _TRUNCATE);
+		m_pTransport->SendMessageToConnection(conn, &data, (uint32)sizeof(data), k_nSteamNetworkingSend_Reliable);
+		sent.record(data.type, sizeof(data));
+	}
+
+	void SendStringToAllClients(const std::string &str, HSteamNetConnection except = k_HSteamNetConnection_Invalid)
 	{
 		for (auto &c : m_mapClients)
 		{
@@ -148,82 +599,679 @@ private:
 		}
 	}
 
-	void SendDataToAllClients(DataPacket *data, HSteamNetConnection except = k_HSteamNetConnection_Invalid)
+	// put a client into a room, leaving the one it was in
+	void JoinRoom(HSteamNetConnection conn, Client_t &client, uint32 roomId, bool spectate, int turn = 0)
 	{
-		for (auto &c : m_mapClients)
+		LeaveRoom(conn, client);
+
+		RoomJob job;
+		job.type = RoomJob::JOIN;
+		job.roomId = roomId;
+		job.conn = conn;
+		job.nick = client.m_sNick;
+		job.spectate = spectate;
+		job.turn = turn;
+		job.joinId = ++client.m_nJoins;
+		Dispatch(job);
+
+		client.m_nRoom = roomId;
+	}
+
+	// a client shows its move before the server answers, so a move dropped by the rate limit still needs an answer.
+	// only its number goes to the room, the message itself stays here. Flooders stop getting answers with everything else.
+	void AnswerThrottledMove(HSteamNetConnection conn, Client_t &client, ISteamNetworkingMessage *pIncomingMsg)
+	{
+		int type = *(int*)pIncomingMsg->m_pData;
+		RoomJob job;
+		if (type == DataPacket::MsgType::GAME_DATA && pIncomingMsg->m_cbSize >= (int)sizeof(DataPacket))
+			job.action = ((DataPacket*)pIncomingMsg->m_pData)->action;
+		else if (type == DataPacket::MsgType::GAME_ACTION && pIncomingMsg->m_cbSize >= (int)offsetof(DeltaPacket, changes))
+			job.action = ((DeltaPacket*)pIncomingMsg->m_pData)->action;
+		else
+			return;
+
+		job.type = RoomJob::THROTTLED;
+		job.roomId = client.m_nRoom;
+		job.conn = conn;
+		Dispatch(job);
+	}
+
+	// clients a worker turned away are back in the lobby
+	void CollectRefusedJoins()
+	{
+		refusedJoins.clear();
+		for (int i = 0; i < workers.size(); i++)
+			workers[i]->TakeRefusedJoins(refusedJoins);
+
+		for (int i = 0; i < refusedJoins.size(); i++)
 		{
-			if (c.first != except)
-				SendDataToClient(c.first, data);
+			auto itClient = m_mapClients.find(refusedJoins[i].conn);
+			if (itClient != m_mapClients.end() && itClient->second.m_nJoins == refusedJoins[i].joinId)
+				itClient->second.m_nRoom = 0;
 		}
 	}
 
-	void SendCurrentDataToAllClients(HSteamNetConnection except = k_HSteamNetConnection_Invalid) {
-		for (auto &c : m_mapClients)
+	// players can go back to a match room that was handed out here (after a reconnect, a redirect or a restore) but
+	// not pick one before the matchmaker does, or the pair it is meant for would find them sitting in it
+	bool MatchRoomIssued(uint32 roomId)
+	{
+		if (roomId < MATCH_ROOM_FIRST)
+			return true;
+
+		uint32 worker = roomId % (uint32)workers.size();
+		return (roomId - FirstMatchRoom(worker)) / (uint32)workers.size() < matchRoomsUsed[worker];
+	}
+
+	// the first match room id that belongs to a worker
+	uint32 FirstMatchRoom(uint32 worker)
+	{
+		uint32 numWorkers = (uint32)workers.size();
+		return MATCH_ROOM_FIRST + (worker + numWorkers - MATCH_ROOM_FIRST % numWorkers) % numWorkers;
+	}
+
+	// put every pair the matchmaker has made into a new room on the worker with the fewest rooms
+	void PlaceMatches()
+	{
+		matches.clear();
+		if (matchmaker.Update(std::chrono::steady_clock::now(), matches) == 0)
+			return;
+
+		// rooms placed here don't show up in the worker counts until the workers get to them
+		std::vector<int> load(workers.size());
+		for (int i = 0; i < workers.size(); i++)
+			load[i] = workers[i]->roomCount;
+
+		char temp[256];
+		for (int i = 0; i < matches.size(); i++)
 		{
-			if (c.first != except)
-				SendCurrentDataToClient(c.first);
+			Matchmaker::Match &match = matches[i];
+
+			// players are taken out of the queue when they leave, so both are still here
+			auto itClient1 = m_mapClients.find(match.player1);
+			auto itClient2 = m_mapClients.find(match.player2);
+			assert(itClient1 != m_mapClients.end() && itClient2 != m_mapClients.end());
+
+			int worker = 0;
+			for (int w = 1; w < load.size(); w++)
+			{
+				if (load[w] < load[worker])
+					worker = w;
+			}
+			load[worker]++;
+
+			// with other shards only rooms hosted here will do, or players looking for the room later are sent elsewhere
+			uint32 roomId;
+			do
+				roomId = FirstMatchRoom(worker) + matchRoomsUsed[worker]++ * (uint32)workers.size();
+			while (!directory.OwnsRoom(roomId));
+			JoinRoom(itClient1->first, itClient1->second, roomId, false);
+			JoinRoom(itClient2->first, itClient2->second, roomId, false);
+
+			sprintf_s(temp, "Matched with %s (rating %d) in room %u", itClient2->second.m_sNick.c_str(), match.rating2, roomId);
+			SendStringToClient(itClient1->first, temp);
+			sprintf_s(temp, "Matched with %s (rating %d) in room %u", itClient1->second.m_sNick.c_str(), match.rating1, roomId);
+			SendStringToClient(itClient2->first, temp);
+
+			if (logConnections)
+				std::cout << itClient1->second.m_sNick << " (" << match.rating1 << ") and " << itClient2->second.m_sNick << " (" << match.rating2 << ") matched into room " << roomId << std::endl;
 		}
 	}
 
-	void PollIncomingMessages()
+	// message is what the rest of the room is told (optional)
+	void LeaveRoom(HSteamNetConnection conn, Client_t &client, const char *message = "")
 	{
-		char temp[1024];
+		if (client.m_nRoom == 0)
+			return;
+
+		RoomJob job;
+		job.type = RoomJob::LEAVE;
+		job.roomId = client.m_nRoom;
+		job.conn = conn;
+		job.message = message;
+		Dispatch(job);
+
+		client.m_nRoom = 0;
+	}
+
+	// returns the number of messages recieved.
+	// messages are taken from the transport in batches and read in place. Room messages go to their worker
+	// without being copied and the worker releases them, the rest are released here once the batch is done.
+	int PollIncomingMessages()
+	{
+		int numRecieved = 0;
 
 		while (!g_bQuit)
 		{
-			ISteamNetworkingMessage *pIncomingMsg = nullptr;
-			int numMsgs = m_pInterface->ReceiveMessagesOnPollGroup(m_hPollGroup, &pIncomingMsg, 1);
+			int numMsgs = m_pTransport->ReceiveMessages(incomingMessages, SERVER_RECEIVE_BATCH);
 			if (numMsgs == 0)
 				break;
 			if (numMsgs < 0)
+			{
 				std::cout << "Error checking for messages" << std::endl;
-			assert(numMsgs == 1 && pIncomingMsg);
-			auto itClient = m_mapClients.find(pIncomingMsg->m_conn);
-			assert(itClient != m_mapClients.end());
-
-			// Parse Data Recieve From Clients
-			DataPacket *data = (DataPacket*)pIncomingMsg->m_pData;
-			switch (data->type) {
-				// connection info
-				case DataPacket::MsgType::CONNECTION_STATUS: {
-					std::cout << "recieved connection data" << std::endl;
-					break;
+				break;
+			}
+			numRecieved += numMsgs;
+
+			// the whole batch is charged to the rate limits at one time
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+			for (int i = 0; i < numMsgs; i++)
+			{
+				ISteamNetworkingMessage *pIncomingMsg = incomingMessages[i];
+				auto itClient = m_mapClients.find(pIncomingMsg->m_conn);
+
+				// links to other shards are only there to notice them going away
+				if (itClient == m_mapClients.end())
+				{
+					releaseMessages.push_back(pIncomingMsg);
+					continue;
+				}
+
+				if (pIncomingMsg->m_cbSize < (int)sizeof(DataPacket::MsgType))
+				{
+					received.record(-1, pIncomingMsg->m_cbSize);
+					dropped.record(-1, pIncomingMsg->m_cbSize);
+					releaseMessages.push_back(pIncomingMsg);
+					continue;
 				}
-				// parse the outline piece recieved
-				case DataPacket::MsgType::GAME_SELECTION: {
-					// send the selected piece as opponent to all people except the one who sent it
-					SendDataToAllClients(data, pIncomingMsg->m_conn);
-					break;
+				int type = *(int*)pIncomingMsg->m_pData;
+				received.record(type, pIncomingMsg->m_cbSize);
+
+				// throttled messages never reach a worker, so a flood only costs the network thread
+				Client_t &client = itClient->second;
+				if (client.flooding)
+				{
+					dropped.record(type, pIncomingMsg->m_cbSize);
+					releaseMessages.push_back(pIncomingMsg);
+					continue;
+				}
+				if (rateLimit && !client.limits.forType(type).take(now))
+				{
+					throttled.record(type, pIncomingMsg->m_cbSize);
+					if (!client.limits.flood.take(now))
+					{
+						client.flooding = true;
+						flooders.push_back(itClient->first);
+					}
+					else if (client.m_nRoom != 0)
+						AnswerThrottledMove(itClient->first, client, pIncomingMsg);
+					releaseMessages.push_back(pIncomingMsg);
+					continue;
 				}
-				// parse data recieved from clients (sorry it is not secure)
-				case DataPacket::MsgType::GAME_DATA: {
-					// if the current turn is set to the player that made the move
-					std::cout << "Recieved game data from client: " + m_mapClients[pIncomingMsg->m_conn].m_sNick << std::endl;
 
-					game.board.setBoardToData(data);
+				// outline pieces are the first thing to go when a worker can't keep up, they are stale anyway
+				if (type == DataPacket::MsgType::GAME_SELECTION && client.m_nRoom != 0 && GetRoomWorker(client.m_nRoom)->pendingJobs >= WORKER_QUEUE_SATURATED)
+				{
+					dropped.record(type, pIncomingMsg->m_cbSize);
+					releaseMessages.push_back(pIncomingMsg);
+					continue;
+				}
 
-					game.setScores((int)data->score1, (int)data->score2);
-					game.setPiecesLeft((int)data->piecesLeft1, (int)data->piecesLeft2);
+				// the lobby only handles joining rooms and matchmaking, everything else belongs to the client's room
+				DataPacket *data = (DataPacket*)pIncomingMsg->m_pData;
+				if (data->type == DataPacket::MsgType::ROOM_JOIN)
+				{
+					RoomPacket *room = (RoomPacket*)pIncomingMsg->m_pData;
+					if (pIncomingMsg->m_cbSize >= (int)sizeof(RoomPacket) && room->roomId != 0 && directory.OwnsRoom(room->roomId) &&
+						!MatchRoomIssued(room->roomId))
+					{
+						std::string refusal = "Rooms from " + std::to_string(MATCH_ROOM_FIRST) + " up are only given out by matchmaking";
+						SendStringToClient(itClient->first, refusal.c_str());
+					}
+					else if (pIncomingMsg->m_cbSize >= (int)sizeof(RoomPacket) && room->roomId != 0)
+					{
+						matchmaker.Cancel(itClient->first);
+						if (directory.OwnsRoom(room->roomId))
+							JoinRoom(itClient->first, itClient->second, room->roomId, room->spectate, room->turn);
+						else
+						{
+							LeaveRoom(itClient->first, itClient->second);
+							RedirectClient(itClient->first, *room);
+						}
+					}
 
-					if (data->currentTurn != 0) {
-						game.setTurnToInt(data->currentTurn);
+					releaseMessages.push_back(pIncomingMsg);
+				}
+				else if (data->type == DataPacket::MsgType::MATCH_REQUEST)
+				{
+					// players wait for their match in the lobby
+					MatchPacket *request = (MatchPacket*)pIncomingMsg->m_pData;
+					if (pIncomingMsg->m_cbSize >= (int)sizeof(MatchPacket))
+					{
+						LeaveRoom(itClient->first, itClient->second);
+						if (matchmaker.Enqueue(itClient->first, request->rating, now))
+							SendStringToClient(itClient->first, "Looking for a match");
 					}
 
-					// send the updated board to all the users
-					SendCurrentDataToAllClients();
-					break;
+					releaseMessages.push_back(pIncomingMsg);
 				}
-				// Recieved unknown data type
-				default: {
-					// std::cout << "Recieved data of no known type" << std::endl;
-					break;
+				else if (data->type == DataPacket::MsgType::ANALYSIS_REQUEST)
+				{
+					// searched on the analysis threads, never in a room
+					if (pIncomingMsg->m_cbSize >= (int)sizeof(AnalysisRequestPacket))
+						analysis.Submit(itClient->first, *(AnalysisRequestPacket*)pIncomingMsg->m_pData);
+
+					releaseMessages.push_back(pIncomingMsg);
+				}
+				else if (itClient->second.m_nRoom != 0)
+				{
+					// the worker releases the message
+					RoomJob job;
+					job.type = RoomJob::MESSAGE;
+					job.roomId = itClient->second.m_nRoom;
+					job.conn = pIncomingMsg->m_conn;
+					job.msg = pIncomingMsg;
+					Dispatch(job);
+				}
+				else
+				{
+					// We don't need this anymore.
+					releaseMessages.push_back(pIncomingMsg);
 				}
 			}
-			// std::cout << "Recieved game data from client: " << std::endl;
 
-			// We don't need this anymore.
-			pIncomingMsg->Release();
+			DisconnectFlooders();
+
+			// each worker is woken once per batch
+			FlushJobs();
+
+			for (int i = 0; i < releaseMessages.size(); i++)
+				releaseMessages[i]->Release();
+			releaseMessages.clear();
+
+			// the transport had nothing more
+			if (numMsgs < SERVER_RECEIVE_BATCH)
+				break;
+		}
+
+		return numRecieved;
+	}
+
+	// close every connection that kept going over its limits
+	void DisconnectFlooders()
+	{
+		for (int i = 0; i < flooders.size(); i++)
+		{
+			auto itClient = m_mapClients.find(flooders[i]);
+			if (itClient == m_mapClients.end())
+				continue;
+
+			std::cout << itClient->second.m_sNick << " was disconnected for flooding" << std::endl;
+
+			LeaveRoom(itClient->first, itClient->second, (itClient->second.m_sNick + " was disconnected").c_str());
+			matchmaker.Cancel(itClient->first);
+			analysis.CancelConnection(itClient->first);
+			m_pTransport->CloseConnection(itClient->first, 0, "Flooding", false);
+			m_mapClients.erase(itClient);
+			connectionsKicked++;
+		}
+		flooders.clear();
+	}
+
+	// rooms and throughput since the last time this was called
+	void PrintRoomStats()
+	{
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		double seconds = std::chrono::duration<double>(now - statsTime).count();
+		if (seconds <= 0)
+			seconds = 1;
+
+		uint64 messages = 0;
+		uint64 matches = 0;
+		uint64 rejected = 0;
+		uint64 movesThrottled = 0;
+		uint64 flagFalls = 0;
+		uint64 lockstepActions = 0;
+		uint64 desyncs = 0;
+		uint64 wakeups = loopWakeups;
+		int rooms = 0;
+		LatencyHistogram relayLatency;
+		LatencyHistogram selectionRelayLatency;
+		for (int i = 0; i < workers.size(); i++)
+		{
+			messages += workers[i]->messagesProcessed;
+			matches += workers[i]->matchesFinished;
+			rejected += workers[i]->movesRejected;
+			movesThrottled += workers[i]->movesThrottled;
+			flagFalls += workers[i]->flagFalls;
+			lockstepActions += workers[i]->lockstepActions;
+			desyncs += workers[i]->desyncs;
+			wakeups += workers[i]->wakeups;
+			rooms += workers[i]->roomCount;
+			relayLatency.merge(workers[i]->relayLatency);
+			selectionRelayLatency.merge(workers[i]->selectionRelayLatency);
+
+			std::cout << "Worker " << i << ": " << workers[i]->roomCount << " rooms, " << workers[i]->messagesProcessed << " messages, " << workers[i]->matchesFinished << " matches finished" << std::endl;
+		}
+
+		std::cout << m_mapClients.size() << " connections in " << rooms << " rooms. " <<
+			(messages - statsMessages) / seconds << " messages/sec (" << (messages - statsMessages) / seconds / workers.size() << " per worker), " <<
+			(matches - statsMatches) / seconds << " matches/sec over the last " << seconds << " seconds" << std::endl;
+
+		if (rejected > 0)
+			std::cout << rejected << " illegal moves rejected" << std::endl;
+		if (movesThrottled > 0)
+			std::cout << movesThrottled << " moves dropped by the rate limit answered with the room's state" << std::endl;
+
+		if (throttled.totalMessages() > 0 || dropped.totalMessages() > 0 || connectionsRejected > 0)
+			std::cout << throttled.totalMessages() << " messages throttled, " << dropped.totalMessages() << " dropped, " <<
+				connectionsRejected << " connections turned away, " << connectionsKicked << " disconnected for flooding" << std::endl;
+
+		if (clockTime.count() > 0)
+			std::cout << flagFalls << " matches lost on time" << std::endl;
+
+		if (lockstep > 0)
+			std::cout << lockstepActions << " lockstep actions passed on, " << desyncs << " players resynced after a checksum mismatch" << std::endl;
+
+		if (directory.Enabled())
+			std::cout << "Shard " << directory.self << " of " << directory.NumShards() << ": " << redirects << " clients sent to other shards, " <<
+				roomsTakenOver << " rooms taken over from shards that went away" << std::endl;
+
+		if (matchmaker.matchesMade > 0 || matchmaker.Waiting() > 0)
+			std::cout << matchmaker.Waiting() << " players waiting for a match, " << matchmaker.matchesMade << " matches made. Wait (ms): p50 " <<
+				matchmaker.waitTime.percentile(0.5) << ", p99 " << matchmaker.waitTime.percentile(0.99) << ", rating gap p50 " <<
+				matchmaker.ratingGap.percentile(0.5) << ", p99 " << matchmaker.ratingGap.percentile(0.99) << std::endl;
+
+		if (analysis.requests > 0)
+			std::cout << "Analysis: " << analysis.requests << " requests, " << analysis.cacheHits << " from the cache, " << analysis.searches << " searched (" <<
+				analysis.nodesSearched << " nodes), " << analysis.rejected << " turned away, " << analysis.cancelled << " cancelled, " << analysis.Waiting() <<
+				" waiting. Wait (us): p99 " << analysis.waitTime.percentile(0.99) << ", search (us): p50 " << analysis.searchTime.percentile(0.5) <<
+				", p99 " << analysis.searchTime.percentile(0.99) << std::endl;
+
+		if (!replayDirectory.empty())
+			std::cout << replayWriter.replaysWritten << " replays saved to " << replayDirectory << (replayWriter.replaysFailed > 0 ?
+				", " + std::to_string(replayWriter.replaysFailed) + " could not be written" : std::string()) << std::endl;
+
+		// idle servers should barely wake up
+		std::cout << (wakeups - statsWakeups) / seconds << " thread wakeups/sec" << std::endl;
+
+		std::cout << "Move relay latency since start (us): p50 " << relayLatency.percentile(0.5) << ", p99 " << relayLatency.percentile(0.99) <<
+			", max " << relayLatency.max << " over " << relayLatency.count << " relays" << std::endl;
+		if (selectionRelayLatency.count > 0)
+			std::cout << "Selection relay latency since start (us): p50 " << selectionRelayLatency.percentile(0.5) << ", p99 " <<
+				selectionRelayLatency.percentile(0.99) << ", max " << selectionRelayLatency.max << " over " << selectionRelayLatency.count << " relays" << std::endl;
+
+		statsTime = now;
+		statsMessages = messages;
+		statsMatches = matches;
+		statsWakeups = wakeups;
+	}
+
+	// ask the transport how every connection is doing
+	void SampleConnections()
+	{
+		connectionPing.reset();
+		connectionQuality.reset();
+		sendQueueBytes.reset();
+		sendQueueTime.reset();
+		worstConnections.clear();
+
+		for (auto &c : m_mapClients)
+		{
+			ConnectionSample sample;
+			sample.conn = c.first;
+			if (!m_pTransport->GetQuickConnectionStatus(c.first, &sample.status))
+				continue;
+
+			connectionPing.record(sample.status.m_nPing);
+			connectionQuality.record((int64)(sample.status.m_flConnectionQualityLocal * 100.0f));
+			sendQueueBytes.record((int64)sample.status.m_cbPendingReliable + sample.status.m_cbPendingUnreliable + sample.status.m_cbSentUnackedReliable);
+			sendQueueTime.record(sample.status.m_usecQueueTime);
+
+			// keep the few with the worst ping
+			worstConnections.push_back(sample);
+			std::sort(worstConnections.begin(), worstConnections.end(), [](const ConnectionSample &a, const ConnectionSample &b) { return a.status.m_nPing > b.status.m_nPing; });
+			if (worstConnections.size() > STATS_WORST_CONNECTIONS)
+				worstConnections.pop_back();
+		}
+	}
+
+	static void PrintMessageCounters(const char *direction, const MessageCounters &counters)
+	{
+		std::cout << direction << ": " << counters.totalMessages() << " messages, " << counters.totalBytes() << " bytes";
+		for (int i = 0; i < MessageCounters::NUM_TYPES; i++)
+		{
+			if (counters.messages[i] > 0)
+				std::cout << ", " << MsgTypeName(i) << " " << counters.messages[i] << " (" << counters.bytes[i] << " bytes)";
 		}
+		std::cout << std::endl;
+	}
+
+	// everything the server measures, for the console
+	void PrintStats()
+	{
+		SampleConnections();
+
+		MessageCounters allSent;
+		allSent.merge(sent);
+		allSent.merge(analysis.sent);
+		for (int i = 0; i < workers.size(); i++)
+			allSent.merge(workers[i]->sent);
+
+		PrintMessageCounters("In", received);
+		PrintMessageCounters("Out", allSent);
+		PrintMessageCounters("Throttled", throttled);
+		PrintMessageCounters("Dropped", dropped);
+
+		// what the workers' send queues saved
+		uint64 queued = 0, wireMessages = 0, flushes = 0, coalesced = 0, superseded = 0, matches = 0;
+		for (int i = 0; i < workers.size(); i++)
+		{
+			queued += workers[i]->outbox.queued;
+			wireMessages += workers[i]->outbox.wireMessages;
+			flushes += workers[i]->outbox.flushes;
+			coalesced += workers[i]->outbox.coalesced;
+			superseded += workers[i]->outbox.superseded;
+			matches += workers[i]->matchesFinished;
+		}
+		BufferPool &pool = BufferPool::Get();
+		std::cout << "Sends: " << queued << " messages queued, " << wireMessages << " sent in " << flushes << " transport calls (" << coalesced <<
+			" packed into batches, " << superseded << " outline pieces replaced). Buffers: " << pool.allocations << " allocated, " << pool.reuses << " reused" << std::endl;
+		if (matches > 0)
+			std::cout << "Per finished match: " << (double)flushes / matches << " transport calls, " << (double)wireMessages / matches << " messages, " <<
+				(double)pool.allocations / matches << " buffer allocations" << std::endl;
+
+		std::cout << "Network loop (us): p50 " << pollTime.percentile(0.5) << ", p99 " << pollTime.percentile(0.99) << ", max " << pollTime.max << std::endl;
+
+		for (int i = 0; i < workers.size(); i++)
+		{
+			RoomWorker &worker = *workers[i];
+			std::cout << "Worker " << i << " (us): loop p50 " << worker.loopTime.percentile(0.5) << " p99 " << worker.loopTime.percentile(0.99) <<
+				", per message p99 " << worker.roomTime.percentile(0.99) << ", validate p99 " << worker.validateTime.percentile(0.99) <<
+				", fan-out p99 " << worker.fanoutTime.percentile(0.99) << ", flush p99 " << worker.flushTime.percentile(0.99) << ", queue depth p99 " << worker.queueDepth.percentile(0.99) <<
+				" max " << worker.queueDepth.max << ", busy " << worker.busyMicros / 1000 << " ms" << std::endl;
+
+			std::vector<RoomLoad> busiest = worker.BusiestRooms();
+			for (int j = 0; j < busiest.size(); j++)
+				std::cout << "  room " << busiest[j].roomId << ": " << busiest[j].members << " members, " << busiest[j].messages << " messages, " << busiest[j].busyMicros << " us" << std::endl;
+		}
+
+		std::cout << m_mapClients.size() << " connections. Ping (ms): p50 " << connectionPing.percentile(0.5) << ", p99 " << connectionPing.percentile(0.99) <<
+			", max " << connectionPing.max << ". Send queue (bytes): p50 " << sendQueueBytes.percentile(0.5) << ", p99 " << sendQueueBytes.percentile(0.99) <<
+			", max " << sendQueueBytes.max << ". Queue time (us): p99 " << sendQueueTime.percentile(0.99) << std::endl;
+
+		for (int i = 0; i < worstConnections.size(); i++)
+		{
+			const SteamNetworkingQuickConnectionStatus &status = worstConnections[i].status;
+			std::cout << "  " << m_mapClients[worstConnections[i].conn].m_sNick << ": ping " << status.m_nPing << " ms, quality " <<
+				status.m_flConnectionQualityLocal * 100.0f << "% local " << status.m_flConnectionQualityRemote * 100.0f << "% remote, " <<
+				status.m_cbPendingReliable + status.m_cbPendingUnreliable << " bytes pending" << std::endl;
+		}
+	}
+
+	static void WriteMessageCounters(MetricsWriter &metrics, const char *direction, const MessageCounters &counters)
+	{
+		std::string messages = std::string("fourconnect_messages_") + direction + "_total";
+		std::string bytes = std::string("fourconnect_bytes_") + direction + "_total";
+
+		metrics.family(messages, "counter", "Messages by type.");
+		for (int i = 0; i < MessageCounters::NUM_TYPES; i++)
+		{
+			if (counters.messages[i] > 0)
+				metrics.sample(messages, std::string("type=\"") + MsgTypeName(i) + "\"", (double)counters.messages[i]);
+		}
+
+		metrics.family(bytes, "counter", "Message bytes by type.");
+		for (int i = 0; i < MessageCounters::NUM_TYPES; i++)
+		{
+			if (counters.bytes[i] > 0)
+				metrics.sample(bytes, std::string("type=\"") + MsgTypeName(i) + "\"", (double)counters.bytes[i]);
+		}
+	}
+
+	// write everything to metricsPath. It is written beside it and swapped in so readers never see half a file.
+	void WriteMetrics()
+	{
+		MetricsWriter metrics;
+
+		MessageCounters allSent;
+		allSent.merge(sent);
+		allSent.merge(analysis.sent);
+		for (int i = 0; i < workers.size(); i++)
+			allSent.merge(workers[i]->sent);
+
+		WriteMessageCounters(metrics, "received", received);
+		WriteMessageCounters(metrics, "sent", allSent);
+		WriteMessageCounters(metrics, "throttled", throttled);
+		WriteMessageCounters(metrics, "dropped", dropped);
+
+		metrics.family("fourconnect_connections_rejected_total", "counter", "Connections turned away because the server was full or its workers were saturated.");
+		metrics.sample("fourconnect_connections_rejected_total", "", (double)connectionsRejected);
+		metrics.family("fourconnect_connections_kicked_total", "counter", "Connections closed for flooding.");
+		metrics.sample("fourconnect_connections_kicked_total", "", (double)connectionsKicked);
+
+		metrics.family("fourconnect_connections", "gauge", "Open connections.");
+		metrics.sample("fourconnect_connections", "", (double)m_mapClients.size());
+
+		metrics.family("fourconnect_network_loop_microseconds", "summary", "Time for one pass of the network loop.");
+		metrics.summary("fourconnect_network_loop_microseconds", "", pollTime);
+
+		// per worker
+		struct WorkerHistogram
+		{
+			const char *name;
+			const char *help;
+			LatencyHistogram RoomWorker::*histogram;
+		};
+		static const WorkerHistogram histograms[] = {
+			{ "fourconnect_worker_loop_microseconds", "Time to work through everything queued at one wakeup.", &RoomWorker::loopTime },
+			{ "fourconnect_worker_queue_depth", "Jobs queued for a worker at one wakeup.", &RoomWorker::queueDepth },
+			{ "fourconnect_room_message_microseconds", "Time to handle one message for a room.", &RoomWorker::roomTime },
+			{ "fourconnect_validate_microseconds", "Time to check a move against the rules.", &RoomWorker::validateTime },
+			{ "fourconnect_fanout_microseconds", "Time to queue one message for every member of a room.", &RoomWorker::fanoutTime },
+			{ "fourconnect_flush_microseconds", "Time to hand everything sent in one wakeup to the transport.", &RoomWorker::flushTime },
+			{ "fourconnect_relay_latency_microseconds", "Time from a move arriving to it being sent on.", &RoomWorker::relayLatency },
+			{ "fourconnect_selection_relay_latency_microseconds", "Time from an outline piece update arriving to it being sent on.", &RoomWorker::selectionRelayLatency },
+		};
+		for (const WorkerHistogram &h : histograms)
+		{
+			metrics.family(h.name, "summary", h.help);
+			for (int i = 0; i < workers.size(); i++)
+				metrics.summary(h.name, "worker=\"" + std::to_string(i) + "\"", (*workers[i]).*h.histogram);
+		}
+
+		metrics.family("fourconnect_worker_busy_microseconds_total", "counter", "Time a worker spent working.");
+		for (int i = 0; i < workers.size(); i++)
+			metrics.sample("fourconnect_worker_busy_microseconds_total", "worker=\"" + std::to_string(i) + "\"", (double)workers[i]->busyMicros);
+
+		metrics.family("fourconnect_send_calls_total", "counter", "Times a worker handed its queued messages to the transport.");
+		for (int i = 0; i < workers.size(); i++)
+			metrics.sample("fourconnect_send_calls_total", "worker=\"" + std::to_string(i) + "\"", (double)workers[i]->outbox.flushes);
+
+		metrics.family("fourconnect_messages_coalesced_total", "counter", "Messages that went out packed into a batch with others.");
+		for (int i = 0; i < workers.size(); i++)
+			metrics.sample("fourconnect_messages_coalesced_total", "worker=\"" + std::to_string(i) + "\"", (double)workers[i]->outbox.coalesced);
+
+		metrics.family("fourconnect_buffer_allocations_total", "counter", "Message buffers allocated instead of taken from the pool.");
+		metrics.sample("fourconnect_buffer_allocations_total", "", (double)BufferPool::Get().allocations);
+		metrics.family("fourconnect_buffer_reuses_total", "counter", "Message buffers taken from the pool.");
+		metrics.sample("fourconnect_buffer_reuses_total", "", (double)BufferPool::Get().reuses);
+
+		metrics.family("fourconnect_rooms", "gauge", "Rooms owned by a worker.");
+		for (int i = 0; i < workers.size(); i++)
+			metrics.sample("fourconnect_rooms", "worker=\"" + std::to_string(i) + "\"", (double)workers[i]->roomCount);
+
+		metrics.family("fourconnect_matches_finished_total", "counter", "Matches won.");
+		for (int i = 0; i < workers.size(); i++)
+			metrics.sample("fourconnect_matches_finished_total", "worker=\"" + std::to_string(i) + "\"", (double)workers[i]->matchesFinished);
+
+		metrics.family("fourconnect_flag_falls_total", "counter", "Matches lost by a player running out of time.");
+		for (int i = 0; i < workers.size(); i++)
+			metrics.sample("fourconnect_flag_falls_total", "worker=\"" + std::to_string(i) + "\"", (double)workers[i]->flagFalls);
+
+		metrics.family("fourconnect_lockstep_actions_total", "counter", "Moves passed on as they were sent in lockstep rooms.");
+		for (int i = 0; i < workers.size(); i++)
+			metrics.sample("fourconnect_lockstep_actions_total", "worker=\"" + std::to_string(i) + "\"", (double)workers[i]->lockstepActions);
+		metrics.family("fourconnect_lockstep_desyncs_total", "counter", "Players resynced because their checksum did not match the server's.");
+		for (int i = 0; i < workers.size(); i++)
+			metrics.sample("fourconnect_lockstep_desyncs_total", "worker=\"" + std::to_string(i) + "\"", (double)workers[i]->desyncs);
+
+		if (directory.Enabled())
+		{
+			metrics.family("fourconnect_shard_redirects_total", "counter", "Clients sent to the shard hosting their room.");
+			metrics.sample("fourconnect_shard_redirects_total", "", (double)redirects);
+			metrics.family("fourconnect_shard_rooms_taken_over_total", "counter", "Rooms brought back from the journal of a shard that went away.");
+			metrics.sample("fourconnect_shard_rooms_taken_over_total", "", (double)roomsTakenOver);
+		}
+
+		metrics.family("fourconnect_matchmaking_waiting", "gauge", "Players waiting for a match.");
+		metrics.sample("fourconnect_matchmaking_waiting", "", (double)matchmaker.Waiting());
+		metrics.family("fourconnect_matchmaking_matches_total", "counter", "Pairs made by the matchmaker.");
+		metrics.sample("fourconnect_matchmaking_matches_total", "", (double)matchmaker.matchesMade);
+		metrics.family("fourconnect_matchmaking_wait_milliseconds", "summary", "Time a player waited to be paired.");
+		metrics.summary("fourconnect_matchmaking_wait_milliseconds", "", matchmaker.waitTime);
+
+		metrics.family("fourconnect_analysis_requests_total", "counter", "Positions clients asked to have analysed.");
+		metrics.sample("fourconnect_analysis_requests_total", "", (double)analysis.requests);
+		metrics.family("fourconnect_analysis_cache_hits_total", "counter", "Analysis requests answered from the cache.");
+		metrics.sample("fourconnect_analysis_cache_hits_total", "", (double)analysis.cacheHits);
+		metrics.family("fourconnect_analysis_searches_total", "counter", "Analysis requests searched.");
+		metrics.sample("fourconnect_analysis_searches_total", "", (double)analysis.searches);
+		metrics.family("fourconnect_analysis_nodes_total", "counter", "Positions visited by analysis searches.");
+		metrics.sample("fourconnect_analysis_nodes_total", "", (double)analysis.nodesSearched);
+		metrics.family("fourconnect_analysis_rejected_total", "counter", "Analysis requests turned away because the queues were full.");
+		metrics.sample("fourconnect_analysis_rejected_total", "", (double)analysis.rejected);
+		metrics.family("fourconnect_analysis_cancelled_total", "counter", "Analysis requests cancelled by the client or its disconnect.");
+		metrics.sample("fourconnect_analysis_cancelled_total", "", (double)analysis.cancelled);
+		metrics.family("fourconnect_analysis_waiting", "gauge", "Analysis requests waiting for a thread.");
+		metrics.sample("fourconnect_analysis_waiting", "", (double)analysis.Waiting());
+		metrics.family("fourconnect_analysis_wait_microseconds", "summary", "Time an analysis request waited for a thread.");
+		metrics.summary("fourconnect_analysis_wait_microseconds", "", analysis.waitTime);
+		metrics.family("fourconnect_analysis_search_microseconds", "summary", "Time spent searching one analysis request.");
+		metrics.summary("fourconnect_analysis_search_microseconds", "", analysis.searchTime);
+
+		metrics.family("fourconnect_room_busy_microseconds", "gauge", "Time spent on each of the busiest rooms over the last second.");
+		for (int i = 0; i < workers.size(); i++)
+		{
+			std::vector<RoomLoad> busiest = workers[i]->BusiestRooms();
+			for (int j = 0; j < busiest.size(); j++)
+				metrics.sample("fourconnect_room_busy_microseconds", "room=\"" + std::to_string(busiest[j].roomId) + "\"", (double)busiest[j].busyMicros);
+		}
+
+		// connections
+		metrics.family("fourconnect_connection_ping_milliseconds", "summary", "Round trip time of every connection.");
+		metrics.summary("fourconnect_connection_ping_milliseconds", "", connectionPing);
+		metrics.family("fourconnect_connection_quality_percent", "summary", "Packets delivered in order, measured locally.");
+		metrics.summary("fourconnect_connection_quality_percent", "", connectionQuality);
+		metrics.family("fourconnect_send_queue_bytes", "summary", "Bytes waiting to be sent or acknowledged per connection.");
+		metrics.summary("fourconnect_send_queue_bytes", "", sendQueueBytes);
+		metrics.family("fourconnect_send_queue_microseconds", "summary", "How long a new message would wait before being sent.");
+		metrics.summary("fourconnect_send_queue_microseconds", "", sendQueueTime);
+
+		std::string tempPath = metricsPath + ".tmp";
+		FILE *file = nullptr;
+		if (fopen_s(&file, tempPath.c_str(), "wb") != 0 || file == nullptr)
+		{
+			std::cout << "Can't write metrics to " << tempPath << std::endl;
+			return;
+		}
+
+		std::string text = metrics.str();
+		fwrite(text.data(), 1, text.size(), file);
+		fclose(file);
+
+		remove(metricsPath.c_str());
+		rename(tempPath.c_str(), metricsPath.c_str());
 	}
 
 	void PollLocalUserInput()
@@ -245,9 +1293,19 @@ private:
 
 				break;
 			}
+			if (strcmp(cmd.c_str(), "/rooms") == 0)
+			{
+				PrintRoomStats();
+				break;
+			}
+			if (strcmp(cmd.c_str(), "/stats") == 0)
+			{
+				PrintStats();
+				break;
+			}
 
 			// That's the only command we support
-			std::cout << "Server commands include: '/quit' and '/test'" << std::endl;
+			std::cout << "Server commands include: '/quit', '/test', '/rooms' and '/stats'" << std::endl;
 		}
 	}
 
@@ -258,13 +1316,16 @@ private:
 		m_mapClients[hConn].m_sNick = nick;
 
 		// Set the connection name, too, which is useful for debugging
-		m_pInterface->SetConnectionName(hConn, nick);
+		m_pTransport->SetConnectionName(hConn, nick);
 	}
 
 	void OnSteamNetConnectionStatusChanged(SteamNetConnectionStatusChangedCallback_t *pInfo)
 	{
 		char temp[1024];
 
+		if (OnShardLinkStatusChanged(pInfo))
+			return;
+
 		// What's the state of the connection?
 		switch (pInfo->m_info.m_eState)
 		{
@@ -304,12 +1365,15 @@ private:
 				// Spew something to our own log.  Note that because we put their nick
 				// as the connection description, it will show up, along with their
 				// transport-specific data (e.g. their IP address)
-				std::cout << "Connection " << pInfo->m_info.m_szConnectionDescription << pszDebugLogAction << ", reason " << pInfo->m_info.m_eEndReason << ": " << pInfo->m_info.m_szEndDebug << std::endl;
+				if (logConnections)
+					std::cout << "Connection " << pInfo->m_info.m_szConnectionDescription << pszDebugLogAction << ", reason " << pInfo->m_info.m_eEndReason << ": " << pInfo->m_info.m_szEndDebug << std::endl;
 
-				m_mapClients.erase(itClient);
+				// the room sends a message so everybody else in it knows what happened
+				LeaveRoom(itClient->first, itClient->second, temp);
+				matchmaker.Cancel(itClient->first);
+				analysis.CancelConnection(itClient->first);
 
-				// Send a message so everybody else knows what happened
-				SendStringToAllClients(temp);
+				m_mapClients.erase(itClient);
 			}
 			else
 			{
@@ -322,7 +1386,7 @@ private:
 			// to finish up.  The reason information do not matter in this case,
 			// and we cannot linger because it's already closed on the other end,
 			// so we just pass 0's.
-			m_pInterface->CloseConnection(pInfo->m_hConn, 0, nullptr, false);
+			m_pTransport->CloseConnection(pInfo->m_hConn, 0, nullptr, false);
 			break;
 		}
 
@@ -331,52 +1395,45 @@ private:
 			// This must be a new connection
 			assert(m_mapClients.find(pInfo->m_hConn) == m_mapClients.end());
 
-			std::cout << "Connection request from " << pInfo->m_info.m_szConnectionDescription << std::endl;
+			if (logConnections)
+				std::cout << "Connection request from " << pInfo->m_info.m_szConnectionDescription << std::endl;
 
-			// deny the request if the number of people in the server already is over two
-			if ((int)m_mapClients.size() + 1 > 2) {
-				// SendStringToClient(pInfo->m_hConn, "The server is currently full. Please wait or make another server on a different port or ip address.");
-				std::cout << "More than two clients attempting to connect." << std::endl;
+			// deny the request if the server is full
+			if ((int)m_mapClients.size() + 1 > MAX_SERVER_CLIENTS) {
+				m_pTransport->CloseConnection(pInfo->m_hConn, 0, "Server full", false);
+				std::cout << "Server is full, rejected connection." << std::endl;
+				connectionsRejected++;
+				break;
+			}
+
+			// or if the room workers are already behind. More players would only make every room slower.
+			if (WorkersSaturated()) {
+				m_pTransport->CloseConnection(pInfo->m_hConn, 0, "Server busy", false);
+				if (logConnections)
+					std::cout << "Room workers are saturated, rejected connection." << std::endl;
+				connectionsRejected++;
 				break;
 			}
 
 			// A client is attempting to connect
 			// Try to accept the connection.
-			if (m_pInterface->AcceptConnection(pInfo->m_hConn) != k_EResultOK)
+			if (!m_pTransport->AcceptConnection(pInfo->m_hConn))
 			{
 				// This could fail.  If the remote host tried to connect, but then
 				// disconnected, the connection may already be half closed.  Just
 				// destroy whatever we have on our side.
-				m_pInterface->CloseConnection(pInfo->m_hConn, 0, nullptr, false);
+				m_pTransport->CloseConnection(pInfo->m_hConn, 0, nullptr, false);
 				std::cout << "Can't accept connection.  (It was already closed?)" << std::endl;
 				break;
 			}
 
-			// Assign the poll group
-			if (!m_pInterface->SetConnectionPollGroup(pInfo->m_hConn, m_hPollGroup))
-			{
-				m_pInterface->CloseConnection(pInfo->m_hConn, 0, nullptr, false);
-				std::cout << "Failed to set poll group?" << std::endl;
-				break;
-			}
-
-			// give a name based on the number of players connected to the server
-			string nick = "Player " + std::to_string(m_mapClients.size());
-
-			// send message to all players that somebody joined
-			SendStringToAllClients(nick + " joined the server. Current # of players on server: " + to_string((int)m_mapClients.size()), pInfo->m_hConn);
-
-			// send game setup info to the new connection so they know what turn they are
-			DataPacket data;
-			data.type = data.GAME_SETUP;
-			data.assignedTurn = ((int)m_mapClients.size()) % 2 + 1;
-			SendDataToClient(pInfo->m_hConn, &data);
+			// give a unique name based on the number of players that have connected to the server
+			std::string nick = "Player " + std::to_string(nextPlayerNumber++);
 
-			// send current gamedata
-			SendCurrentDataToClient(pInfo->m_hConn);
+			// they wait in the lobby until they ask to join a room
 
 			// Add them to the client list, using std::map wacky syntax
-			m_mapClients[pInfo->m_hConn];
+			m_mapClients[pInfo->m_hConn].limits.reset(std::chrono::steady_clock::now());
 			SetClientNick(pInfo->m_hConn, nick.c_str());
 			break;
 		}
@@ -392,48 +1449,14 @@ private:
 		}
 	}
 
-	static Server *s_pCallbackInstance;
-
-	static void SteamNetConnectionStatusChangedCallback(SteamNetConnectionStatusChangedCallback_t *pInfo)
+	static void StatusChangedCallback(SteamNetConnectionStatusChangedCallback_t *pInfo, void *context)
 	{
-		s_pCallbackInstance->OnSteamNetConnectionStatusChanged(pInfo);
+		((Server*)context)->OnSteamNetConnectionStatusChanged(pInfo);
 	}
 
 	void PollConnectionStateChanges()
 	{
-		s_pCallbackInstance = this;
-		m_pInterface->RunCallbacks();
-	}
-
-	// game stuff
-	// convert the pieces on the board to data 1's and 2's to represent red and blue respectivley.
-	// returns a datapacket with the int array converted to numbers
-	DataPacket convertBoardToPacket() {
-		DataPacket data;
-		data.type = DataPacket::MsgType::GAME_DATA;
-
-		for (int c = 0; c < 3; c++) {
-			for (int x = 0; x < 3; x++) {
-				for (int y = 0; y < 3; y++) {
-					for (int z = 0; z < 3; z++) {
-						if (game.board.data[c][x][y][z].type == Piece::Color::EMPTY) {
-							data.board[c][x][y][z] = -1;
-						}
-						if (game.board.data[c][x][y][z].type == Piece::Color::NONE) {
-							data.board[c][x][y][z] = 0;
-						}
-						if (game.board.data[c][x][y][z].type == Piece::Color::RED) {
-							data.board[c][x][y][z] = 1;
-						}
-						if (game.board.data[c][x][y][z].type == Piece::Color::BLUE) {
-							data.board[c][x][y][z] = 2;
-						}
-					}
-				}
-			}
-		}
-
-		return data;
+		m_pTransport->RunCallbacks();
 	}
 };
 
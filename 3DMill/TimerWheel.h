@@ -0,0 +1,259 @@
+// hierarchical timer wheel. Timers are kept in buckets by how far away they are: level 0 has one bucket per tick,
+// each level above has buckets 64 times as wide. When a lower level wraps around, the next bucket of the level above
+// is spread out over the levels below it. Arming and cancelling a timer is O(1) and advancing only touches buckets
+// that have timers in them, so thousands of idle timers cost nothing until they are about to fire.
+// not thread safe, every wheel belongs to one thread.
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+#include <vector>
+#include <chrono>
+
+// resolution of the timers. Nothing fires early, and at most one tick late.
+const std::chrono::milliseconds TIMER_WHEEL_TICK(10);
+
+class TimerWheel {
+public:
+	typedef std::chrono::steady_clock::time_point TimePoint;
+
+	// 0 is never a valid timer
+	typedef uint64_t TimerId;
+
+	struct Expired {
+		TimerId timer;
+		uint32_t owner;
+	};
+
+	TimerWheel() {
+		origin = std::chrono::steady_clock::now();
+		for (int level = 0; level < LEVELS; level++) {
+			occupied[level] = 0;
+			for (int slot = 0; slot < SLOTS; slot++) {
+				heads[level][slot] = NIL;
+			}
+		}
+	}
+
+	size_t Armed() const {
+		return armed;
+	}
+
+	// fire at (or just after) deadline. owner is handed back when the timer fires.
+	TimerId Arm(uint32_t owner, TimePoint deadline) {
+		uint32_t index;
+		if (freeList != NIL) {
+			index = freeList;
+			freeList = nodes[index].next;
+		}
+		else {
+			index = (uint32_t)nodes.size();
+			nodes.push_back(Node());
+		}
+
+		// round up so a timer never fires before its deadline, and always in the future
+		uint64_t expires = current + 1;
+		if (deadline > origin) {
+			uint64_t ticks = (uint64_t)((deadline - origin + TIMER_WHEEL_TICK - std::chrono::nanoseconds(1)) / TIMER_WHEEL_TICK);
+			if (ticks > expires) {
+				expires = ticks;
+			}
+		}
+
+		Node &node = nodes[index];
+		node.expires = expires;
+		node.owner = owner;
+		node.armed = true;
+		Insert(index);
+		armed++;
+
+		return ((TimerId)node.generation << 32) | index;
+	}
+
+	// returns false if the timer already fired or was cancelled
+	bool Cancel(TimerId timer) {
+		uint32_t index = (uint32_t)timer;
+		if (timer == 0 || index >= nodes.size() || nodes[index].generation != (uint32_t)(timer >> 32) || !nodes[index].armed) {
+			return false;
+		}
+
+		Unlink(index);
+		Free(index);
+		armed--;
+		return true;
+	}
+
+	// move the wheel up to now and add every timer that fired to expired, earliest first
+	void Advance(TimePoint now, std::vector<Expired> &expired) {
+		if (now <= origin) {
+			return;
+		}
+		uint64_t target = (uint64_t)((now - origin) / TIMER_WHEEL_TICK);
+
+		while (current < target) {
+			// jump straight past ticks that have nothing to do
+			uint64_t next = NextTick();
+			if (next > target) {
+				current = target;
+				break;
+			}
+			current = next;
+
+			// buckets of the levels above are spread out before anything at this tick fires
+			for (int level = LEVELS - 1; level > 0; level--) {
+				if ((current & (((uint64_t)1 << (BITS * level)) - 1)) == 0) {
+					Cascade(level, (int)((current >> (BITS * level)) & MASK));
+				}
+			}
+
+			int slot = (int)(current & MASK);
+			while (heads[0][slot] != NIL) {
+				uint32_t index = heads[0][slot];
+				Expired timer;
+				timer.timer = ((TimerId)nodes[index].generation << 32) | index;
+				timer.owner = nodes[index].owner;
+
+				Unlink(index);
+				Free(index);
+				armed--;
+				expired.push_back(timer);
+			}
+		}
+	}
+
+	// the earliest the next timer can fire, or TimePoint::max() if none are armed.
+	// timers far out may only be moved down a level at this time, so Advance can return nothing.
+	TimePoint NextExpiry() const {
+		if (armed == 0) {
+			return TimePoint::max();
+		}
+		return origin + TIMER_WHEEL_TICK * (int64_t)NextTick();
+	}
+
+private:
+	static const int BITS = 6;
+	static const int SLOTS = 1 << BITS;
+	static const uint64_t MASK = SLOTS - 1;
+	static const int LEVELS = 4;
+	static const uint32_t NIL = 0xFFFFFFFF;
+
+	struct Node {
+		uint64_t expires = 0;
+		uint32_t next = NIL;
+		uint32_t prev = NIL;
+		// bumped every time the node is reused so old ids can't cancel a new timer
+		uint32_t generation = 1;
+		uint32_t owner = 0;
+		uint8_t level = 0;
+		uint8_t slot = 0;
+		bool armed = false;
+	};
+
+	TimePoint origin;
+	// the last tick that was processed
+	uint64_t current = 0;
+	size_t armed = 0;
+
+	std::vector<Node> nodes;
+	uint32_t freeList = NIL;
+
+	// each bucket is a doubly linked list through nodes. A bit is set for every bucket that is not empty.
+	uint32_t heads[LEVELS][SLOTS];
+	uint64_t occupied[LEVELS];
+
+	// the first tick after current where a bucket has to be fired or cascaded
+	uint64_t NextTick() const {
+		uint64_t next = UINT64_MAX;
+		for (int level = 0; level < LEVELS; level++) {
+			if (occupied[level] == 0) {
+				continue;
+			}
+
+			// buckets are looked at in order starting from the one after the current position
+			uint64_t position = current >> (BITS * level);
+			int start = (int)((position + 1) & MASK);
+			uint64_t rotated = (occupied[level] >> start) | (start == 0 ? 0 : occupied[level] << (SLOTS - start));
+			uint64_t tick = (position + 1 + CountTrailingZeros(rotated)) << (BITS * level);
+
+			if (tick < next) {
+				next = tick;
+			}
+		}
+		return next;
+	}
+
+	// put a node in the bucket for how far away it is
+	void Insert(uint32_t index) {
+		Node &node = nodes[index];
+
+		uint64_t delta = node.expires - current;
+		int level = 0;
+		while (level < LEVELS - 1 && delta >= ((uint64_t)1 << (BITS * (level + 1)))) {
+			level++;
+		}
+
+		// anything past the top level waits in its last bucket and is looked at again when that comes round
+		uint64_t furthest = current + ((uint64_t)1 << (BITS * LEVELS)) - 1;
+		uint64_t expires = node.expires < furthest ? node.expires : furthest;
+		int slot = (int)((expires >> (BITS * level)) & MASK);
+
+		node.level = (uint8_t)level;
+		node.slot = (uint8_t)slot;
+		node.prev = NIL;
+		node.next = heads[level][slot];
+		if (node.next != NIL) {
+			nodes[node.next].prev = index;
+		}
+		heads[level][slot] = index;
+		occupied[level] |= (uint64_t)1 << slot;
+	}
+
+	void Unlink(uint32_t index) {
+		Node &node = nodes[index];
+		if (node.prev != NIL) {
+			nodes[node.prev].next = node.next;
+		}
+		else {
+			heads[node.level][node.slot] = node.next;
+		}
+		if (node.next != NIL) {
+			nodes[node.next].prev = node.prev;
+		}
+
+		if (heads[node.level][node.slot] == NIL) {
+			occupied[node.level] &= ~((uint64_t)1 << node.slot);
+		}
+	}
+
+	void Free(uint32_t index) {
+		Node &node = nodes[index];
+		node.armed = false;
+		node.generation++;
+		node.next = freeList;
+		freeList = index;
+	}
+
+	// spread a bucket out over the levels below now that it is close
+	void Cascade(int level, int slot) {
+		uint32_t index = heads[level][slot];
+		heads[level][slot] = NIL;
+		occupied[level] &= ~((uint64_t)1 << slot);
+
+		while (index != NIL) {
+			uint32_t next = nodes[index].next;
+			Insert(index);
+			index = next;
+		}
+	}
+
+	static int CountTrailingZeros(uint64_t bits) {
+		int count = 0;
+		while ((bits & 1) == 0) {
+			bits >>= 1;
+			count++;
+		}
+		return count;
+	}
+};
+
+#endif
@@ -15,6 +15,7 @@
 #include <chrono>
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include <queue>
 #include <map>
 #include <cctype>
@@ -31,6 +32,14 @@
 
 // all vars and static methods are defined in the Tools.h fill
 
+// notified when input is queued so the main loop doesn't have to poll for it
+static std::atomic<EventSignal*> s_pUserInputSignal(nullptr);
+
+void LocalUserInput_SetSignal(EventSignal *signal)
+{
+	s_pUserInputSignal = signal;
+}
+
 void LocalUserInput_Init()
 {
 	s_pThreadUserInput = new std::thread([]()
@@ -52,6 +61,10 @@ void LocalUserInput_Init()
 			mutexUserInputQueue.lock();
 			queueUserInput.push(std::string(szLine));
 			mutexUserInputQueue.unlock();
+
+			EventSignal *signal = s_pUserInputSignal;
+			if (signal != nullptr)
+				signal->Notify();
 		}
 	});
 }
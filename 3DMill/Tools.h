@@ -11,12 +11,15 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <stddef.h>
 #include <algorithm>
 #include <string>
 #include <random>
 #include <chrono>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
 #include <queue>
 #include <map>
 #include <cctype>
@@ -31,6 +34,8 @@
 
 #include <signal.h>
 
+#include "Zobrist.h"
+
 static bool g_bQuit = false;
 
 static SteamNetworkingMicroseconds g_logTimeZero;
@@ -40,19 +45,25 @@ static SteamNetworkingMicroseconds g_logTimeZero;
 struct DataPacket
 {
 	// game data handles per move data, game_setup sends the setup info to the clients, game selection is a per selection update that just sends the position of cursor, connection status is basically just a message
-	enum MsgType {GAME_DATA, GAME_SETUP, GAME_SELECTION, CONNECTION_STATUS};
+	// game delta is a small per move update from the server (see DeltaPacket), game resync is a client asking the server for a full snapshot
+	// room join is a client in the server lobby asking to join (or create) a room (see RoomPacket)
+	// game clock is the server telling a room how much time each player has left (see ClockPacket)
+	// batch is several messages for one connection sent as one (see BatchHeader)
+	// game action is a move in a lockstep room, only the slots it changed (a DeltaPacket the mover built itself)
+	// room redirect is the server telling a client its room is hosted by another server process (see RedirectPacket)
+	// analysis request and result are a client asking the server to look at a position and its answer (see AnalysisRequestPacket)
+	enum MsgType {GAME_DATA, GAME_SETUP, GAME_SELECTION, CONNECTION_STATUS, GAME_DELTA, GAME_RESYNC, ROOM_JOIN, MATCH_REQUEST, GAME_CLOCK, BATCH, GAME_ACTION, ROOM_REDIRECT, ANALYSIS_REQUEST, ANALYSIS_RESULT};
 	MsgType type;
 
-	// connection status info
-	std::string msg;
+	// connection status info (fixed size so the packet can be sent and copied as raw bytes)
+	char msg[256] = "";
 
 	// game setup
 	int assignedTurn;
-
-	// game selection
-	bool selectedVisible;
-	// board coordinate system 0-3 inclusive, not world space
-	glm::vec3 selectedPiecePos;
+	// the room runs in lockstep and checksums are compared every this many actions (0 if the server sends every state)
+	int lockstep = 0;
+	// the room the client was put in, so it can find it again after a reconnect
+	uint32 roomId = 0;
 
 	// game data info
 	// -1 is EMPTY, 0 is None, 1 is red, blue is 2
@@ -64,8 +75,306 @@ struct DataPacket
 
 	int currentTurn;
 	int board[3][3][3][3];
+
+	// state sync (only set on snapshots sent by the server)
+	// sequence id of the state change this snapshot is at
+	uint32 sequence = 0;
+	// zobrist checksum of the board and counters
+	uint64 checksum = 0;
+	// the opponent's pieces the player to move still has to take for the mills they closed (see Rules::legalSubmission)
+	int millsLeft = 0;
+
+	// clients number every state they submit. Snapshots the server sends to one client carry the last number
+	// it handled from that client, so the client knows which of its predictions have been answered.
+	uint32 action = 0;
+};
+
+// a numbered state change sent by the server instead of a full snapshot.
+// in a lockstep room the mover builds it and the server passes it on as a GAME_ACTION.
+// only the header and the first numChanges entries of changes are sent over the network.
+struct DeltaPacket
+{
+	DataPacket::MsgType type = DataPacket::MsgType::GAME_DELTA;
+
+	// sequence id of the state after this delta is applied (always the previous one + 1)
+	uint32 sequence = 0;
+	// zobrist checksum of the state after this delta is applied.
+	// lockstep actions only carry it every DataPacket::lockstep actions and leave it 0 otherwise.
+	uint64 checksum = 0;
+
+	// the player (1 red, 2 blue) whose submission made this change and the number they gave it (0 if none)
+	int actionTurn = 0;
+	uint32 action = 0;
+
+	// counters are small so they are always sent
+	int score1 = 0;
+	int score2 = 0;
+
+	int piecesLeft1 = 23;
+	int piecesLeft2 = 23;
+
+	int currentTurn = 0;
+
+	// board slots that changed (slot index from slotIndex(), value uses the DataPacket board values)
+	struct SlotChange
+	{
+		uint8 slot;
+		int8 value;
+	};
+
+	int numChanges = 0;
+	SlotChange changes[BOARD_SLOTS];
+};
+
+// the position of a player's outline piece (cursor). These are sent unreliably, so each one is numbered
+// and anything older than the newest one seen is dropped.
+struct SelectionPacket
+{
+	DataPacket::MsgType type = DataPacket::MsgType::GAME_SELECTION;
+
+	// stamped by the sender, then restamped by the server when it relays so every receiver sees one increasing stream
+	uint32 sequence = 0;
+
+	bool visible = false;
+	// the cursor stopped here. Sent once, reliably and with the sequence of the last update, and passed on
+	// reliably by the server even if it already relayed that update, so the final position always arrives.
+	bool settled = false;
+	// world space position of the outline piece
+	glm::vec3 pos = glm::vec3(0);
+};
+
+// sent by a client in the lobby to join a room. A room that does not exist yet is created.
+struct RoomPacket
+{
+	DataPacket::MsgType type = DataPacket::MsgType::ROOM_JOIN;
+
+	// 0 is the lobby and can't be joined
+	uint32 roomId = 1;
+
+	// watch the match instead of playing
+	bool spectate = false;
+
+	// the color to take if it is free (a player coming back to a match after a reconnect), 0 for either
+	int turn = 0;
+};
+
+// sent instead of joining when the room is hosted by another server process. The client connects there and asks again.
+struct RedirectPacket
+{
+	DataPacket::MsgType type = DataPacket::MsgType::ROOM_REDIRECT;
+
+	uint32 roomId = 0;
+	bool spectate = false;
+	int turn = 0;
+
+	// ip:port of the server hosting the room
+	char address[SteamNetworkingIPAddr::k_cchMaxString] = "";
+};
+
+// sent by a client in the lobby to be paired with someone of a similar rating. The server puts both in a new room.
+struct MatchPacket
+{
+	DataPacket::MsgType type = DataPacket::MsgType::MATCH_REQUEST;
+
+	int rating = 1500;
+};
+
+// a client asking the server about a position: the best move, how good it is for the side to move, or whether that
+// side can force a win. It is answered with an AnalysisResultPacket carrying the same requestId.
+// a CANCEL stops the request with that id (it is answered as cancelled unless it already finished).
+struct AnalysisRequestPacket
+{
+	DataPacket::MsgType type = DataPacket::MsgType::ANALYSIS_REQUEST;
+
+	enum Kind { BEST_MOVE, EVALUATE, FORCED_WIN, CANCEL };
+	int kind = BEST_MOVE;
+
+	// picked by the client
+	uint32 requestId = 0;
+
+	// 0 is a player in a live game, 1 is reviewing a finished one (only searched when no live game is waiting)
+	int lane = 0;
+
+	// most positions to look at and most time to take. The server caps both, 0 asks for the cap.
+	uint32 maxNodes = 0;
+	int maxMillis = 0;
+
+	// only the board, reserves and currentTurn are used
+	DataPacket position;
+};
+
+struct AnalysisResultPacket
+{
+	DataPacket::MsgType type = DataPacket::MsgType::ANALYSIS_RESULT;
+
+	// busy means the server has too many requests waiting, try again later
+	enum Status { DONE, BUSY, CANCELLED, BAD_POSITION };
+	int status = DONE;
+
+	uint32 requestId = 0;
+	int kind = AnalysisRequestPacket::BEST_MOVE;
+
+	// for the side to move, 100 is one piece ahead. A forced win is 100000 less the plies to it (a loss is negative).
+	int score = 0;
+
+	// plies to a forced win (a forced loss is negative), 0 if neither was found.
+	// a FORCED_WIN check only proves there is one within this many plies.
+	int forcedWin = 0;
+
+	// plies searched and positions looked at (the search that filled the cache if cached is set)
+	int depth = 0;
+	uint32 nodes = 0;
+	bool cached = false;
+
+	// best move: a piece from a slot (-1 if it comes from the reserve) to a slot, then the opponent's pieces
+	// it takes (-1 for none). Slots are numbered by slotIndex(). to is -1 if there is no move.
+	int from = -1;
+	int to = -1;
+	int taken[3] = { -1, -1, -1 };
+};
+
+// the players' clocks, sent by the server whenever one starts, stops or runs out (only if the server has a time control)
+struct ClockPacket
+{
+	DataPacket::MsgType type = DataPacket::MsgType::GAME_CLOCK;
+
+	// time left for red and blue when this was sent
+	int millisLeft1 = 0;
+	int millisLeft2 = 0;
+
+	// the player (1 red, 2 blue) whose clock is running, 0 if both are stopped
+	int running = 0;
+
+	// the player who ran out of time and lost, 0 if nobody has
+	int flagged = 0;
+};
+
+// the server packs everything it has for one connection in a tick into one message.
+// the header is followed by count entries, each a BatchEntry and then the message padded to 8 bytes.
+struct BatchHeader
+{
+	DataPacket::MsgType type = DataPacket::MsgType::BATCH;
+	uint32 count = 0;
 };
 
+struct BatchEntry
+{
+	uint32 size;
+	uint32 reserved;
+};
+
+// room taken up by one message in a batch
+static uint32 BatchEntrySize(uint32 size) {
+	return (uint32)sizeof(BatchEntry) + ((size + 7) & ~7u);
+}
+
+// call handle(data, size) for every message in a batch, or once for a message that isn't one
+template <typename Handler>
+static void UnpackMessages(const void *data, int size, Handler handle) {
+	if (size < (int)sizeof(BatchHeader) || *(const int*)data != DataPacket::MsgType::BATCH) {
+		handle(data, size);
+		return;
+	}
+
+	const BatchHeader *header = (const BatchHeader*)data;
+	const char *next = (const char*)data + sizeof(BatchHeader);
+	const char *end = (const char*)data + size;
+	for (uint32 i = 0; i < header->count && end - next >= (int)sizeof(BatchEntry); i++) {
+		const BatchEntry *entry = (const BatchEntry*)next;
+		if (entry->size > (uint32)(end - next) - sizeof(BatchEntry)) {
+			return;
+		}
+
+		handle(next + sizeof(BatchEntry), (int)entry->size);
+
+		// the last entry doesn't have to be padded
+		if (BatchEntrySize(entry->size) >= (uint32)(end - next)) {
+			return;
+		}
+		next += BatchEntrySize(entry->size);
+	}
+}
+
+// name of a message type for stats output
+static const char *MsgTypeName(int type) {
+	static const char *names[] = { "game_data", "game_setup", "game_selection", "connection_status", "game_delta", "game_resync", "room_join", "match_request", "game_clock", "batch", "game_action", "room_redirect", "analysis_request", "analysis_result" };
+	return type >= 0 && type < (int)(sizeof(names) / sizeof(names[0])) ? names[type] : "other";
+}
+
+// number of bytes of a delta that actually need to be sent
+static uint32 DeltaPacketSize(const DeltaPacket &delta) {
+	return (uint32)(offsetof(DeltaPacket, changes) + delta.numChanges * sizeof(DeltaPacket::SlotChange));
+}
+
+// zobrist checksum of the whole game state in a packet
+static uint64 ChecksumPacket(const DataPacket &data) {
+	return zobrist().hashBoard(data.board) ^ zobrist().hashCounters(data.score1, data.score2, data.piecesLeft1, data.piecesLeft2, data.currentTurn);
+}
+
+// fill delta with everything that differs between two states and return the number of changed slots
+static int BuildDelta(const DataPacket &from, const DataPacket &to, DeltaPacket &delta) {
+	delta.type = DataPacket::MsgType::GAME_DELTA;
+	delta.score1 = to.score1;
+	delta.score2 = to.score2;
+	delta.piecesLeft1 = to.piecesLeft1;
+	delta.piecesLeft2 = to.piecesLeft2;
+	delta.currentTurn = to.currentTurn;
+
+	delta.numChanges = 0;
+	for (int c = 0; c < 3; c++) {
+		for (int x = 0; x < 3; x++) {
+			for (int y = 0; y < 3; y++) {
+				for (int z = 0; z < 3; z++) {
+					if (from.board[c][x][y][z] != to.board[c][x][y][z]) {
+						DeltaPacket::SlotChange &change = delta.changes[delta.numChanges++];
+						change.slot = (uint8)slotIndex(c, x, y, z);
+						change.value = (int8)to.board[c][x][y][z];
+					}
+				}
+			}
+		}
+	}
+
+	return delta.numChanges;
+}
+
+// apply a delta on top of a state. The checksum is updated incrementally and put in checksum so it can be compared with
+// delta.checksum. Deltas come off the network and out of files, so one with a bad change count or slot number is
+// refused (false) before anything is written and the state is left as it was.
+static bool ApplyDelta(DataPacket &state, const DeltaPacket &delta, uint64 &checksum) {
+	if (delta.numChanges < 0 || delta.numChanges > BOARD_SLOTS) {
+		return false;
+	}
+	for (int i = 0; i < delta.numChanges; i++) {
+		if (delta.changes[i].slot >= BOARD_SLOTS) {
+			return false;
+		}
+	}
+
+	uint64 boardHash = state.checksum ^ zobrist().hashCounters(state.score1, state.score2, state.piecesLeft1, state.piecesLeft2, state.currentTurn);
+
+	for (int i = 0; i < delta.numChanges; i++) {
+		int c, x, y, z;
+		slotCoord(delta.changes[i].slot, c, x, y, z);
+
+		boardHash ^= zobrist().slotKey(delta.changes[i].slot, state.board[c][x][y][z]);
+		state.board[c][x][y][z] = delta.changes[i].value;
+		boardHash ^= zobrist().slotKey(delta.changes[i].slot, state.board[c][x][y][z]);
+	}
+
+	state.score1 = delta.score1;
+	state.score2 = delta.score2;
+	state.piecesLeft1 = delta.piecesLeft1;
+	state.piecesLeft2 = delta.piecesLeft2;
+	state.currentTurn = delta.currentTurn;
+
+	state.sequence = delta.sequence;
+	state.checksum = boardHash ^ zobrist().hashCounters(state.score1, state.score2, state.piecesLeft1, state.piecesLeft2, state.currentTurn);
+
+	checksum = state.checksum;
+	return true;
+}
+
 // static methods
 static void DebugOutput(ESteamNetworkingSocketsDebugOutputType eType, const char *pszMsg) {
 	std::cout << pszMsg << std::endl;
@@ -115,6 +424,44 @@ static void ShutdownSteamDatagramConnectionSockets()
 #endif
 }
 
+// lets a thread sleep until something happens (console input, a timer, more work) instead of waking up on a fixed interval
+class EventSignal
+{
+public:
+	// wake up the waiting thread. Safe to call from any thread.
+	void Notify()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutexSignal);
+			signaled = true;
+		}
+		condition.notify_one();
+	}
+
+	// sleep until notified or the timeout passes. Returns true if it was notified.
+	bool WaitFor(std::chrono::microseconds timeout)
+	{
+		std::unique_lock<std::mutex> lock(mutexSignal);
+		bool notified = condition.wait_for(lock, timeout, [this] { return signaled; });
+		signaled = false;
+		return notified;
+	}
+
+	// the same, but returns straight away once stop is set. Whoever sets it still has to Notify.
+	bool WaitFor(std::chrono::microseconds timeout, const std::atomic<bool> &stop)
+	{
+		std::unique_lock<std::mutex> lock(mutexSignal);
+		bool notified = condition.wait_for(lock, timeout, [this, &stop] { return signaled || stop; });
+		signaled = false;
+		return notified;
+	}
+
+private:
+	std::mutex mutexSignal;
+	std::condition_variable condition;
+	bool signaled = false;
+};
+
 // vars
 
 static std::mutex mutexUserInputQueue;
@@ -126,6 +473,9 @@ void LocalUserInput_Init();
 
 void LocalUserInput_Kill();
 
+// signal notified every time a line of input is queued (nullptr to stop)
+void LocalUserInput_SetSignal(EventSignal *signal);
+
 // trim from start (in place)
 static inline void ltrim(std::string &s);
 
@@ -0,0 +1,170 @@
+// the connection handling the server and client need, so they can run over real sockets (GnsTransport)
+// or entirely in memory inside one process (LoopbackTransport).
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <vector>
+#include <iostream>
+
+#include <GameNetworkingSockets/steam/steamnetworkingsockets.h>
+#include <GameNetworkingSockets/steam/isteamnetworkingutils.h>
+
+#include "Broadcast.h"
+
+// handles and messages are the GameNetworkingSockets types so code written against one transport works on the other
+class Transport {
+public:
+	typedef void(*StatusChangedCallback)(SteamNetConnectionStatusChangedCallback_t *pInfo, void *context);
+
+	virtual ~Transport() {}
+
+	// connection status changes are given to this from RunCallbacks
+	void SetStatusChangedCallback(StatusChangedCallback callback, void *context) {
+		m_pfnStatusChanged = callback;
+		m_pStatusContext = context;
+	}
+
+	// accept connections on a port. They show up as Connecting status changes.
+	virtual bool Listen(uint16 port) = 0;
+
+	virtual HSteamNetConnection Connect(const SteamNetworkingIPAddr &addr) = 0;
+
+	// accept an incoming connection. Its messages are returned by ReceiveMessages.
+	virtual bool AcceptConnection(HSteamNetConnection conn) = 0;
+
+	virtual void CloseConnection(HSteamNetConnection conn, int reason, const char *debug, bool linger) = 0;
+
+	virtual void SetConnectionName(HSteamNetConnection conn, const char *name) = 0;
+
+	// messages from every connection (accepted or connected). Release each one when done.
+	virtual int ReceiveMessages(ISteamNetworkingMessage **ppOutMessages, int nMaxMessages) = 0;
+
+	// the send functions are safe to call from any thread
+	virtual EResult SendMessageToConnection(HSteamNetConnection conn, const void *data, uint32 size, int sendFlags) = 0;
+
+	// send the same payload to many connections. It is only copied once.
+	virtual void SendMessageToConnections(const std::vector<HSteamNetConnection> &conns, const void *data, uint32 size, int sendFlags) = 0;
+
+	// send messages that were already put in buffers (see SendQueue) in one go. Takes their buffer references.
+	virtual void SendMessages(const std::vector<OutboundMessage> &outbound) = 0;
+
+	// deliver queued connection status changes to the callback
+	virtual void RunCallbacks() = 0;
+
+	// the clock m_usecTimeReceived on recieved messages is measured with
+	virtual SteamNetworkingMicroseconds GetLocalTimestamp() = 0;
+
+	// ping, quality and how much is waiting to be sent on a connection. Returns false if the connection is gone.
+	virtual bool GetQuickConnectionStatus(HSteamNetConnection conn, SteamNetworkingQuickConnectionStatus *pStatus) = 0;
+
+protected:
+	StatusChangedCallback m_pfnStatusChanged = nullptr;
+	void *m_pStatusContext = nullptr;
+
+	void StatusChanged(SteamNetConnectionStatusChangedCallback_t *pInfo) {
+		if (m_pfnStatusChanged != nullptr)
+			m_pfnStatusChanged(pInfo, m_pStatusContext);
+	}
+};
+
+// real networking through GameNetworkingSockets. Every connection is put in one poll group.
+// the library runs status callbacks for the whole process, so only make one of these per process.
+class GnsTransport : public Transport {
+public:
+	GnsTransport(ISteamNetworkingSockets *pInterface) {
+		m_pInterface = pInterface;
+		m_hPollGroup = m_pInterface->CreatePollGroup();
+		if (m_hPollGroup == k_HSteamNetPollGroup_Invalid)
+			std::cout << "Failed to create poll group" << std::endl;
+	}
+
+	~GnsTransport() {
+		if (m_hListenSock != k_HSteamListenSocket_Invalid)
+			m_pInterface->CloseListenSocket(m_hListenSock);
+		m_pInterface->DestroyPollGroup(m_hPollGroup);
+	}
+
+	bool Listen(uint16 port) {
+		SteamNetworkingIPAddr serverLocalAddr;
+		serverLocalAddr.Clear();
+		serverLocalAddr.m_port = port;
+		SteamNetworkingConfigValue_t opt;
+		opt.SetPtr(k_ESteamNetworkingConfig_Callback_ConnectionStatusChanged, (void*)SteamNetConnectionStatusChangedCallback);
+		m_hListenSock = m_pInterface->CreateListenSocketIP(serverLocalAddr, 1, &opt);
+		return m_hListenSock != k_HSteamListenSocket_Invalid;
+	}
+
+	HSteamNetConnection Connect(const SteamNetworkingIPAddr &addr) {
+		SteamNetworkingConfigValue_t opt;
+		opt.SetPtr(k_ESteamNetworkingConfig_Callback_ConnectionStatusChanged, (void*)SteamNetConnectionStatusChangedCallback);
+		HSteamNetConnection conn = m_pInterface->ConnectByIPAddress(addr, 1, &opt);
+		if (conn != k_HSteamNetConnection_Invalid)
+			m_pInterface->SetConnectionPollGroup(conn, m_hPollGroup);
+		return conn;
+	}
+
+	bool AcceptConnection(HSteamNetConnection conn) {
+		// This could fail.  If the remote host tried to connect, but then
+		// disconnected, the connection may already be half closed.
+		if (m_pInterface->AcceptConnection(conn) != k_EResultOK)
+			return false;
+
+		return m_pInterface->SetConnectionPollGroup(conn, m_hPollGroup);
+	}
+
+	void CloseConnection(HSteamNetConnection conn, int reason, const char *debug, bool linger) {
+		m_pInterface->CloseConnection(conn, reason, debug, linger);
+	}
+
+	void SetConnectionName(HSteamNetConnection conn, const char *name) {
+		m_pInterface->SetConnectionName(conn, name);
+	}
+
+	int ReceiveMessages(ISteamNetworkingMessage **ppOutMessages, int nMaxMessages) {
+		return m_pInterface->ReceiveMessagesOnPollGroup(m_hPollGroup, ppOutMessages, nMaxMessages);
+	}
+
+	EResult SendMessageToConnection(HSteamNetConnection conn, const void *data, uint32 size, int sendFlags) {
+		return m_pInterface->SendMessageToConnection(conn, data, size, sendFlags, nullptr);
+	}
+
+	void SendMessageToConnections(const std::vector<HSteamNetConnection> &conns, const void *data, uint32 size, int sendFlags) {
+		BroadcastShared(m_pInterface, conns, data, size, sendFlags);
+	}
+
+	void SendMessages(const std::vector<OutboundMessage> &outbound) {
+		SendOutbound(m_pInterface, outbound);
+	}
+
+	void RunCallbacks() {
+		// the library's callback has no context so point it at whoever is running callbacks
+		RunningInstance() = this;
+		m_pInterface->RunCallbacks();
+		RunningInstance() = nullptr;
+	}
+
+	SteamNetworkingMicroseconds GetLocalTimestamp() {
+		return SteamNetworkingUtils()->GetLocalTimestamp();
+	}
+
+	bool GetQuickConnectionStatus(HSteamNetConnection conn, SteamNetworkingQuickConnectionStatus *pStatus) {
+		return m_pInterface->GetQuickConnectionStatus(conn, pStatus);
+	}
+
+private:
+	ISteamNetworkingSockets *m_pInterface;
+	HSteamListenSocket m_hListenSock = k_HSteamListenSocket_Invalid;
+	HSteamNetPollGroup m_hPollGroup;
+
+	static GnsTransport *&RunningInstance() {
+		static GnsTransport *instance = nullptr;
+		return instance;
+	}
+
+	static void SteamNetConnectionStatusChangedCallback(SteamNetConnectionStatusChangedCallback_t *pInfo) {
+		if (RunningInstance() != nullptr)
+			RunningInstance()->StatusChanged(pInfo);
+	}
+};
+
+#endif
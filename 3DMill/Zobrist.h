@@ -0,0 +1,96 @@
+// zobrist hashing of the board state so the server and clients can cheaply tell if they agree on the game.
+#ifndef ZOBRIST_H
+#define ZOBRIST_H
+
+#include <random>
+#include <stdint.h>
+
+// number of slots in the board (cube level, x, y, z)
+const int BOARD_SLOTS = 3 * 3 * 3 * 3;
+
+// flattens a board coordinate into a single slot index (0-80)
+inline int slotIndex(int c, int x, int y, int z) {
+	return ((c * 3 + x) * 3 + y) * 3 + z;
+}
+
+// expands a slot index (0-80) back into the board coordinate
+inline void slotCoord(int slot, int &c, int &x, int &y, int &z) {
+	z = slot % 3;
+	y = (slot / 3) % 3;
+	x = (slot / 9) % 3;
+	c = slot / 27;
+}
+
+class Zobrist {
+public:
+	// keys for each slot and each packet value (-1 is EMPTY, 0 is None, 1 is red, 2 is blue)
+	uint64_t slotKeys[BOARD_SLOTS][4];
+
+	// keys for whoever's turn it is (0 is neutral, 1 is red, 2 is blue)
+	uint64_t turnKeys[3];
+
+	// seed is fixed so every process (server or client) builds the same table
+	Zobrist() {
+		std::mt19937_64 rng(0x3D4D494C4C5A4F42ULL);
+
+		for (int i = 0; i < BOARD_SLOTS; i++) {
+			for (int v = 0; v < 4; v++) {
+				slotKeys[i][v] = rng();
+			}
+		}
+
+		for (int i = 0; i < 3; i++) {
+			turnKeys[i] = rng();
+		}
+	}
+
+	// key for a single slot with a given packet value
+	uint64_t slotKey(int slot, int value) const {
+		return slotKeys[slot][(value + 1) & 3];
+	}
+
+	// hash of only the board pieces. Can be updated incrementally with slotKey(old) ^ slotKey(new).
+	uint64_t hashBoard(const int board[3][3][3][3]) const {
+		uint64_t hash = 0;
+
+		for (int c = 0; c < 3; c++) {
+			for (int x = 0; x < 3; x++) {
+				for (int y = 0; y < 3; y++) {
+					for (int z = 0; z < 3; z++) {
+						hash ^= slotKey(slotIndex(c, x, y, z), board[c][x][y][z]);
+					}
+				}
+			}
+		}
+
+		return hash;
+	}
+
+	// the counters (scores and reserve pieces) are unbounded so they are mixed in rather than given keys
+	uint64_t hashCounters(int score1, int score2, int piecesLeft1, int piecesLeft2, int currentTurn) const {
+		uint64_t hash = turnKeys[(currentTurn >= 0 && currentTurn <= 2) ? currentTurn : 0];
+
+		hash ^= mix(((uint64_t)(uint32_t)score1 << 32) | (uint32_t)score2);
+		hash ^= mix((((uint64_t)(uint32_t)piecesLeft1 << 32) | (uint32_t)piecesLeft2) ^ 0x9E3779B97F4A7C15ULL);
+
+		return hash;
+	}
+
+	// splitmix64 finalizer
+	static uint64_t mix(uint64_t x) {
+		x ^= x >> 30;
+		x *= 0xBF58476D1CE4E5B9ULL;
+		x ^= x >> 27;
+		x *= 0x94D049BB133111EBULL;
+		x ^= x >> 31;
+		return x;
+	}
+};
+
+// shared table, built once per process
+inline const Zobrist &zobrist() {
+	static const Zobrist table;
+	return table;
+}
+
+#endif
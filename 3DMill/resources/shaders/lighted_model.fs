@@ -4,6 +4,11 @@ out vec4 FragColor;
 in vec3 Normal;
 in vec2 TexCoords;
 in vec3 FragPos;
+flat in vec4 InstanceOverrideColor;
+flat in vec4 InstanceEffect;
+
+//instanced draws take the override color and effect from the instance instead of the uniforms
+uniform bool instanced = false;
 
 //override color
 uniform bool overrideColorEnabled = false;
@@ -14,15 +19,18 @@ uniform vec3 overrideColor = vec3(1.0);
 uniform vec3 effectColor = vec3(1.0,1.0,1.0);
 uniform float effectColorStrength = 0.5;
 
-//light info
-uniform bool enableLighting = false;
-uniform vec3 lightPos;
-uniform vec3 lightColor;
-uniform float lightBrightness;
-uniform float lightDistance;
-
-//camera data
-uniform vec3 viewPos;
+//camera and light info, set once per frame for every model (GraphicsEngine::FrameUniforms)
+layout (std140) uniform Frame
+{
+    mat4 projection;
+    mat4 view;
+    vec4 viewPos;
+    vec4 lightPos;
+    vec4 lightColor;
+    float lightBrightness;
+    float lightDistance;
+    int enableLighting;
+};
 
 //textures
 uniform bool hasDiffuseTex = false;
@@ -67,7 +75,7 @@ void main()
 
     vec3 lightingResults = vec3(1.0,1.0,1.0);
     //texture lighting
-    if (enableLighting){
+    if (enableLighting != 0){
     	//specular shading
     	if (hasSpecularTex){
 
@@ -80,25 +88,25 @@ void main()
     }
 
     //non-texture based lighting
-    if (enableLighting){
+    if (enableLighting != 0){
     	float diff = 0;
 
     	//ambient lighting
 		float ambientStrength = 0.3;
-    	vec3 ambient = ambientStrength * (lightColor * ambient_color);
+    	vec3 ambient = ambientStrength * (lightColor.xyz * ambient_color);
 
     	//diffuse lighting (normals)
 		vec3 norm = normalize(Normal);
-		vec3 lightDir = normalize(lightPos - FragPos);
+		vec3 lightDir = normalize(lightPos.xyz - FragPos);
 		diff = max(dot(norm, lightDir), 0.0);
-		vec3 diffuse = diff * lightColor * diffuse_color;
+		vec3 diffuse = diff * lightColor.xyz * diffuse_color;
 
 		//specular lighting
 		//basically just make the surface brighter if more light reflects more into the viewers eyes
-    	vec3 viewDir = normalize(viewPos - FragPos);
+    	vec3 viewDir = normalize(viewPos.xyz - FragPos);
     	vec3 reflectDir = reflect(-lightDir, norm);  
     	float spec = pow(max(dot(viewDir, reflectDir), 0.0), specular_shine);
-    	vec3 specular = 1 * spec * (lightColor * specular_color); 
+    	vec3 specular = 1 * spec * (lightColor.xyz * specular_color); 
     	//(EDIT) removed specular_strength where 1 is because it was recieved invalid many times
 
     	//combine the lighting output colors
@@ -107,12 +115,14 @@ void main()
     }
 
     //adjust for color effect multiplier
-    objectColor = objectColor * (1-effectColorStrength) + (effectColor * effectColorStrength);
+    vec3 effect = instanced ? InstanceEffect.xyz : effectColor;
+    float effectStrength = instanced ? InstanceEffect.w : effectColorStrength;
+    objectColor = objectColor * (1-effectStrength) + (effect * effectStrength);
 
     FragColor = vec4(objectColor * lightingResults, depthComponent * opacity);
 
     //override for color
-    if (overrideColorEnabled){
+    if (instanced ? InstanceOverrideColor.w > 0.5 : overrideColorEnabled){
         FragColor = vec4(objectColor, depthComponent * opacity);
     }
 }
\ No newline at end of file
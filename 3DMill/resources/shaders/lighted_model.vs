@@ -4,20 +4,46 @@ layout (location = 1) in vec3 aNormal;
 layout (location = 2) in vec2 aTexCoords;
 layout (location = 3) in vec3 tangent;
 
+//per instance data when the board pieces are drawn together (Instance in Mesh.h)
+layout (location = 5) in mat4 instanceModel;
+layout (location = 9) in vec4 instanceOverrideColor;
+layout (location = 10) in vec4 instanceEffect;
+layout (location = 11) in mat3 instanceNormal;
+
 out vec3 FragPos;
 out vec3 Normal;
 out vec2 TexCoords;
+flat out vec4 InstanceOverrideColor;
+flat out vec4 InstanceEffect;
+
+//set once per frame for every model (GraphicsEngine::FrameUniforms)
+layout (std140) uniform Frame
+{
+    mat4 projection;
+    mat4 view;
+    vec4 viewPos;
+    vec4 lightPos;
+    vec4 lightColor;
+    float lightBrightness;
+    float lightDistance;
+    int enableLighting;
+};
 
 uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+//inverse transpose of the model matrix, worked out once on the CPU when the asset moves
+uniform mat3 normalMatrix;
+uniform bool instanced = false;
 
 void main()
 {
+    mat4 world = instanced ? instanceModel : model;
+    InstanceOverrideColor = instanceOverrideColor;
+    InstanceEffect = instanceEffect;
+
     TexCoords = aTexCoords;    
-    gl_Position = projection * view * model * vec4(aPos, 1.0);
+    gl_Position = projection * view * world * vec4(aPos, 1.0);
 
-    Normal = transpose(inverse(mat3(model))) * aNormal;
+    Normal = (instanced ? instanceNormal : normalMatrix) * aNormal;
 
-    FragPos = vec3(model * vec4(aPos, 1.0));
+    FragPos = vec3(world * vec4(aPos, 1.0));
 }
\ No newline at end of file
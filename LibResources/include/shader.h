@@ -5,6 +5,8 @@
 #include <glm/glm.hpp>
 
 #include <string>
+#include <vector>
+#include <unordered_map>
 #include <fstream>
 #include <sstream>
 #include <iostream>
@@ -100,6 +102,7 @@ public:
 		if (geometryPath != nullptr)
 			glDeleteShader(geometry);
 
+		cacheUniforms();
 	}
 	// activate the shader
 	
@@ -107,66 +110,165 @@ public:
 	{
 		glUseProgram(ID);
 	}
+
+	// index of a uniform in the location cache, look it up once and set it by index every frame.
+	// names the program doesn't have get an index too (location -1, so setting them does nothing like in GL)
+	int uniform(const std::string &name) const
+	{
+		auto it = uniformIndices.find(name);
+		if (it != uniformIndices.end())
+			return it->second;
+
+		int index = (int)uniformLocations.size();
+		uniformLocations.push_back(glGetUniformLocation(ID, name.c_str()));
+		uniformIndices[name] = index;
+		return index;
+	}
+
+	// cached location of a uniform
+	GLint location(const std::string &name) const
+	{
+		return uniformLocations[uniform(name)];
+	}
+
+	// use the uniform block with this name from the buffer bound to a binding point
+	void bindUniformBlock(const std::string &name, unsigned int binding) const
+	{
+		unsigned int block = glGetUniformBlockIndex(ID, name.c_str());
+		if (block != GL_INVALID_INDEX)
+			glUniformBlockBinding(ID, block, binding);
+	}
+
 	// utility uniform functions
 	
 	void setBool(const std::string &name, bool value) const
 	{
-		glUniform1i(glGetUniformLocation(ID, name.c_str()), (int)value);
+		glUniform1i(location(name), (int)value);
 	}
 	
 	void setInt(const std::string &name, int value) const
 	{
-		glUniform1i(glGetUniformLocation(ID, name.c_str()), value);
+		glUniform1i(location(name), value);
 	}
 	
 	void setFloat(const std::string &name, float value) const
 	{
-		glUniform1f(glGetUniformLocation(ID, name.c_str()), value);
+		glUniform1f(location(name), value);
 	}
 	
 	void setVec2(const std::string &name, const glm::vec2 &value) const
 	{
-		glUniform2fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+		glUniform2fv(location(name), 1, &value[0]);
 	}
 	void setVec2(const std::string &name, float x, float y) const
 	{
-		glUniform2f(glGetUniformLocation(ID, name.c_str()), x, y);
+		glUniform2f(location(name), x, y);
 	}
 	
 	void setVec3(const std::string &name, const glm::vec3 &value) const
 	{
-		glUniform3fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+		glUniform3fv(location(name), 1, &value[0]);
 	}
 	void setVec3(const std::string &name, float x, float y, float z) const
 	{
-		glUniform3f(glGetUniformLocation(ID, name.c_str()), x, y, z);
+		glUniform3f(location(name), x, y, z);
 	}
 	
 	void setVec4(const std::string &name, const glm::vec4 &value) const
 	{
-		glUniform4fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+		glUniform4fv(location(name), 1, &value[0]);
 	}
 	void setVec4(const std::string &name, float x, float y, float z, float w)
 	{
-		glUniform4f(glGetUniformLocation(ID, name.c_str()), x, y, z, w);
+		glUniform4f(location(name), x, y, z, w);
 	}
 	
 	void setMat2(const std::string &name, const glm::mat2 &mat) const
 	{
-		glUniformMatrix2fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+		glUniformMatrix2fv(location(name), 1, GL_FALSE, &mat[0][0]);
 	}
 	
 	void setMat3(const std::string &name, const glm::mat3 &mat) const
 	{
-		glUniformMatrix3fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+		glUniformMatrix3fv(location(name), 1, GL_FALSE, &mat[0][0]);
 	}
 	
 	void setMat4(const std::string &name, const glm::mat4 &mat) const
 	{
-		glUniformMatrix4fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+		glUniformMatrix4fv(location(name), 1, GL_FALSE, &mat[0][0]);
+	}
+
+	// the same by index from uniform(), no string hashing
+	void setBool(int uniform, bool value) const
+	{
+		glUniform1i(uniformLocations[uniform], (int)value);
+	}
+
+	void setInt(int uniform, int value) const
+	{
+		glUniform1i(uniformLocations[uniform], value);
+	}
+
+	void setFloat(int uniform, float value) const
+	{
+		glUniform1f(uniformLocations[uniform], value);
+	}
+
+	void setVec3(int uniform, const glm::vec3 &value) const
+	{
+		glUniform3fv(uniformLocations[uniform], 1, &value[0]);
+	}
+
+	void setVec4(int uniform, const glm::vec4 &value) const
+	{
+		glUniform4fv(uniformLocations[uniform], 1, &value[0]);
+	}
+
+	void setMat3(int uniform, const glm::mat3 &mat) const
+	{
+		glUniformMatrix3fv(uniformLocations[uniform], 1, GL_FALSE, &mat[0][0]);
+	}
+
+	void setMat4(int uniform, const glm::mat4 &mat) const
+	{
+		glUniformMatrix4fv(uniformLocations[uniform], 1, GL_FALSE, &mat[0][0]);
 	}
 
 private:
+	// locations by the index uniform() hands out
+	mutable std::vector<GLint> uniformLocations;
+	mutable std::unordered_map<std::string, int> uniformIndices;
+
+	// look up every active uniform once after linking so drawing never asks GL for a location
+	void cacheUniforms()
+	{
+		uniformLocations.clear();
+		uniformIndices.clear();
+
+		GLint count = 0;
+		glGetProgramiv(ID, GL_ACTIVE_UNIFORMS, &count);
+		for (GLint i = 0; i < count; i++)
+		{
+			GLchar name[256];
+			GLsizei length = 0;
+			GLint size = 0;
+			GLenum type = 0;
+			glGetActiveUniform(ID, (GLuint)i, sizeof(name), &length, &size, &type, name);
+
+			// uniform block members have no location of their own
+			std::string uniformName(name, length);
+			GLint uniformLocation = glGetUniformLocation(ID, uniformName.c_str());
+			if (uniformLocation < 0)
+				continue;
+
+			// arrays are listed as name[0], they are set by the plain name too
+			if (uniformName.size() > 3 && uniformName.compare(uniformName.size() - 3, 3, "[0]") == 0)
+				uniformIndices[uniformName.substr(0, uniformName.size() - 3)] = (int)uniformLocations.size();
+			uniformIndices[uniformName] = (int)uniformLocations.size();
+			uniformLocations.push_back(uniformLocation);
+		}
+	}
+
 	// utility function for checking shader compilation/linking errors.
 	
 	void checkCompileErrors(GLuint shader, std::string type)